@@ -33,14 +33,17 @@ uniform vec2 contourLineFboTransformation; // Transformation from elevation to n
 uniform mat4 kinectWorldMatrix; // Transformation from kinect image space to kinect world space
 uniform mat4 kinectProjMatrix; // Transformation from kinect world space to proj image space
 uniform vec4 basePlaneEq; // Base plane equation
+uniform vec4 meshROI; // Grid offset (xy) and last vertex position (zw) in depth image space
 
 void main()
 {
     vec4 position = gl_Vertex;
-    vec2 texcoord = gl_MultiTexCoord0.xy;
     // copy position so we can work with it.
     vec4 pos = position;
-    vec2 varyingtexcoord = pos.xy;//texcoord;
+    
+    /* Place the grid vertex in the ROI, vertices past the ROI collapse on its border: */
+    pos.xy = min(pos.xy+meshROI.xy, meshROI.zw);
+    vec2 varyingtexcoord = pos.xy;
     
     /* Set the vertex' depth image-space z coordinate from the texture: */
     vec4 texel0 = texture2DRect(tex0, varyingtexcoord);
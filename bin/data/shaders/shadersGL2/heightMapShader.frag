@@ -25,25 +25,47 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #version 120
 
 varying float depthfrag;
+varying float contourfrag;
+varying float shadefrag;
+varying float waterfrag;
+varying float riverfrag;
 
 uniform sampler2DRect heightColorMapSampler;
 uniform sampler2DRect pixelCornerElevationSampler; // Sampler for the half pixel texture
+uniform vec4 waterColor; // Color of the water, alpha is the opacity of deep water
+uniform vec4 riverColor; // Color of the rivers, alpha is the opacity of the largest ones
 uniform float contourLineFactor;
-uniform int drawContourLines;
+uniform int drawContourLines; // 0: none, 1: from the elevation fbo, 2: single pass from the interpolated elevation
 
 void main()
 {
     vec2 depthPos = vec2(depthfrag, 0.5);//depthvalue*texsize, 0.5);
     vec4 color =  texture2DRect(heightColorMapSampler, depthPos);	//colormap converted depth
+    color.rgb *= shadefrag;
+    color.rgb = mix(color.rgb, waterColor.rgb, waterfrag*waterColor.a);
+    color.rgb = mix(color.rgb, riverColor.rgb, riverfrag*riverColor.a);
 
-    if (drawContourLines == 1)
+    if (drawContourLines != 0)
     {
         // Contour line computation
-        /* Calculate the contour line interval containing each pixel corner by evaluating the half-pixel offset elevation texture: */
-        float corner0=floor(texture2DRect(pixelCornerElevationSampler,vec2(gl_FragCoord.x,gl_FragCoord.y)).r*contourLineFactor);
-        float corner1=floor(texture2DRect(pixelCornerElevationSampler,vec2(gl_FragCoord.x+1.0,gl_FragCoord.y)).r*contourLineFactor);
-        float corner2=floor(texture2DRect(pixelCornerElevationSampler,vec2(gl_FragCoord.x,gl_FragCoord.y+1.0)).r*contourLineFactor);
-        float corner3=floor(texture2DRect(pixelCornerElevationSampler,vec2(gl_FragCoord.x+1.0,gl_FragCoord.y+1.0)).r*contourLineFactor);
+        float corner0, corner1, corner2, corner3;
+        if (drawContourLines == 1)
+        {
+            /* Calculate the contour line interval containing each pixel corner by evaluating the half-pixel offset elevation texture: */
+            corner0=floor(texture2DRect(pixelCornerElevationSampler,vec2(gl_FragCoord.x,gl_FragCoord.y)).r*contourLineFactor);
+            corner1=floor(texture2DRect(pixelCornerElevationSampler,vec2(gl_FragCoord.x+1.0,gl_FragCoord.y)).r*contourLineFactor);
+            corner2=floor(texture2DRect(pixelCornerElevationSampler,vec2(gl_FragCoord.x,gl_FragCoord.y+1.0)).r*contourLineFactor);
+            corner3=floor(texture2DRect(pixelCornerElevationSampler,vec2(gl_FragCoord.x+1.0,gl_FragCoord.y+1.0)).r*contourLineFactor);
+        }
+        else
+        {
+            /* Extrapolate the pixel corners from the screen-space derivatives, clamped to the range of the elevation fbo: */
+            vec2 halfDerivatives = 0.5*vec2(dFdx(contourfrag), dFdy(contourfrag));
+            corner0=floor(clamp(contourfrag-halfDerivatives.x-halfDerivatives.y, 0.0, contourLineFactor));
+            corner1=floor(clamp(contourfrag+halfDerivatives.x-halfDerivatives.y, 0.0, contourLineFactor));
+            corner2=floor(clamp(contourfrag-halfDerivatives.x+halfDerivatives.y, 0.0, contourLineFactor));
+            corner3=floor(clamp(contourfrag+halfDerivatives.x+halfDerivatives.y, 0.0, contourLineFactor));
+        }
         
         /* Find all pixel edges that cross at least one contour line: */
         int edgeMask=0;
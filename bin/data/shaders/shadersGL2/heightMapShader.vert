@@ -25,6 +25,10 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #version 120
 
 varying float depthfrag;
+varying float contourfrag; // Contour line interval coordinate (single pass contour lines)
+varying float shadefrag; // Hillshading factor applied to the height map color
+varying float waterfrag; // Water depth relative to the fully colored depth
+varying float riverfrag; // River opacity, 0 outside of the rivers
 
 uniform sampler2DRect tex0; // Sampler for the depth image-space elevation texture automatically set by binding
 
@@ -33,16 +37,28 @@ uniform mat4 kinectWorldMatrix; // Transformation from kinect image space to kin
 uniform vec2 heightColorMapTransformation; // Transformation from elevation to height color map texture coordinate factor and offset
 uniform vec2 depthTransformation; // Normalisation factor and offset applied by openframeworks
 uniform vec4 basePlaneEq; // Base plane equation
+uniform vec4 meshROI; // Grid offset (xy) and last vertex position (zw) in depth image space
+uniform vec2 contourLineTransformation; // Transformation from elevation to contour line interval factor and offset
+uniform sampler2DRect normalsSampler; // Sampler for the packed depth image-space surface normals
+uniform int useHillshading;
+uniform vec3 lightDirection; // Direction toward the light in depth image space
+uniform float hillshadingStrength;
+uniform sampler2DRect waterDepthSampler; // Sampler for the depth image-space water depth
+uniform int useWater;
+uniform sampler2DRect riverSampler; // Sampler for the depth image-space river network
+uniform int useRivers;
 
 void main()
 {
     vec4 position =gl_Vertex;
-    vec2 texcoord = gl_MultiTexCoord0.xy;
     // copy position so we can work with it.
     vec4 pos = position;
+    
+    /* Place the grid vertex in the ROI, vertices past the ROI collapse on its border: */
+    pos.xy = min(pos.xy+meshROI.xy, meshROI.zw);
 
     /* Set the vertex' depth image-space z coordinate from the texture: */
-    vec4 texel0 = texture2DRect(tex0, texcoord);
+    vec4 texel0 = texture2DRect(tex0, pos.xy);
     float depth1 = texel0.r;
     float depth = depth1 * depthTransformation.x + depthTransformation.y;
 
@@ -57,6 +73,25 @@ void main()
     /* Transform elevation to height color map texture coordinate: */
     float elevation = dot(basePlaneEq,vertexCcx);///vertexCc.w;
     depthfrag = elevation*heightColorMapTransformation.x+heightColorMapTransformation.y;
+    contourfrag = elevation*contourLineTransformation.x+contourLineTransformation.y;
+    
+    /* Lambertian shading, relative to a flat surface so that the colors are kept on flat sand: */
+    shadefrag = 1.0;
+    if (useHillshading == 1)
+    {
+        vec3 surfaceNormal = texture2DRect(normalsSampler, pos.xy).rgb*2.0-1.0;
+        shadefrag = max(1.0+hillshadingStrength*(dot(surfaceNormal, lightDirection)-lightDirection.z), 0.0);
+    }
+    
+    /* Water depth of the simulation layer: */
+    waterfrag = 0.0;
+    if (useWater == 1)
+        waterfrag = texture2DRect(waterDepthSampler, pos.xy).r;
+    
+    /* Rivers of the flow accumulation: */
+    riverfrag = 0.0;
+    if (useRivers == 1)
+        riverfrag = texture2DRect(riverSampler, pos.xy).r;
     
     /* Transform vertex to proj coordinates: */
     vec4 screenPos = kinectProjMatrix * vertexCcx;
@@ -0,0 +1,52 @@
+/***********************************************************************
+AgentRandom - AgentRandom is a small seeded random number generator,
+one stream per agent.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <stdint.h>
+
+// SplitMix64: 8 bytes of state, and the stream of an agent only depends on
+// the simulation seed and the agent number, not on the other agents nor on
+// the order in which the agents are updated.
+class AgentRandom {
+public:
+    AgentRandom(uint64_t seed = 0, uint64_t stream = 0){
+        setSeed(seed, stream);
+    }
+
+    void setSeed(uint64_t seed, uint64_t stream){
+        state = seed;
+        state = next()^(stream*0xD1B54A32D192ED03ULL);
+    }
+    uint64_t next(){
+        state += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = state;
+        z = (z^(z >> 30))*0xBF58476D1CE4E5B9ULL;
+        z = (z^(z >> 27))*0x94D049BB133111EBULL;
+        return z^(z >> 31);
+    }
+    float uniform(float min, float max){ // In [min, max)
+        return min+(max-min)*((next() >> 40)*(1.0f/16777216.0f));
+    }
+
+private:
+    uint64_t state;
+};
@@ -0,0 +1,488 @@
+/***********************************************************************
+FishSchool - FishSchool moves and draws all the fish of the sandbox at
+once, with one array per attribute and one pass per behaviour.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "FishSchool.h"
+
+namespace {
+    // Fish scale (projector pixels)
+    const float sc = 7;
+    const float tailSize = 1*sc;
+    const float fishLength = 2*sc;
+    const float fishHead = tailSize;
+    const int eyeSegments = 6;
+    const int outlineResolution = 4; // Segments per curve of the body outline
+
+    // Scales (dx, dy) down to a length of at most maxLength
+    inline void limit(float & dx, float & dy, float maxLength){
+        float lengthSquared = dx*dx+dy*dy;
+        float scale = lengthSquared > maxLength*maxLength ? maxLength/sqrt(lengthSquared) : 1;
+        dx *= scale;
+        dy *= scale;
+    }
+}
+
+FishSchool::FishSchool()
+:navigationField(NULL),
+numThreads(1),
+minborderDist(50),
+wanderR(10),
+wanderD(80),
+change(0.3),
+maxVelocityChange(1),
+maxRotation(30),
+topSpeed(2),
+desiredseparation(24),
+neighbourDist(48),
+seed(0),
+nextSerial(0),
+stepSeekMother(false),
+shore(NULL),
+gridDirty(true)
+{
+}
+
+FishSchool::~FishSchool(){
+    if (stepThread.joinable())
+        stepThread.join();
+}
+
+void FishSchool::setup(int width, int height, ofRectangle sborders, int snumThreads){
+    numThreads = snumThreads > 0 ? snumThreads : max(1u, std::thread::hardware_concurrency());
+    setBorders(sborders);
+    buildOutline();
+    grid.setup(width, height, desiredseparation);
+}
+
+void FishSchool::setSeed(uint64_t sseed){
+    finishStep();
+    seed = sseed;
+    nextSerial = 0;
+    ofLogVerbose("FishSchool") << "setSeed(): " << seed;
+}
+
+void FishSchool::setBorders(ofRectangle sborders){
+    finishStep();
+    borders = sborders;
+    internalBorders = borders;
+    internalBorders.scaleFromCenter((borders.width-minborderDist)/borders.width, (borders.height-minborderDist)/borders.height);
+}
+
+void FishSchool::buildOutline(){
+    // Curved body with a few segments per curve, the moving tail is drawn with straight lines
+    ofPolyline body;
+    body.curveTo(ofPoint(-fishLength-tailSize, 0), outlineResolution);
+    body.curveTo(ofPoint(-fishLength, 0), outlineResolution);
+    body.curveTo(ofPoint(0, -fishHead), outlineResolution);
+    body.curveTo(ofPoint(fishHead, 0), outlineResolution);
+    body.curveTo(ofPoint(0, fishHead), outlineResolution);
+    body.curveTo(ofPoint(-fishLength, 0), outlineResolution);
+    body.curveTo(ofPoint(-fishLength-tailSize, 0), outlineResolution);
+    bodyOutline.clear();
+    for (auto & vertex : body.getVertices())
+        bodyOutline.push_back(ofVec2f(vertex.x, vertex.y));
+}
+
+void FishSchool::add(ofVec2f location){
+    finishStep();
+    x.push_back(location.x);
+    y.push_back(location.y);
+    vx.push_back(0);
+    vy.push_back(0);
+    angle.push_back(0);
+    wandertheta.push_back(0);
+    random.push_back(AgentRandom(seed, nextSerial++));
+    mother.push_back(0);
+    seekWeight.push_back(1);
+    bordersWeight.push_back(2);
+    slopesWeight.push_back(2);
+    wanderWeight.push_back(0.8);
+    separateWeight.push_back(1);
+    alignWeight.push_back(0.5);
+    cohesionWeight.push_back(0.5);
+    grid.clear(); // Its indices are stale
+    gridDirty = true;
+}
+
+void FishSchool::pop_back(){
+    finishStep();
+    for (auto array : {&x, &y, &vx, &vy, &angle, &wandertheta, &seekWeight, &bordersWeight, &slopesWeight, &wanderWeight,
+                       &separateWeight, &alignWeight, &cohesionWeight})
+        array->pop_back();
+    mother.pop_back();
+    random.pop_back();
+    grid.clear(); // Its indices are stale
+    gridDirty = true;
+}
+
+void FishSchool::clear(){
+    finishStep();
+    for (auto array : {&x, &y, &vx, &vy, &angle, &wandertheta, &seekWeight, &bordersWeight, &slopesWeight, &wanderWeight,
+                       &separateWeight, &alignWeight, &cohesionWeight})
+        array->clear();
+    mother.clear();
+    random.clear();
+    grid.clear(); // Its indices are stale
+    gridDirty = true;
+}
+
+void FishSchool::startStep(const ShoreDistanceField & sshore, bool seekMother){
+    finishStep();
+    int n = size();
+    for (auto array : {&nextX, &nextY, &nextVx, &nextVy, &nextAngle,
+                       &beach, &border, &seeking, &beachDist, &beachSlopeX, &beachSlopeY, &slopesX, &slopesY,
+                       &bordersX, &bordersY, &wanderX, &wanderY, &seekX, &seekY,
+                       &separateX, &separateY, &alignX, &alignY, &cohesionX, &cohesionY})
+        array->resize(n);
+    nextMother.resize(n);
+    if (n == 0)
+        return;
+
+    // Everything the bands share is ready before they start
+    stepSeekMother = seekMother;
+    shore = &sshore;
+    if (gridDirty)
+        grid.build(x, y);
+    stepThread = std::thread(&FishSchool::runStep, this);
+}
+
+void FishSchool::finishStep(){
+    if (!stepThread.joinable())
+        return;
+    stepThread.join();
+    std::swap(x, nextX);
+    std::swap(y, nextY);
+    std::swap(vx, nextVx);
+    std::swap(vy, nextVy);
+    std::swap(angle, nextAngle);
+    std::swap(mother, nextMother);
+    grid.build(x, y);
+    gridDirty = false;
+}
+
+void FishSchool::runStep(){
+    runInBands(size(), [this](int start, int end){
+        sampleTerrain(start, end);
+        slopesEffect(start, end);
+        bordersEffect(start, end);
+        wanderEffect(start, end);
+        flockEffect(start, end);
+        seekEffect(start, end);
+        integrate(start, end);
+    });
+}
+
+void FishSchool::runInBands(int size, std::function<void(int, int)> work){
+    // Each thread processes a band of fish
+    int numBands = max(1, min(numThreads, size));
+    vector<std::thread> workers;
+    for (int i = 1; i < numBands; i++)
+        workers.push_back(std::thread(work, i*size/numBands, (i+1)*size/numBands));
+    work(0, size/numBands);
+    for (auto & worker : workers)
+        worker.join();
+}
+
+void FishSchool::sampleTerrain(int start, int end){
+    // Distance to the shore inside of the water and direction away from the shore,
+    // the beach is near when the fish can reach it in less than 10 steps in any direction
+    int width = shore->getDistancePixels().getWidth();
+    int height = shore->getDistancePixels().getHeight();
+    for (int i = start; i < end; i++){
+        int ix = ofClamp(static_cast<int>(x[i]), 0, width-1);
+        int iy = ofClamp(static_cast<int>(y[i]), 0, height-1);
+        float shoreDistance = -shore->getDistance(ix, iy);
+        ofVec2f escapeDirection = -shore->getGradient(ix, iy);
+        float speed = sqrt(vx[i]*vx[i]+vy[i]*vy[i]);
+        bool nearBeach = shoreDistance < 0 || shoreDistance < 9*speed;
+        beach[i] = nearBeach;
+        beachDist[i] = nearBeach && shoreDistance > 0 ? 1+shoreDistance/speed : 1; // In steps
+        beachSlopeX[i] = nearBeach ? escapeDirection.x : 0;
+        beachSlopeY[i] = nearBeach ? escapeDirection.y : 0;
+    }
+}
+
+void FishSchool::slopesEffect(int start, int end){
+    // The closest the beach is, the more we want to avoid it
+    for (int i = start; i < end; i++){
+        float length = sqrt(beachSlopeX[i]*beachSlopeX[i]+beachSlopeY[i]*beachSlopeY[i]);
+        float scale = length > 0 ? topSpeed/(length*beachDist[i]) : 0;
+        float dx = beachSlopeX[i]*scale-vx[i];
+        float dy = beachSlopeY[i]*scale-vy[i];
+        limit(dx, dy, maxVelocityChange);
+        slopesX[i] = dx;
+        slopesY[i] = dy;
+    }
+}
+
+void FishSchool::bordersEffect(int start, int end){
+    // Predict location 10 (arbitrary choice) frames ahead and go to the opposite direction
+    float left = internalBorders.getLeft();
+    float right = internalBorders.getRight();
+    float top = internalBorders.getTop();
+    float bottom = internalBorders.getBottom();
+    for (int i = start; i < end; i++){
+        float futureX = x[i]+vx[i]*10;
+        float futureY = y[i]+vy[i]*10;
+        float targetX = futureX < left ? borders.getRight() : futureX > right ? borders.getLeft() : x[i];
+        float targetY = futureY < top ? borders.getBottom() : futureY > bottom ? borders.getTop() : y[i];
+        border[i] = !(futureX > left && futureX < right && futureY > top && futureY < bottom);
+        float desiredX = targetX-x[i];
+        float desiredY = targetY-y[i];
+        float length = sqrt(desiredX*desiredX+desiredY*desiredY);
+        float scale = length > 0 ? topSpeed/length : 0;
+        float dx = desiredX*scale-vx[i];
+        float dy = desiredY*scale-vy[i];
+        limit(dx, dy, maxVelocityChange);
+        bordersX[i] = dx;
+        bordersY[i] = dy;
+    }
+}
+
+void FishSchool::wanderEffect(int start, int end){
+    for (int i = start; i < end; i++){
+        wandertheta[i] += random[i].uniform(-change, change); // Randomly change wander theta
+        // Target on the wander circle in front of the fish, offset from its heading
+        float speed = sqrt(vx[i]*vx[i]+vy[i]*vy[i]);
+        float frontScale = speed > 0 ? wanderD/speed : 0;
+        float frontX = vx[i]*frontScale;
+        float frontY = vy[i]*frontScale;
+        float heading = atan2(frontY, frontX);
+        float desiredX = frontX+wanderR*cos(wandertheta[i]+heading);
+        float desiredY = frontY+wanderR*sin(wandertheta[i]+heading);
+        float length = sqrt(desiredX*desiredX+desiredY*desiredY);
+        float scale = length > 0 ? topSpeed/length : 0;
+        float dx = desiredX*scale-vx[i];
+        float dy = desiredY*scale-vy[i];
+        limit(dx, dy, maxVelocityChange);
+        wanderX[i] = dx;
+        wanderY[i] = dy;
+    }
+}
+
+void FishSchool::seekEffect(int start, int end){
+    for (int i = start; i < end; i++){
+        nextMother[i] = mother[i];
+        if (!stepSeekMother){
+            seekX[i] = 0;
+            seekY[i] = 0;
+            seeking[i] = 0;
+            continue;
+        }
+        float desiredX = motherLocation.x-x[i];
+        float desiredY = motherLocation.y-y[i];
+        float d = sqrt(desiredX*desiredX+desiredY*desiredY);
+        // Around the islands and along the channels dug to the mother, from anywhere she can be reached
+        bool navigating = d >= 10 && navigationField != NULL && navigationField->isReachable(x[i], y[i]);
+        if (navigating){
+            ofVec2f direction = navigationField->getDirection(x[i], y[i]);
+            desiredX = direction.x;
+            desiredY = direction.y;
+        }
+        float length = sqrt(desiredX*desiredX+desiredY*desiredY);
+        float speed = topSpeed;
+        if (d < 10){ // Slow down close to the mother
+            speed = ofMap(d, 0, 100, 0, topSpeed);
+            nextMother[i] = 1;
+        }
+        float scale = length > 0 ? speed/length : 0;
+        float dx = desiredX*scale-vx[i];
+        float dy = desiredY*scale-vy[i];
+        limit(dx, dy, maxVelocityChange);
+        if (d > 100 && !navigating){ // We don't see the mother
+            dx = 0;
+            dy = 0;
+        }
+        seekX[i] = dx;
+        seekY[i] = dy;
+        seeking[i] = dx*dx+dy*dy != 0;
+    }
+}
+
+void FishSchool::flockEffect(int start, int end){
+    // Steer away from the fish that are too close, along with the neighbours and toward their center
+    for (int i = start; i < end; i++){
+        float awayX = 0, awayY = 0;
+        float headingX = 0, headingY = 0;
+        float centerX = 0, centerY = 0;
+        int tooClose = 0, neighbours = 0;
+        grid.forEachCandidate(x[i], y[i], neighbourDist, [&](int j){
+            float dx = x[i]-x[j];
+            float dy = y[i]-y[j];
+            float distanceSquared = dx*dx+dy*dy;
+            if (j == i || distanceSquared >= neighbourDist*neighbourDist)
+                return;
+            headingX += vx[j];
+            headingY += vy[j];
+            centerX += x[j];
+            centerY += y[j];
+            neighbours++;
+            if (distanceSquared > 0 && distanceSquared < desiredseparation*desiredseparation){
+                awayX += dx/distanceSquared; // Normalized, divided by the distance
+                awayY += dy/distanceSquared;
+                tooClose++;
+            }
+        });
+        auto steer = [&](float desiredX, float desiredY, float & outX, float & outY){
+            float length = sqrt(desiredX*desiredX+desiredY*desiredY);
+            if (length == 0){
+                outX = 0;
+                outY = 0;
+                return;
+            }
+            outX = desiredX*topSpeed/length-vx[i];
+            outY = desiredY*topSpeed/length-vy[i];
+            limit(outX, outY, maxVelocityChange);
+        };
+        steer(awayX, awayY, separateX[i], separateY[i]);
+        steer(headingX, headingY, alignX[i], alignY[i]);
+        if (neighbours > 0)
+            steer(centerX/neighbours-x[i], centerY/neighbours-y[i], cohesionX[i], cohesionY[i]);
+        else
+            steer(0, 0, cohesionX[i], cohesionY[i]);
+    }
+}
+
+void FishSchool::integrate(int start, int end){
+    // Sum of the weighted behaviours: away from the beach and the borders, toward the mother or wandering, flocking
+    for (int i = start; i < end; i++){
+        float dx = beach[i]*slopesWeight[i]*slopesX[i]+border[i]*bordersWeight[i]*bordersX[i]
+            +seeking[i]*seekWeight[i]*seekX[i]+(1-seeking[i])*wanderWeight[i]*wanderX[i]
+            +separateWeight[i]*separateX[i]+alignWeight[i]*alignX[i]+cohesionWeight[i]*cohesionX[i];
+        float dy = beach[i]*slopesWeight[i]*slopesY[i]+border[i]*bordersWeight[i]*bordersY[i]
+            +seeking[i]*seekWeight[i]*seekY[i]+(1-seeking[i])*wanderWeight[i]*wanderY[i]
+            +separateWeight[i]*separateY[i]+alignWeight[i]*alignY[i]+cohesionWeight[i]*cohesionY[i];
+        if (nextMother[i] && vx[i] == 0 && vy[i] == 0){ // Arrived
+            nextX[i] = x[i];
+            nextY[i] = y[i];
+            nextVx[i] = 0;
+            nextVy[i] = 0;
+            nextAngle[i] = angle[i];
+            continue;
+        }
+        float newVx = vx[i]+dx;
+        float newVy = vy[i]+dy;
+        limit(newVx, newVy, topSpeed);
+        nextVx[i] = newVx;
+        nextVy[i] = newVy;
+        nextX[i] = x[i]+newVx;
+        nextY[i] = y[i]+newVy;
+
+        float desiredAngle = ofRadToDeg(atan2(newVy, newVx));
+        float angleChange = desiredAngle-angle[i];
+        angleChange += (angleChange > 180) ? -360 : (angleChange < -180) ? 360 : 0; // The difference between -180 and 180 is 0 and not 360
+        angleChange *= sqrt(newVx*newVx+newVy*newVy)/topSpeed;
+        nextAngle[i] = angle[i]+ofClamp(angleChange, -maxRotation, maxRotation);
+    }
+}
+
+uint64_t FishSchool::getStateHash() const{
+    // FNV-1a over the bytes of the arrays
+    uint64_t hash = 14695981039346656037ULL;
+    auto addBytes = [&](const void* data, size_t size){
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t k = 0; k < size; k++)
+            hash = (hash^bytes[k])*1099511628211ULL;
+    };
+    for (auto array : {&x, &y, &vx, &vy, &angle, &wandertheta})
+        addBytes(array->data(), array->size()*sizeof(float));
+    addBytes(mother.data(), mother.size());
+    addBytes(random.data(), random.size()*sizeof(AgentRandom));
+    return hash;
+}
+
+void FishSchool::draw(std::function<ofVec2f(float, float)> kinectToProj){
+    linesMesh.clear();
+    linesMesh.setMode(OF_PRIMITIVE_LINES);
+    fillMesh.clear();
+    fillMesh.setMode(OF_PRIMITIVE_TRIANGLES);
+
+    // The fish that found their mother are filled and have a rainbow eye
+    float time = ofGetElapsedTimef();
+    float hsb = 255.0/50*abs(((int)(time*50) % 100)-50);
+    ofColor rainbow;
+    rainbow.setHsb(255-(int)hsb, 255, 255);
+    ofFloatColor white(1, 1, 1, 1);
+    ofFloatColor eyeColor(rainbow);
+
+    vector<ofVec3f> body(bodyOutline.size()), tail(3), eye(eyeSegments);
+    int n = size();
+    for (int i = 0; i < n; i++){
+        ofVec2f position = kinectToProj(x[i], y[i]);
+        float heading = ofDegToRad(angle[i]);
+        float c = cos(heading);
+        float s = sin(heading);
+        auto toProj = [&](const ofVec2f & p){
+            return ofVec3f(position.x+c*p.x-s*p.y, position.y+s*p.x+c*p.y, 0);
+        };
+
+        // Tail movement, faster with the speed
+        float fact = 50+250*sqrt(vx[i]*vx[i]+vy[i]*vy[i])/topSpeed;
+        float tailangle = 0.5/25*(abs(((int)(time*fact) % 100)-50)-25);
+        ofVec3f tailBase = toProj(ofVec2f(-fishLength, 0));
+        ofVec3f tailTip1 = toProj(ofVec2f(-fishLength-tailSize*cos(tailangle+0.8), tailSize*sin(tailangle+0.8)));
+        ofVec3f tailTip2 = toProj(ofVec2f(-fishLength-tailSize*cos(tailangle-0.8), tailSize*sin(tailangle-0.8)));
+        ofVec3f center = toProj(ofVec2f(0, 0));
+
+        for (int k = 0; k < bodyOutline.size(); k++)
+            body[k] = toProj(bodyOutline[k]);
+        tail[0] = tailTip1;
+        tail[1] = tailBase;
+        tail[2] = tailTip2;
+        for (int k = 0; k < eyeSegments; k++){
+            float a = 2*PI*k/eyeSegments;
+            eye[k] = toProj(ofVec2f(sc*0.5*cos(a), sc*0.5*sin(a)));
+        }
+
+        auto addOutline = [&](const vector<ofVec3f> & points, const ofFloatColor & color){
+            for (int k = 0; k < points.size(); k++){
+                linesMesh.addVertex(points[k]);
+                linesMesh.addVertex(points[(k+1) % points.size()]);
+                linesMesh.addColor(color);
+                linesMesh.addColor(color);
+            }
+        };
+        auto addFan = [&](const ofVec3f & origin, const vector<ofVec3f> & points, const ofFloatColor & color){
+            for (int k = 0; k < points.size(); k++){
+                fillMesh.addVertex(origin);
+                fillMesh.addVertex(points[k]);
+                fillMesh.addVertex(points[(k+1) % points.size()]);
+                for (int v = 0; v < 3; v++)
+                    fillMesh.addColor(color);
+            }
+        };
+        addOutline(body, white);
+        addOutline(tail, white);
+        if (mother[i]){
+            addFan(center, body, white);
+            addFan(tailBase, tail, white);
+            addFan(center, eye, eyeColor);
+        } else {
+            addOutline(eye, white);
+        }
+    }
+
+    ofPushStyle();
+    ofSetLineWidth(2.0);
+    fillMesh.draw();
+    linesMesh.draw();
+    ofPopStyle();
+}
@@ -0,0 +1,152 @@
+/***********************************************************************
+FishSchool - FishSchool moves and draws all the fish of the sandbox at
+once, with one array per attribute and one pass per behaviour.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include "KinectProjector/ShoreDistanceField.h"
+#include "NavigationField.h"
+#include "SpatialHashGrid.h"
+#include "AgentRandom.h"
+#include <thread>
+
+// Structure of arrays: the positions, velocities, angles and behaviour
+// weights of the fish are contiguous arrays, and each steering behaviour
+// (slopes, borders, wander, seek, flocking) is a pass over the fish. The
+// passes that do not sample the terrain are branchless loops the compiler
+// can vectorize. The neighbours of a fish for flocking (separation,
+// alignment and cohesion) come from a grid rebuilt at each step, so the
+// cost stays linear in the number of fish.
+// A step runs in the background, in bands of fish, one per thread: it
+// reads the current state, the shore distance field and the navigation
+// field, which nobody changes until finishStep, and writes the next state.
+// Each fish draws its random numbers from its own stream, seeded with the
+// seed of the school and the number of the fish: a step only depends on the
+// previous state and on the terrain, not on the number of threads, so that
+// a recorded simulation can be replayed bit for bit.
+// The fish are drawn as a single line mesh, plus a triangle mesh for the
+// ones that found their mother.
+class FishSchool {
+public:
+    FishSchool();
+    ~FishSchool();
+
+    void setup(int width, int height, ofRectangle borders, int numThreads = 0); // Kinect image size
+    void setSeed(uint64_t seed); // Restarts the numbering of the fish added afterwards
+    void setBorders(ofRectangle borders);
+    void setMotherLocation(ofVec2f loc){
+        finishStep();
+        motherLocation = loc;
+    }
+    void setNavigationField(const NavigationField* field){
+        finishStep();
+        navigationField = field;
+    }
+
+    void add(ofVec2f location); // Kinect coordinates
+    void pop_back();
+    void clear();
+    size_t size() const {
+        return x.size();
+    }
+    bool empty() const {
+        return x.empty();
+    }
+    ofVec2f getLocation(int i) const {
+        return ofVec2f(x[i], y[i]);
+    }
+    ofVec2f getVelocity(int i) const {
+        return ofVec2f(vx[i], vy[i]);
+    }
+    bool foundMother(int i) const {
+        return mother[i] != 0;
+    }
+
+    // The terrain must not change between startStep and finishStep, the fish can be read and drawn
+    void startStep(const ShoreDistanceField & shore, bool seekMother);
+    void finishStep(); // Waits for the step and makes its state current
+    void step(const ShoreDistanceField & shore, bool seekMother){
+        startStep(shore, seekMother);
+        finishStep();
+    }
+    uint64_t getStateHash() const; // Of the bits of the current state, random streams included
+    void draw(std::function<ofVec2f(float, float)> kinectToProj); // In the projector window
+
+private:
+    void runStep();
+    void sampleTerrain(int start, int end);
+    void slopesEffect(int start, int end);
+    void bordersEffect(int start, int end);
+    void wanderEffect(int start, int end);
+    void seekEffect(int start, int end);
+    void flockEffect(int start, int end);
+    void integrate(int start, int end);
+    void runInBands(int size, std::function<void(int, int)> work);
+    void buildOutline();
+
+    const NavigationField* navigationField; // Shortest paths to the mother, NULL: straight line
+    int numThreads;
+
+    // Shared parameters
+    ofRectangle borders, internalBorders;
+    ofVec2f motherLocation;
+    int minborderDist;
+    float wanderR;          // Radius for our "wander circle"
+    float wanderD;          // Distance for our "wander circle"
+    float change;
+    float maxVelocityChange;
+    float maxRotation;
+    float topSpeed;
+    float desiredseparation;
+    float neighbourDist; // Alignment and cohesion
+
+    // State, one entry per fish, current and next
+    vector<float> x, y, nextX, nextY;
+    vector<float> vx, vy, nextVx, nextVy;
+    vector<float> angle, nextAngle; // Direction of the drawing (degrees)
+    vector<unsigned char> mother, nextMother;
+    vector<float> wandertheta; // Only read by its own fish
+    vector<AgentRandom> random; // Only drawn by its own fish
+    uint64_t seed;
+    uint64_t nextSerial; // Random stream of the next fish added
+    vector<float> seekWeight, bordersWeight, slopesWeight, wanderWeight;
+    vector<float> separateWeight, alignWeight, cohesionWeight;
+
+    // Behaviours of the current step, one entry per fish (masks are 0 or 1)
+    std::thread stepThread;
+    bool stepSeekMother;
+    const ShoreDistanceField* shore;
+    vector<float> beach, border, seeking;
+    vector<float> beachDist, beachSlopeX, beachSlopeY;
+    vector<float> slopesX, slopesY;
+    vector<float> bordersX, bordersY;
+    vector<float> wanderX, wanderY;
+    vector<float> seekX, seekY;
+    vector<float> separateX, separateY;
+    vector<float> alignX, alignY;
+    vector<float> cohesionX, cohesionY;
+    SpatialHashGrid grid; // Cells of desiredseparation, current state
+    bool gridDirty; // Fish added or removed since the grid was built, it is empty until rebuilt
+
+    // Drawing
+    vector<ofVec2f> bodyOutline; // Fish coordinates, closed
+    ofVboMesh linesMesh, fillMesh;
+};
@@ -0,0 +1,133 @@
+/***********************************************************************
+DepthCorrection - DepthCorrection learns a per-pixel linear correction
+of the kinect depth from several flat surface acquisitions.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DepthCorrection.h"
+
+DepthCorrection::DepthCorrection()
+:width(0),
+height(0),
+valid(false),
+numAcquisitions(0),
+maxGainDeviation(0.25),
+maxOffset(200)
+{
+}
+
+void DepthCorrection::setup(int swidth, int sheight){
+    width = swidth;
+    height = sheight;
+    gains.assign(width*height, 1);
+    offsets.assign(width*height, 0);
+    valid = false;
+    clearSamples();
+}
+
+void DepthCorrection::clearSamples(){
+    sumM.assign(width*height, 0);
+    sumE.assign(width*height, 0);
+    sumMM.assign(width*height, 0);
+    sumME.assign(width*height, 0);
+    numSamples.assign(width*height, 0);
+    numAcquisitions = 0;
+}
+
+void DepthCorrection::addSample(int x, int y, float measured, float expected){
+    if (measured <= 0 || expected <= 0)
+        return;
+    int ind = y*width+x;
+    sumM[ind] += measured;
+    sumE[ind] += expected;
+    sumMM[ind] += measured*measured;
+    sumME[ind] += measured*expected;
+    numSamples[ind]++;
+}
+
+void DepthCorrection::endAcquisition(){
+    numAcquisitions++;
+}
+
+bool DepthCorrection::compute(){
+    if (numAcquisitions == 0)
+        return false;
+    int numCorrected = 0;
+    for (int i = 0; i < width*height; i++){
+        double n = numSamples[i];
+        float gain = 1;
+        float offset = 0;
+        if (n > 0){
+            double meanM = sumM[i]/n;
+            double meanE = sumE[i]/n;
+            double varM = sumMM[i]/n-meanM*meanM;
+            double covME = sumME[i]/n-meanM*meanE;
+            if (n >= 2 && varM > 1.0f) // Heights must be far enough apart to fit a gain
+                gain = ofClamp(covME/varM, 1-maxGainDeviation, 1+maxGainDeviation);
+            offset = ofClamp(meanE-gain*meanM, -maxOffset, maxOffset);
+            numCorrected++;
+        }
+        gains[i] = gain;
+        offsets[i] = offset;
+    }
+    ofLogVerbose("DepthCorrection") << "compute(): " << numCorrected << " pixels corrected from " << numAcquisitions << " acquisitions";
+    valid = numCorrected > 0;
+    return valid;
+}
+
+// File layout: "MSDC", width, height (int32) then for each pixel a
+// int16 gain ((gain-1)/maxGainDeviation*32767) and a int16 offset (1/16 mm)
+bool DepthCorrection::save(string path){
+    if (!valid)
+        return false;
+    vector<char> data(4+2*sizeof(int32_t)+width*height*2*sizeof(int16_t));
+    char* ptr = data.data();
+    memcpy(ptr, "MSDC", 4);
+    ptr += 4;
+    int32_t dims[2] = {width, height};
+    memcpy(ptr, dims, sizeof(dims));
+    ptr += sizeof(dims);
+    int16_t* valPtr = reinterpret_cast<int16_t*>(ptr);
+    for (int i = 0; i < width*height; i++){
+        *valPtr++ = static_cast<int16_t>(ofClamp((gains[i]-1)/maxGainDeviation*32767, -32767, 32767));
+        *valPtr++ = static_cast<int16_t>(ofClamp(offsets[i]*16, -32767, 32767));
+    }
+    ofBuffer buffer(data.data(), data.size());
+    return ofBufferToFile(path, buffer, true);
+}
+
+bool DepthCorrection::load(string path){
+    ofBuffer buffer = ofBufferFromFile(path, true);
+    size_t expectedSize = 4+2*sizeof(int32_t)+width*height*2*sizeof(int16_t);
+    if (buffer.size() != expectedSize || strncmp(buffer.getData(), "MSDC", 4) != 0)
+        return false;
+    const char* ptr = buffer.getData()+4;
+    int32_t dims[2];
+    memcpy(dims, ptr, sizeof(dims));
+    ptr += sizeof(dims);
+    if (dims[0] != width || dims[1] != height)
+        return false;
+    const int16_t* valPtr = reinterpret_cast<const int16_t*>(ptr);
+    for (int i = 0; i < width*height; i++){
+        gains[i] = 1+(*valPtr++)*maxGainDeviation/32767;
+        offsets[i] = (*valPtr++)/16.0f;
+    }
+    valid = true;
+    return true;
+}
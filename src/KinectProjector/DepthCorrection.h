@@ -0,0 +1,76 @@
+/***********************************************************************
+DepthCorrection - DepthCorrection learns a per-pixel linear correction
+of the kinect depth from several flat surface acquisitions.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+// corrected depth = gain * measured depth + offset, fitted for each pixel
+// in the least square sense over all the flat surface acquisitions.
+class DepthCorrection {
+public:
+    DepthCorrection();
+
+    void setup(int width, int height);
+
+    // Learning
+    void clearSamples();
+    void addSample(int x, int y, float measured, float expected); // expected: depth of the fitted plane at (x, y)
+    void endAcquisition(); // Call after adding all the samples of one flat surface
+    int getNumAcquisitions() const {
+        return numAcquisitions;
+    }
+    bool compute();
+
+    // Correction maps
+    bool isValid() const {
+        return valid;
+    }
+    const vector<float> & getGains() const {
+        return gains;
+    }
+    const vector<float> & getOffsets() const {
+        return offsets;
+    }
+    float correct(int x, int y, float measured) const {
+        int ind = y*width+x;
+        return gains[ind]*measured+offsets[ind];
+    }
+
+    // Maps are stored as 16-bit fixed point values in a binary file
+    bool load(string path);
+    bool save(string path);
+
+private:
+    int width, height;
+    bool valid;
+    int numAcquisitions;
+
+    // Per-pixel accumulators for the linear least square fit
+    vector<double> sumM, sumE, sumMM, sumME;
+    vector<unsigned short> numSamples;
+
+    vector<float> gains;
+    vector<float> offsets;
+
+    float maxGainDeviation; // Gains are clamped to 1 +/- maxGainDeviation
+    float maxOffset; // Offsets are clamped to +/- maxOffset mm
+};
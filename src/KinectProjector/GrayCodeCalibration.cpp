@@ -0,0 +1,208 @@
+/***********************************************************************
+GrayCodeCalibration - GrayCodeCalibration generates the structured-light
+Gray code patterns projected on the sand and decodes them from the
+kinect color stream to get dense projector-kinect correspondences.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "GrayCodeCalibration.h"
+#include <thread>
+
+GrayCodeCalibration::GrayCodeCalibration()
+:numColBits(0),
+numRowBits(0),
+numIgnoredBits(0),
+minContrast(20),
+minBitDifference(5)
+{
+}
+
+void GrayCodeCalibration::setup(ofVec2f sprojRes, ofVec2f skinectRes, int snumIgnoredBits){
+    projRes = sprojRes;
+    kinectRes = skinectRes;
+    numIgnoredBits = snumIgnoredBits;
+    numColBits = max(1, (int)ceil(log2(projRes.x))-numIgnoredBits);
+    numRowBits = max(1, (int)ceil(log2(projRes.y))-numIgnoredBits);
+    decodedMap.allocate(kinectRes.x, kinectRes.y, 2);
+    ofLogVerbose("GrayCodeCalibration") << "setup(): column bits: " << numColBits << " row bits: " << numRowBits << " patterns: " << getNumPatterns();
+    clearCaptures();
+}
+
+bool GrayCodeCalibration::patternValue(int index, int px, int py) const{
+    if (index == 0)
+        return true; // Full white
+    if (index == 1)
+        return false; // Full black
+    int bitPattern = (index-2)/2;
+    bool inverse = (index-2)%2 == 1;
+    unsigned int gray;
+    int bit;
+    if (bitPattern < numColBits){
+        gray = (px >> numIgnoredBits) ^ ((px >> numIgnoredBits) >> 1);
+        bit = numColBits-1-bitPattern;
+    } else {
+        gray = (py >> numIgnoredBits) ^ ((py >> numIgnoredBits) >> 1);
+        bit = numRowBits-1-(bitPattern-numColBits);
+    }
+    bool lit = (gray >> bit) & 1;
+    return inverse ? !lit : lit;
+}
+
+void GrayCodeCalibration::drawPattern(int index) const{
+    ofPushStyle();
+    ofFill();
+    ofBackground(index == 0 ? 255 : 0);
+    if (index >= 2){
+        // Stripes are drawn as rectangles: the pattern only depends on one coordinate
+        int bitPattern = (index-2)/2;
+        bool columns = bitPattern < numColBits;
+        int length = columns ? projRes.x : projRes.y;
+        int step = 1 << numIgnoredBits;
+        ofSetColor(255);
+        for (int i = 0; i < length; i += step){
+            bool lit = columns ? patternValue(index, i, 0) : patternValue(index, 0, i);
+            if (lit){
+                if (columns)
+                    ofDrawRectangle(i, 0, step, projRes.y);
+                else
+                    ofDrawRectangle(0, i, projRes.x, step);
+            }
+        }
+    }
+    ofPopStyle();
+}
+
+void GrayCodeCalibration::renderPattern(int index, ofPixels & pattern) const{
+    pattern.allocate(projRes.x, projRes.y, 1);
+    unsigned char* patternPtr = pattern.getData();
+    for (int y = 0; y < projRes.y; y++)
+        for (int x = 0; x < projRes.x; x++, patternPtr++)
+            *patternPtr = patternValue(index, x, y) ? 255 : 0;
+}
+
+void GrayCodeCalibration::clearCaptures(){
+    captures.clear();
+    correspondences.clear();
+}
+
+void GrayCodeCalibration::addCapture(const ofPixels & colorFrame){
+    ofPixels gray;
+    gray.allocate(colorFrame.getWidth(), colorFrame.getHeight(), 1);
+    int channels = colorFrame.getNumChannels();
+    const unsigned char* colorPtr = colorFrame.getData();
+    unsigned char* grayPtr = gray.getData();
+    int size = colorFrame.getWidth()*colorFrame.getHeight();
+    for (int i = 0; i < size; i++, colorPtr += channels, grayPtr++){
+        if (channels >= 3)
+            *grayPtr = (77*colorPtr[0]+150*colorPtr[1]+29*colorPtr[2]) >> 8; // Luminance
+        else
+            *grayPtr = *colorPtr;
+    }
+    captures.push_back(gray);
+}
+
+unsigned int GrayCodeCalibration::grayToBinary(unsigned int g){
+    for (unsigned int shift = 1; shift < 32; shift <<= 1)
+        g ^= g >> shift;
+    return g;
+}
+
+void GrayCodeCalibration::decodeRows(int startRow, int endRow){
+    int w = kinectRes.x;
+    const unsigned char* white = captures[0].getData();
+    const unsigned char* black = captures[1].getData();
+    float* mapPtr = decodedMap.getData()+2*startRow*w;
+    for (int y = startRow; y < endRow; y++){
+        for (int x = 0; x < w; x++, mapPtr += 2){
+            int ind = y*w+x;
+            mapPtr[0] = -1;
+            mapPtr[1] = -1;
+            if (white[ind]-black[ind] < minContrast)
+                continue; // Not lit by the projector (or shadowed)
+            unsigned int colGray = 0, rowGray = 0;
+            bool valid = true;
+            for (int b = 0; b < numColBits+numRowBits && valid; b++){
+                int p = captures[2+2*b][ind];
+                int n = captures[3+2*b][ind];
+                if (abs(p-n) < minBitDifference)
+                    valid = false; // Ambiguous bit, probably on a stripe border
+                unsigned int bit = p > n ? 1 : 0;
+                if (b < numColBits)
+                    colGray = (colGray << 1) | bit;
+                else
+                    rowGray = (rowGray << 1) | bit;
+            }
+            if (!valid)
+                continue;
+            int halfStep = (1 << numIgnoredBits)/2;
+            float px = (grayToBinary(colGray) << numIgnoredBits)+halfStep;
+            float py = (grayToBinary(rowGray) << numIgnoredBits)+halfStep;
+            if (px < projRes.x && py < projRes.y){
+                mapPtr[0] = px;
+                mapPtr[1] = py;
+            }
+        }
+    }
+}
+
+int GrayCodeCalibration::decode(int numThreads){
+    correspondences.clear();
+    if (!isComplete()){
+        ofLogError("GrayCodeCalibration") << "decode(): " << captures.size() << " captures for " << getNumPatterns() << " patterns";
+        return 0;
+    }
+    if (numThreads <= 0)
+        numThreads = max(1u, std::thread::hardware_concurrency());
+
+    // Each thread decodes a band of kinect rows
+    int h = kinectRes.y;
+    vector<std::thread> workers;
+    for (int i = 0; i < numThreads; i++){
+        int startRow = i*h/numThreads;
+        int endRow = (i+1)*h/numThreads;
+        workers.push_back(std::thread(&GrayCodeCalibration::decodeRows, this, startRow, endRow));
+    }
+    for (auto & worker : workers)
+        worker.join();
+
+    const float* mapPtr = decodedMap.getData();
+    for (int y = 0; y < kinectRes.y; y++)
+        for (int x = 0; x < kinectRes.x; x++, mapPtr += 2)
+            if (mapPtr[0] >= 0){
+                Correspondence c;
+                c.kinect = ofVec2f(x, y);
+                c.projector = ofVec2f(mapPtr[0], mapPtr[1]);
+                correspondences.push_back(c);
+            }
+    ofLogVerbose("GrayCodeCalibration") << "decode(): " << correspondences.size() << " kinect pixels decoded";
+    return correspondences.size();
+}
+
+void GrayCodeCalibration::renderSyntheticCapture(int index, std::function<ofVec2f(int, int)> kinectToProj, ofPixels & capture, float ambient, float gain) const{
+    capture.allocate(kinectRes.x, kinectRes.y, 1);
+    unsigned char* capturePtr = capture.getData();
+    for (int y = 0; y < kinectRes.y; y++)
+        for (int x = 0; x < kinectRes.x; x++, capturePtr++){
+            ofVec2f p = kinectToProj(x, y);
+            float val = ambient;
+            if (p.x >= 0 && p.x < projRes.x && p.y >= 0 && p.y < projRes.y && patternValue(index, p.x, p.y))
+                val += gain;
+            *capturePtr = ofClamp(val, 0, 255);
+        }
+}
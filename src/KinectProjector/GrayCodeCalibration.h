@@ -0,0 +1,95 @@
+/***********************************************************************
+GrayCodeCalibration - GrayCodeCalibration generates the structured-light
+Gray code patterns projected on the sand and decodes them from the
+kinect color stream to get dense projector-kinect correspondences.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+// Pattern sequence: full white, full black, then for each column bit and
+// each row bit (most significant first) the Gray code stripe pattern
+// followed by its inverse. Bits finer than what the kinect can resolve
+// are skipped (numIgnoredBits).
+class GrayCodeCalibration {
+public:
+    struct Correspondence {
+        ofVec2f kinect; // Kinect pixel coordinate
+        ofVec2f projector; // Decoded projector pixel coordinate
+    };
+
+    GrayCodeCalibration();
+
+    void setup(ofVec2f projRes, ofVec2f kinectRes, int numIgnoredBits = 2);
+
+    // Pattern generation
+    int getNumPatterns() const {
+        return 2+2*(numColBits+numRowBits);
+    }
+    void drawPattern(int index) const; // Draw pattern #index in the current fbo/window
+    void renderPattern(int index, ofPixels & pattern) const; // Render pattern #index in a grayscale image of projector size
+
+    // Acquisition
+    void clearCaptures();
+    void addCapture(const ofPixels & colorFrame); // Color or grayscale kinect frame showing the current pattern
+    int getNumCaptures() const {
+        return captures.size();
+    }
+    bool isComplete() const {
+        return captures.size() == getNumPatterns();
+    }
+
+    // Decoding (multi-threaded). Returns the number of decoded kinect pixels
+    int decode(int numThreads = 0);
+    const vector<Correspondence> & getCorrespondences() const {
+        return correspondences;
+    }
+    const ofFloatPixels & getDecodedMap() const { // 2 channels: projector x, y (-1 if undecoded)
+        return decodedMap;
+    }
+
+    // Decoding thresholds
+    void setMinContrast(float sminContrast){
+        minContrast = sminContrast;
+    }
+    void setMinBitDifference(float sminBitDifference){
+        minBitDifference = sminBitDifference;
+    }
+
+    // Synthetic render of what the kinect would see of pattern #index,
+    // kinectToProj giving the projector coordinate seen by each kinect pixel.
+    // Used to check the decoder offline without projector nor kinect.
+    void renderSyntheticCapture(int index, std::function<ofVec2f(int, int)> kinectToProj, ofPixels & capture, float ambient = 30, float gain = 180) const;
+
+private:
+    bool patternValue(int index, int px, int py) const; // true if projector pixel (px, py) is lit in pattern #index
+    void decodeRows(int startRow, int endRow);
+    static unsigned int grayToBinary(unsigned int g);
+
+    ofVec2f projRes, kinectRes;
+    int numColBits, numRowBits;
+    int numIgnoredBits;
+    float minContrast; // Minimal white-black difference to consider a kinect pixel lit by the projector
+    float minBitDifference; // Minimal pattern/inverse difference to trust a bit
+
+    vector<ofPixels> captures; // Grayscale kinect frames, one per pattern
+    ofFloatPixels decodedMap;
+    vector<Correspondence> correspondences;
+};
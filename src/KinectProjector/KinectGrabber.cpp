@@ -25,13 +25,26 @@ General Public License for more details.
 KinectGrabber::KinectGrabber()
 :newFrame(true),
 bufferInitiated(false),
-kinectOpened(false)
+numCapturedFrames(0),
+kinectOpened(false),
+applyDepthCorrection(false),
+computeNormals(false),
+pixelSize(1/580.0f), // Kinect focal length in pixels, updated when the kinect is opened
+parametersVersion(0),
+appliedParametersVersion(0),
+changedTileSize(32),
+changedTilesCols(0),
+changedTilesRows(0),
+filterStateSavePeriod(60),
+lastFilterStateSave(0)
 {
 }
 
 KinectGrabber::~KinectGrabber(){
     //    stop();
     waitForThread(true);
+    if (filterStateWriter.joinable())
+        filterStateWriter.join();
     //	waitForThread(true);
 }
 
@@ -59,6 +72,7 @@ bool KinectGrabber::setup(){
 
 	kinectDepthImage.allocate(width, height, 1);
     filteredframe.allocate(width, height, 1);
+    normalsframe.allocate(width, height, 3);
     kinectColorImage.allocate(width, height);
     kinectColorImage.setUseTexture(false);
 	return openKinect();
@@ -66,6 +80,8 @@ bool KinectGrabber::setup(){
 
 bool KinectGrabber::openKinect() {
 	kinectOpened = kinect.open();
+    if (kinectOpened)
+        pixelSize = kinect.getWorldCoordinateAt(1, 0, 1).x-kinect.getWorldCoordinateAt(0, 0, 1).x;
 	return kinectOpened;
 }
 void KinectGrabber::setupFramefilter(int sgradFieldresolution, float newMaxOffset, ofRectangle ROI, bool sspatialFilter, bool sfollowBigChange, int snumAveragingSlots) {
@@ -90,17 +106,42 @@ void KinectGrabber::setupFramefilter(int sgradFieldresolution, float newMaxOffse
     maxgradfield = 1000;
     initialValue = 4000;
     outsideROIValue = 3999;
-    minInitFrame = 60;
+    maxInitFrame = 300; // 10 s at 30 fps
+    minStableFraction = 0.8f;
+    maxChangeRate = 0.002f;
+    minConvergedFrames = 5;
     
     //Setup ROI
-    setKinectROI(ROI);
+    minX = static_cast<int>(ROI.getMinX());
+    maxX = static_cast<int>(ROI.getMaxX());
+    minY = static_cast<int>(ROI.getMinY());
+    maxY = static_cast<int>(ROI.getMaxY());
+    ROIwidth = maxX-minX;
+    ROIheight = maxY-minY;
+    
+    // Live parameters start from the current state
+    pendingParameters.numAveragingSlots = numAveragingSlots;
+    pendingParameters.followBigChange = followBigChange;
+    pendingParameters.spatialFilter = spatialFilter;
+    pendingParameters.computeNormals = computeNormals;
+    pendingParameters.maxOffset = maxOffset;
+    pendingParameters.gradFieldresolution = gradFieldresolution;
+    pendingParameters.ROI = ROI;
+    pendingParameters.minStableFraction = minStableFraction;
+    pendingParameters.maxChangeRate = maxChangeRate;
+    pendingParameters.minConvergedFrames = minConvergedFrames;
+    pendingParameters.maxInitFrame = maxInitFrame;
+    appliedParametersVersion = parametersVersion;
     
     //setting buffers
-	initiateBuffers();
+	resetBuffers();
 }
 
 void KinectGrabber::initiateBuffers(void){
 	filteredframe.set(0);
+    for(unsigned int y=0;y<height;++y)
+        for(unsigned int x=0;x<width;++x)
+            resetNormal(x, y);
 
     averagingBuffer=new float[numAveragingSlots*height*width];
     float* averagingBufferPtr=averagingBuffer;
@@ -127,15 +168,27 @@ void KinectGrabber::initiateBuffers(void){
             *vbPtr=initialValue;
     
     /* Initialize the gradient field buffer: */
-    gradField = new ofVec2f[gradFieldcols*gradFieldrows];
-    ofVec2f* gfPtr=gradField;
-    for(unsigned int y=0;y<gradFieldrows;++y)
-        for(unsigned int x=0;x<gradFieldcols;++x,++gfPtr)
-            *gfPtr=ofVec2f(0);
+    gradField.assign(gradFieldcols*gradFieldrows, ofVec2f(0));
+    
+    /* Initialize the changed tiles mask: */
+    changedTilesCols = (width+changedTileSize-1)/changedTileSize;
+    changedTilesRows = (height+changedTileSize-1)/changedTileSize;
+    changedTiles.assign(changedTilesCols*changedTilesRows, 0);
+    markAllTilesChanged();
     
     bufferInitiated = true;
     currentInitFrame = 0;
     firstImageReady = false;
+    resetConvergence();
+}
+
+void KinectGrabber::resetConvergence(void){
+    stableFraction = 0;
+    meanVariance = 0;
+    changeRate = 1;
+    convergedFrames = 0;
+    imageConverged = false;
+    stabilizationProgress = 0;
 }
 
 void KinectGrabber::resetBuffers(void){
@@ -144,7 +197,6 @@ void KinectGrabber::resetBuffers(void){
         delete[] averagingBuffer;
         delete[] statBuffer;
         delete[] validBuffer;
-        delete[] gradField;
     }
     initiateBuffers();
 }
@@ -158,18 +210,33 @@ void KinectGrabber::threadedFunction() {
         this->actions.clear();
         this->actionsLock.unlock();
         
+        if (parametersVersion != appliedParametersVersion){ // Cheap check of the parameter block
+            applyParameters();
+            markAllTilesChanged(); // ROI or spatial filter changes modify pixels outside the filter stability test
+        }
+        
         kinect.update();
         if(kinect.isFrameNew()){
+            numCapturedFrames++;
             kinectDepthImage = kinect.getRawDepthPixels();
             filter();
             filteredframe.setImageType(OF_IMAGE_GRAYSCALE);
             updateGradientField();
 			kinectColorImage.setFromPixels(kinect.getPixels());
+            if (filterStatePath != "" && firstImageReady && ofGetElapsedTimef()-lastFilterStateSave > filterStateSavePeriod){
+                saveFilterState(filterStatePath);
+                lastFilterStateSave = ofGetElapsedTimef();
+            }
         }
         if (storedframes == 0)
         {
+            changed.send(changedTiles); // Before the frame, so that it is available when the frame is received
+            frameNumber.send(numCapturedFrames);
+            std::fill(changedTiles.begin(), changedTiles.end(), 0);
             filtered.send(std::move(filteredframe));
-			gradient.send(std::move(gradField));
+            if (computeNormals)
+                normals.send(normalsframe); // Copied: the normals are only updated in the changed tiles
+			gradient.send(gradField);
             colored.send(std::move(kinectColorImage.getPixels()));
             lock();
             storedframes += 1;
@@ -177,11 +244,14 @@ void KinectGrabber::threadedFunction() {
         }
         
     }
+    if (filterStatePath != "" && firstImageReady) // Snapshot for the next start
+        saveFilterState(filterStatePath);
+    if (filterStateWriter.joinable())
+        filterStateWriter.join();
     kinect.close();
     delete[] averagingBuffer;
     delete[] statBuffer;
     delete[] validBuffer;
-    delete[] gradField;
 }
 
 void KinectGrabber::performInThread(std::function<void(KinectGrabber&)> action) {
@@ -205,6 +275,9 @@ void KinectGrabber::filter()
         statBufferPtr += minY*width*3;
         validBufferPtr += minY*width;
         filteredFramePtr += minY*width;
+        
+        int numValid = 0, numStable = 0, numChanged = 0;
+        float sumVariance = 0;
 
 		for(unsigned int y=minY ; y<maxY ; ++y)
         {
@@ -216,6 +289,8 @@ void KinectGrabber::filter()
             for(unsigned int x=minX ; x<maxX ; ++x,++inputFramePtr,++averagingBufferPtr,statBufferPtr+=3,++validBufferPtr,++filteredFramePtr)
             {
                 float newVal = static_cast<float>(*inputFramePtr);
+                if (applyDepthCorrection && newVal > 0) // Correct the kinect depth bias (multiply-add), 0 is no reading
+                    newVal = newVal*depthCorrectionGains[y*width+x]+depthCorrectionOffsets[y*width+x];
                 float oldVal = *averagingBufferPtr;
                 
 				if(newVal > maxOffset)//we are under the ceiling plane
@@ -248,16 +323,22 @@ void KinectGrabber::filter()
                         statBufferPtr[2] -= oldVal * oldVal; // Sum of squares of valid samples
                     }
                 }
+                if(statBufferPtr[0] >= minNumSamples)
+                    ++numValid;
                 // Check if the pixel is "stable": */
                 if(statBufferPtr[0] >= minNumSamples &&
                    statBufferPtr[2]*statBufferPtr[0] <= maxVariance*statBufferPtr[0]*statBufferPtr[0] + statBufferPtr[1]*statBufferPtr[1])
                 {
                     /* Check if the new running mean is outside the previous value's envelope: */
                     float newFiltered = statBufferPtr[1]/statBufferPtr[0];
+                    ++numStable;
+                    sumVariance += statBufferPtr[2]/statBufferPtr[0]-newFiltered*newFiltered;
                     if(abs(newFiltered-*validBufferPtr) >= hysteresis)
                     {
                         /* Set the output pixel value to the depth-corrected running mean: */
                         *filteredFramePtr = *validBufferPtr = newFiltered;
+                        ++numChanged;
+                        markTilesChanged(x, y);
                     } else {
                         /* Leave the pixel at its previous value: */
                         *filteredFramePtr = *validBufferPtr;
@@ -276,20 +357,48 @@ void KinectGrabber::filter()
         if(++averagingSlotIndex==numAveragingSlots)
             averagingSlotIndex=0;
         
-        if (!firstImageReady){
-            currentInitFrame++;
-            if(currentInitFrame > minInitFrame)
-                firstImageReady = true;
-        }
+        updateConvergence(numValid, numStable, numChanged, sumVariance);
         
-        /* Apply a spatial filter if requested: */
+        /* Apply a spatial filter if requested, the normals are computed by its last pass: */
         if(spatialFilter)
         {
             applySpaceFilter();
+        } else if (computeNormals)
+        {
+            updateNormals();
         }
 	}
 }
 
+void KinectGrabber::updateConvergence(int numValid, int numStable, int numChanged, float sumVariance)
+{
+    int numPixels = max(1, numValid);
+    stableFraction = static_cast<float>(numStable)/numPixels;
+    meanVariance = numStable > 0 ? sumVariance/numStable : 0;
+    changeRate = numValid > 0 ? static_cast<float>(numChanged)/numPixels : 1;
+    
+    /* The ROI is converged when most pixels are stable and the displayed values stopped moving: */
+    if (stableFraction >= minStableFraction && changeRate <= maxChangeRate)
+        convergedFrames++;
+    else
+        convergedFrames = 0;
+    imageConverged = convergedFrames >= minConvergedFrames;
+    stabilizationProgress = imageConverged ? 1 : 0.5f*min(1.0f, stableFraction/minStableFraction)
+                                                +0.5f*static_cast<float>(convergedFrames)/minConvergedFrames;
+    
+    if (!firstImageReady){
+        currentInitFrame++;
+        if (imageConverged){
+            firstImageReady = true;
+            ofLogVerbose("kinectGrabber") << "updateConvergence(): Image stabilized after " << currentInitFrame << " frames, stable pixels: " << stableFraction << " mean variance: " << meanVariance;
+        } else if (currentInitFrame >= maxInitFrame){
+            firstImageReady = true;
+            ofLogWarning("kinectGrabber") << "updateConvergence(): Image not converged after " << currentInitFrame << " frames (stable pixels: "
+                << stableFraction << ", changing pixels: " << changeRate << "), using it anyway";
+        }
+    }
+}
+
 void KinectGrabber::applySpaceFilter()
 {
     for(int filterPass=0;filterPass<2;++filterPass)
@@ -298,7 +407,7 @@ void KinectGrabber::applySpaceFilter()
         for(unsigned int x=minX;x<maxX;++x)
         {
             /* Get a pointer to the current column: */
-            float* colPtr = filteredframe.getData()+x;
+            float* colPtr = filteredframe.getData()+minY*width+x;
             
             /* Filter the first pixel in the column: */
             float lastVal = *colPtr;
@@ -317,9 +426,11 @@ void KinectGrabber::applySpaceFilter()
             /* Filter the last pixel in the column: */
             *colPtr=(lastVal+colPtr[0]*2.0f)/3.0f;
         }
-        float* rowPtr = filteredframe.getData();
         for(unsigned int y=minY;y<maxY;++y)
         {
+            /* Get a pointer to the current row: */
+            float* rowPtr = filteredframe.getData()+y*width+minX;
+            
             /* Filter the first pixel in the row: */
             float lastVal=*rowPtr;
             *rowPtr=(rowPtr[0]*2.0f+rowPtr[1])/3.0f;
@@ -336,11 +447,68 @@ void KinectGrabber::applySpaceFilter()
             
             /* Filter the last pixel in the row: */
             *rowPtr=(lastVal+rowPtr[0]*2.0f)/3.0f;
-            ++rowPtr;
+            
+            /* The previous row is final once this one is filtered, compute its normals while it is in cache: */
+            if(computeNormals && filterPass==1 && y>minY)
+                updateNormalsRow(y-1);
+        }
+    }
+    if(computeNormals && maxY>minY)
+        updateNormalsRow(maxY-1);
+}
+
+void KinectGrabber::updateNormals()
+{
+    for(int y=minY;y<maxY;++y)
+        updateNormalsRow(y);
+}
+
+void KinectGrabber::updateNormalsRow(int y)
+{
+    /* Central differences, clamped to the ROI: */
+    int y0 = max(y-1, minY);
+    int y1 = min(y+1, maxY-1);
+    const float* framePtr = filteredframe.getData();
+    unsigned char* normalsPtr = normalsframe.getData();
+    int tileRow = (y/changedTileSize)*changedTilesCols;
+    for(int tx=minX/changedTileSize;tx*changedTileSize<maxX;++tx)
+    {
+        if(!changedTiles[tileRow+tx])
+            continue;
+        int tileMaxX = min((tx+1)*changedTileSize, maxX);
+        for(int x=max(tx*changedTileSize, minX);x<tileMaxX;++x)
+        {
+            int x0 = max(x-1, minX);
+            int x1 = min(x+1, maxX-1);
+            float depth = framePtr[y*width+x];
+            if(depth <= 0 || x1 == x0 || y1 == y0)
+            {
+                resetNormal(x, y);
+                continue;
+            }
+            /* Depth gradient in mm per mm: a pixel spans depth*pixelSize mm on the surface */
+            float footprint = depth*pixelSize;
+            ofVec3f normal((framePtr[y*width+x1]-framePtr[y*width+x0])/((x1-x0)*footprint),
+                           (framePtr[y1*width+x]-framePtr[y0*width+x])/((y1-y0)*footprint),
+                           1);
+            normal.normalize();
+            unsigned char* pixelPtr = normalsPtr+3*(y*width+x);
+            pixelPtr[0] = static_cast<unsigned char>(roundf((normal.x*0.5f+0.5f)*255));
+            pixelPtr[1] = static_cast<unsigned char>(roundf((normal.y*0.5f+0.5f)*255));
+            pixelPtr[2] = static_cast<unsigned char>(roundf((normal.z*0.5f+0.5f)*255));
         }
     }
 }
 
+void KinectGrabber::resetNormal(int x, int y)
+{
+    /* Flat surface facing the kinect: */
+    unsigned char* pixelPtr = normalsframe.getData()+3*(y*width+x);
+    pixelPtr[0] = 128;
+    pixelPtr[1] = 128;
+    pixelPtr[2] = 255;
+}
+
 void KinectGrabber::updateGradientField()
 {
     int ind = 0;
@@ -381,6 +549,23 @@ void KinectGrabber::updateGradientField()
     }
 }
 
+void KinectGrabber::markTilesChanged(int x, int y){
+    // The two passes of the spatial filter spread a change over 2 pixels in each direction
+    // and the normals central differences over one more pixel
+    int radius = (spatialFilter ? 2 : 0)+(computeNormals ? 1 : 0);
+    int minTileX = max(x-radius, 0)/changedTileSize;
+    int maxTileX = min(x+radius, (int)width-1)/changedTileSize;
+    int minTileY = max(y-radius, 0)/changedTileSize;
+    int maxTileY = min(y+radius, (int)height-1)/changedTileSize;
+    for (int ty = minTileY; ty <= maxTileY; ty++)
+        for (int tx = minTileX; tx <= maxTileX; tx++)
+            changedTiles[ty*changedTilesCols+tx] = 1;
+}
+
+void KinectGrabber::markAllTilesChanged(){
+    std::fill(changedTiles.begin(), changedTiles.end(), 1);
+}
+
 bool KinectGrabber::isInsideROI(int x, int y){
     if (x<minX||x>maxX||y<minY||y>maxY)
         return false;
@@ -388,50 +573,295 @@ bool KinectGrabber::isInsideROI(int x, int y){
 }
 
 void KinectGrabber::setKinectROI(ofRectangle ROI){
-    minX = static_cast<int>(ROI.getMinX());
-    maxX = static_cast<int>(ROI.getMaxX());
-    minY = static_cast<int>(ROI.getMinY());
-    maxY = static_cast<int>(ROI.getMaxY());
-    ROIwidth = maxX-minX;
-    ROIheight = maxY-minY;
-    resetBuffers();
+    parametersLock.lock();
+    pendingParameters.ROI = ROI;
+    parametersVersion++;
+    parametersLock.unlock();
 }
 
 void KinectGrabber::setAveragingSlotsNumber(int snumAveragingSlots){
-    if (bufferInitiated){
-            bufferInitiated = false;
-            delete[] averagingBuffer;
-            delete[] statBuffer;
-            delete[] validBuffer;
-            delete[] gradField;
-        }
-    numAveragingSlots = snumAveragingSlots;
-    minNumSamples=(numAveragingSlots+1)/2;
-    initiateBuffers();
+    parametersLock.lock();
+    pendingParameters.numAveragingSlots = max(1, snumAveragingSlots);
+    parametersVersion++;
+    parametersLock.unlock();
 }
 
 void KinectGrabber::setGradFieldResolution(int sgradFieldresolution){
-    if (bufferInitiated){
-        bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
-        delete[] validBuffer;
-        delete[] gradField;
+    parametersLock.lock();
+    pendingParameters.gradFieldresolution = max(1, sgradFieldresolution);
+    parametersVersion++;
+    parametersLock.unlock();
+}
+
+void KinectGrabber::setFollowBigChange(bool newfollowBigChange){
+    parametersLock.lock();
+    pendingParameters.followBigChange = newfollowBigChange;
+    parametersVersion++;
+    parametersLock.unlock();
+}
+
+void KinectGrabber::setMaxOffset(float newMaxOffset){
+    parametersLock.lock();
+    pendingParameters.maxOffset = newMaxOffset;
+    parametersVersion++;
+    parametersLock.unlock();
+}
+
+void KinectGrabber::setSpatialFiltering(bool newspatialFilter){
+    parametersLock.lock();
+    pendingParameters.spatialFilter = newspatialFilter;
+    parametersVersion++;
+    parametersLock.unlock();
+}
+
+void KinectGrabber::setComputeNormals(bool newcomputeNormals){
+    parametersLock.lock();
+    pendingParameters.computeNormals = newcomputeNormals;
+    parametersVersion++;
+    parametersLock.unlock();
+}
+
+void KinectGrabber::setConvergenceThresholds(float sminStableFraction, float smaxChangeRate, int sminConvergedFrames, int smaxInitFrames){
+    parametersLock.lock();
+    pendingParameters.minStableFraction = ofClamp(sminStableFraction, 0, 1);
+    pendingParameters.maxChangeRate = max(0.0f, smaxChangeRate);
+    pendingParameters.minConvergedFrames = max(1, sminConvergedFrames);
+    pendingParameters.maxInitFrame = max(1, smaxInitFrames);
+    parametersVersion++;
+    parametersLock.unlock();
+}
+
+void KinectGrabber::applyParameters(){
+    parametersLock.lock();
+    FilterParameters newParameters = pendingParameters;
+    appliedParametersVersion = parametersVersion;
+    parametersLock.unlock();
+    
+    // Simple parameters are used as is by the next filtering pass
+    followBigChange = newParameters.followBigChange;
+    spatialFilter = newParameters.spatialFilter;
+    if (newParameters.computeNormals && !computeNormals)
+        markAllTilesChanged(); // The normals were not updated while they were off: full pass
+    computeNormals = newParameters.computeNormals;
+    maxOffset = newParameters.maxOffset;
+    minStableFraction = newParameters.minStableFraction;
+    maxChangeRate = newParameters.maxChangeRate;
+    minConvergedFrames = newParameters.minConvergedFrames;
+    maxInitFrame = newParameters.maxInitFrame;
+    
+    if (!bufferInitiated)
+        return;
+    if (newParameters.numAveragingSlots != numAveragingSlots)
+        resizeAveragingBuffer(newParameters.numAveragingSlots);
+    if (newParameters.gradFieldresolution != gradFieldresolution)
+        updateGradFieldResolution(newParameters.gradFieldresolution);
+    if (static_cast<int>(newParameters.ROI.getMinX()) != minX || static_cast<int>(newParameters.ROI.getMaxX()) != maxX
+        || static_cast<int>(newParameters.ROI.getMinY()) != minY || static_cast<int>(newParameters.ROI.getMaxY()) != maxY)
+        updateROI(newParameters.ROI);
+}
+
+void KinectGrabber::resizeAveragingBuffer(int snumAveragingSlots){
+    int frameSize = height*width;
+    float* newAveragingBuffer = new float[snumAveragingSlots*frameSize];
+    
+    // Keep the most recent samples, oldest first, so that the ring order is preserved
+    int keptSlots = min(snumAveragingSlots, numAveragingSlots);
+    for (int i = 0; i < keptSlots; i++){
+        int oldSlot = (averagingSlotIndex-keptSlots+i+numAveragingSlots) % numAveragingSlots;
+        memcpy(newAveragingBuffer+i*frameSize, averagingBuffer+oldSlot*frameSize, frameSize*sizeof(float));
     }
+    float* averagingBufferPtr = newAveragingBuffer+keptSlots*frameSize;
+    for (int i = keptSlots*frameSize; i < snumAveragingSlots*frameSize; i++, averagingBufferPtr++)
+        *averagingBufferPtr = initialValue;
+    delete[] averagingBuffer;
+    averagingBuffer = newAveragingBuffer;
+    numAveragingSlots = snumAveragingSlots;
+    minNumSamples = (numAveragingSlots+1)/2;
+    averagingSlotIndex = keptSlots % numAveragingSlots;
+    
+    /* Rebuild the statistics from the kept samples: */
+    float* statBufferPtr = statBuffer;
+    for (int i = 0; i < frameSize; i++, statBufferPtr += 3){
+        statBufferPtr[0] = statBufferPtr[1] = statBufferPtr[2] = 0;
+        for (int slot = 0; slot < keptSlots; slot++){
+            float val = averagingBuffer[slot*frameSize+i];
+            if (val != initialValue){
+                ++statBufferPtr[0];
+                statBufferPtr[1] += val;
+                statBufferPtr[2] += val*val;
+            }
+        }
+    }
+    ofLogVerbose("kinectGrabber") << "resizeAveragingBuffer(): " << numAveragingSlots << " slots, " << keptSlots << " slots kept";
+}
+
+void KinectGrabber::updateGradFieldResolution(int sgradFieldresolution){
     gradFieldresolution = sgradFieldresolution;
-    initiateBuffers();
+    gradFieldcols = width / gradFieldresolution;
+    gradFieldrows = height / gradFieldresolution;
+    gradField.assign(gradFieldcols*gradFieldrows, ofVec2f(0));
 }
 
-void KinectGrabber::setFollowBigChange(bool newfollowBigChange){
-    if (bufferInitiated){
-        bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
-        delete[] validBuffer;
-        delete[] gradField;
+void KinectGrabber::updateROI(ofRectangle ROI){
+    int newMinX = static_cast<int>(ROI.getMinX());
+    int newMaxX = static_cast<int>(ROI.getMaxX());
+    int newMinY = static_cast<int>(ROI.getMinY());
+    int newMaxY = static_cast<int>(ROI.getMaxY());
+    int frameSize = height*width;
+    bool extended = false;
+    int numSeeded = 0;
+    float* filteredFramePtr = filteredframe.getData();
+    const RawDepth* rawFramePtr = kinectDepthImage.getWidth() == width && kinectDepthImage.getHeight() == height ? kinectDepthImage.getData() : NULL;
+    for (int y = 0; y < height; y++){
+        for (int x = 0; x < width; x++){
+            bool insideOld = x >= minX && x < maxX && y >= minY && y < maxY;
+            bool insideNew = x >= newMinX && x < newMaxX && y >= newMinY && y < newMaxY;
+            int ind = y*width+x;
+            if (insideNew && !insideOld){
+                // The pixel enters the ROI: its filter state is out of date, it is
+                // seeded with the last kinect frame so that the image stays stabilized
+                float newVal = rawFramePtr != NULL ? static_cast<float>(rawFramePtr[ind]) : 0;
+                if (applyDepthCorrection && newVal > 0)
+                    newVal = newVal*depthCorrectionGains[ind]+depthCorrectionOffsets[ind];
+                bool seeded = newVal > maxOffset;
+                for (int slot = 0; slot < numAveragingSlots; slot++)
+                    averagingBuffer[slot*frameSize+ind] = seeded ? newVal : initialValue;
+                statBuffer[3*ind] = seeded ? numAveragingSlots : 0;
+                statBuffer[3*ind+1] = seeded ? newVal*numAveragingSlots : 0;
+                statBuffer[3*ind+2] = seeded ? newVal*newVal*numAveragingSlots : 0;
+                validBuffer[ind] = seeded ? newVal : initialValue;
+                filteredFramePtr[ind] = validBuffer[ind];
+                if (seeded)
+                    numSeeded++;
+                extended = true;
+            } else if (insideOld && !insideNew){
+                filteredFramePtr[ind] = 0;
+                resetNormal(x, y);
+            }
+        }
     }
-    followBigChange = newfollowBigChange;
-    initiateBuffers();
+    minX = newMinX;
+    maxX = newMaxX;
+    minY = newMinY;
+    maxY = newMaxY;
+    ROIwidth = maxX-minX;
+    ROIheight = maxY-minY;
+    ofLogVerbose("kinectGrabber") << "updateROI(): new ROI: " << ROI << (extended ? " (extended, "+ofToString(numSeeded)+" pixels seeded)" : " (cropped)");
+}
+
+void KinectGrabber::setDepthCorrection(const vector<float> & gains, const vector<float> & offsets){
+    if (gains.size() != width*height || offsets.size() != width*height){
+        ofLogError("kinectGrabber") << "setDepthCorrection(): correction maps size does not match kinect frame size";
+        return;
+    }
+    depthCorrectionGains = gains;
+    depthCorrectionOffsets = offsets;
+    applyDepthCorrection = true;
+}
+
+void KinectGrabber::clearDepthCorrection(){
+    applyDepthCorrection = false;
+}
+
+void KinectGrabber::setFilterStatePersistence(string path, float savePeriod){
+    filterStatePath = path;
+    filterStateSavePeriod = savePeriod;
+    lastFilterStateSave = ofGetElapsedTimef();
+}
+
+// File layout: "MSFS", width, height, ROI (minX, maxX, minY, maxY), depth correction
+// flag (int32) then for each pixel the valid value, running mean and variance (float).
+// Pixels that were not stable are stored with a mean equal to initialValue.
+// The state is copied here, a writer thread writes it to a temporary file and
+// renames it over the previous snapshot, which is never left half written.
+bool KinectGrabber::saveFilterState(string path){
+    if (!bufferInitiated)
+        return false;
+    int frameSize = width*height;
+    vector<char> data(4+7*sizeof(int32_t)+frameSize*3*sizeof(float));
+    char* ptr = data.data();
+    memcpy(ptr, "MSFS", 4);
+    ptr += 4;
+    int32_t header[7] = {static_cast<int32_t>(width), static_cast<int32_t>(height), minX, maxX, minY, maxY, applyDepthCorrection ? 1 : 0};
+    memcpy(ptr, header, sizeof(header));
+    ptr += sizeof(header);
+    float* valPtr = reinterpret_cast<float*>(ptr);
+    const float* statBufferPtr = statBuffer;
+    for (int i = 0; i < frameSize; i++, statBufferPtr += 3){
+        *valPtr++ = validBuffer[i];
+        if (statBufferPtr[0] >= minNumSamples && validBuffer[i] != initialValue){
+            float mean = statBufferPtr[1]/statBufferPtr[0];
+            *valPtr++ = mean;
+            *valPtr++ = max(0.0f, statBufferPtr[2]/statBufferPtr[0]-mean*mean);
+        } else {
+            *valPtr++ = initialValue;
+            *valPtr++ = 0;
+        }
+    }
+    if (filterStateWriter.joinable()) // The previous snapshot is written: at most one file write at a time
+        filterStateWriter.join();
+    filterStateWriter = std::thread(&KinectGrabber::writeFilterState, this, std::move(data), ofToDataPath(path, true));
+    return true;
+}
+
+void KinectGrabber::writeFilterState(vector<char> data, string path){
+    string tmpPath = path+".tmp";
+    std::ofstream file(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+    file.close();
+    bool saved = !file.fail() && std::rename(tmpPath.c_str(), path.c_str()) == 0;
+    if (!saved)
+        std::remove(tmpPath.c_str());
+    ofLogVerbose("kinectGrabber") << "writeFilterState(): " << (saved ? "Filter state saved" : "Filter state could not be saved");
+}
+
+bool KinectGrabber::loadFilterState(string path){
+    if (!bufferInitiated)
+        return false;
+    int frameSize = width*height;
+    ofBuffer buffer = ofBufferFromFile(path, true);
+    if (buffer.size() != 4+7*sizeof(int32_t)+frameSize*3*sizeof(float) || strncmp(buffer.getData(), "MSFS", 4) != 0)
+        return false;
+    const char* ptr = buffer.getData()+4;
+    int32_t header[7];
+    memcpy(header, ptr, sizeof(header));
+    ptr += sizeof(header);
+    if (header[0] != static_cast<int32_t>(width) || header[1] != static_cast<int32_t>(height)){
+        ofLogVerbose("kinectGrabber") << "loadFilterState(): Kinect size does not match";
+        return false;
+    }
+    if ((header[6] == 1) != applyDepthCorrection){ // Stored depths would not be comparable
+        ofLogVerbose("kinectGrabber") << "loadFilterState(): Depth correction does not match";
+        return false;
+    }
+    
+    // Seed all the averaging slots with the stored running mean so that the
+    // statistics stay consistent when the ring is overwritten by new frames
+    const float* valPtr = reinterpret_cast<const float*>(ptr);
+    int numSeeded = 0;
+    for (int y = 0; y < height; y++){
+        for (int x = 0; x < width; x++, valPtr += 3){
+            float mean = valPtr[1];
+            if (!isInsideROI(x, y) || mean == initialValue)
+                continue;
+            int ind = y*width+x;
+            for (int slot = 0; slot < numAveragingSlots; slot++)
+                averagingBuffer[slot*frameSize+ind] = mean;
+            statBuffer[3*ind] = numAveragingSlots;
+            statBuffer[3*ind+1] = mean*numAveragingSlots;
+            statBuffer[3*ind+2] = (valPtr[2]+mean*mean)*numAveragingSlots;
+            validBuffer[ind] = valPtr[0];
+            numSeeded++;
+        }
+    }
+    
+    // The stabilization warm-up can only be skipped if the whole ROI was stored
+    if (header[2] <= minX && header[3] >= maxX && header[4] <= minY && header[5] >= maxY){
+        currentInitFrame = 0;
+        firstImageReady = true;
+    }
+    ofLogVerbose("kinectGrabber") << "loadFilterState(): " << numSeeded << " pixels seeded, image stabilized: " << firstImageReady;
+    return true;
 }
 
 ofVec3f KinectGrabber::getStatBuffer(int x, int y){
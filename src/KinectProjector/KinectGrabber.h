@@ -20,6 +20,8 @@ General Public License for more details.
 ***********************************************************************/
 
 #pragma once
+#include <atomic>
+#include <thread>
 #include "ofMain.h"
 #include "ofxOpenCv.h"
 #include "ofxCv.h"
@@ -47,23 +49,64 @@ public:
     float getAveragingBuffer(int x, int y, int slotNum);
     float getValidBuffer(int x, int y);
     
+    // Filter parameters: can be called from any thread, they are applied
+    // live by the grabber thread without resetting the buffers
     void setFollowBigChange(bool newfollowBigChange);
     void setKinectROI(ofRectangle skinectROI);
     void setAveragingSlotsNumber(int snumAveragingSlots);
     void setGradFieldResolution(int sgradFieldresolution);
+    void setMaxOffset(float newMaxOffset);
+    void setSpatialFiltering(bool newspatialFilter);
+    void setComputeNormals(bool newcomputeNormals);
+    void setDepthCorrection(const vector<float> & gains, const vector<float> & offsets);
+    void clearDepthCorrection();
+    // The ROI is converged after minConvergedFrames consecutive frames with at least minStableFraction
+    // of its valid pixels stable and at most maxChangeRate of them changing their displayed value.
+    // The image is only considered stabilized without converging after smaxInitFrames frames
+    void setConvergenceThresholds(float sminStableFraction, float smaxChangeRate, int sminConvergedFrames, int smaxInitFrames);
+    
+    // Filter state snapshot: seeds the filter at startup (call after setupFramefilter,
+    // before start) and is copied periodically and on exit by the grabber thread,
+    // which leaves the writing of the file to a writer thread
+    bool loadFilterState(string path);
+    void setFilterStatePersistence(string path, float savePeriod);
     
     void decStoredframes(){
         storedframes -= 1;
     }
     
-    bool isImageStabilized(){
+    bool isImageStabilized(){ // The filter has converged once since the last buffer reset
         return firstImageReady;
     }
     
+    bool isImageConverged(){ // The ROI is currently stable (cleared by big changes)
+        return imageConverged;
+    }
+    
+    float getStabilizationProgress(){ // 0 to 1, reaches 1 when the image is converged
+        return stabilizationProgress;
+    }
+    
+    float getStableFraction(){
+        return stableFraction;
+    }
+    
+    float getMeanVariance(){
+        return meanVariance;
+    }
+    
+    float getChangeRate(){
+        return changeRate;
+    }
+    
     bool isFrameNew(){
         return newFrame;
     }
     
+    unsigned int getNumCapturedFrames(){ // Kinect frames captured so far, can be read from any thread
+        return numCapturedFrames;
+    }
+    
     ofVec2f getKinectSize(){
         return ofVec2f(width, height);
     }
@@ -78,34 +121,72 @@ public:
         return numAveragingSlots;
     }
     
-    void setMaxOffset(float newMaxOffset){
-        maxOffset = newMaxOffset;
-    }
-    
-    void setSpatialFiltering(bool newspatialFilter){
-        spatialFilter = newspatialFilter;
+    int getChangedTileSize(){ // Tiles of the changed tiles mask, in kinect pixels
+        return changedTileSize;
     }
     
+    // Sent with each filtered frame (before it): one byte per tile, non zero
+    // if a pixel of the tile changed since the previously sent frame
+	ofThreadChannel<vector<unsigned char> > changed;
+    // Sent with each filtered frame (before it): number of the kinect frame it was computed from
+	ofThreadChannel<unsigned int> frameNumber;
 	ofThreadChannel<ofFloatPixels> filtered;
+    // Sent with each filtered frame (after it) when the normals are computed: surface
+    // normals in kinect image space (x right, y down, z toward the kinect) packed as n*0.5+0.5
+	ofThreadChannel<ofPixels> normals;
 	ofThreadChannel<ofPixels> colored;
-	ofThreadChannel<ofVec2f*> gradient;
+	ofThreadChannel<vector<ofVec2f> > gradient; // Copied: the main thread keeps its own field
     
 private:
+    struct FilterParameters {
+        int numAveragingSlots;
+        bool followBigChange;
+        bool spatialFilter;
+        bool computeNormals;
+        float maxOffset;
+        int gradFieldresolution;
+        ofRectangle ROI;
+        float minStableFraction;
+        float maxChangeRate;
+        int minConvergedFrames;
+        int maxInitFrame;
+    };
+    
 	void threadedFunction() override;
+    void applyParameters(); // Apply the pending parameters (grabber thread)
+    void resizeAveragingBuffer(int snumAveragingSlots);
+    void updateROI(ofRectangle ROI);
+    void updateGradFieldResolution(int sgradFieldresolution);
+    bool saveFilterState(string path); // Grabber thread only, the file is written in the background
+    void writeFilterState(vector<char> data, string path); // Writer thread
+    void resetConvergence(void);
+    void updateConvergence(int numValid, int numStable, int numChanged, float sumVariance);
     void filter();
     bool isInsideROI(int x, int y); // test is x, y is inside ROI
     void applySpaceFilter();
     void updateGradientField();
+    void updateNormals(); // All the ROI rows
+    void updateNormalsRow(int y); // Changed tiles of the row y, the rows y-1 to y+1 must be filtered
+    void resetNormal(int x, int y);
+    void markTilesChanged(int x, int y); // Tiles influenced by the filtered pixel x, y
+    void markAllTilesChanged();
     
 	bool newFrame;
     bool bufferInitiated;
     bool firstImageReady;
     int storedframes;
+    std::atomic<unsigned int> numCapturedFrames;
     
     // Thread lambda functions (actions)
 	vector<std::function<void(KinectGrabber&)> > actions;
 	ofMutex actionsLock;
     
+    // Parameter block written by the main thread and applied by the grabber thread
+    FilterParameters pendingParameters;
+    ofMutex parametersLock;
+    std::atomic<unsigned int> parametersVersion;
+    unsigned int appliedParametersVersion;
+    
     // Kinect parameters
 	bool kinectOpened;
     ofxKinect               kinect;
@@ -117,7 +198,8 @@ private:
     ofxCvColorImage         kinectColorImage;
     ofShortPixels     kinectDepthImage;
     ofFloatPixels filteredframe;
-    ofVec2f* gradField;
+    ofPixels normalsframe;
+    vector<ofVec2f> gradField;
     
     // Filtering buffers
 	float* averagingBuffer; // Buffer to calculate running averages of each pixel's depth value
@@ -141,11 +223,41 @@ private:
     float bigChange; // Amount of change over which the averaging slot is reset to new value
 	float instableValue; // Value to assign to instable pixels if retainValids is false
 	bool spatialFilter; // Flag whether to apply a spatial filter to time-averaged depth values
+    bool computeNormals; // Flag whether to compute the surface normals of the filtered frame
+    float pixelSize; // Size of a kinect pixel at 1 mm depth, in mm
     float maxOffset;
     
-    int minInitFrame; // Minimal number of frame to consider the kinect initialized
+    // Per-pixel linear depth correction (corrected = gain*raw+offset)
+    bool applyDepthCorrection;
+    vector<float> depthCorrectionGains;
+    vector<float> depthCorrectionOffsets;
+    
+    int maxInitFrame; // Fallback: number of frames after which the kinect is considered initialized even if not converged
     int currentInitFrame;
     
+    // Convergence tracking (statistics of the valid ROI pixels of the last filtered frame,
+    // the pixels without enough valid samples, holes and shadows, never stabilize)
+    float stableFraction; // Fraction of valid ROI pixels passing the stability test
+    float meanVariance; // Mean depth variance of the stable pixels
+    float changeRate; // Fraction of valid ROI pixels whose displayed value changed
+    float minStableFraction;
+    float maxChangeRate;
+    int minConvergedFrames; // Number of consecutive converged frames needed
+    int convergedFrames;
+    bool imageConverged;
+    float stabilizationProgress;
+    
+    // Changed tiles mask, accumulated until the next frame is sent
+    int changedTileSize;
+    int changedTilesCols, changedTilesRows;
+    vector<unsigned char> changedTiles;
+    
+    // Filter state persistence
+    string filterStatePath; // Empty if the filter state is not saved
+    float filterStateSavePeriod; // Seconds between two snapshots
+    float lastFilterStateSave;
+    std::thread filterStateWriter; // Writes the last snapshot, joined before the next one
+    
     // Debug
 //    int blockX, blockY;
 };
@@ -25,6 +25,26 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 using namespace ofxCSG;
 
+namespace {
+    // Same conversion as ofxCvFloatImage: native scale range to 0..maxValue, rounded and saturated
+    template<typename T>
+    void convertDepthRegions(ofxCvFloatImage & depthImage, const vector<ofRectangle> & regions, T* dst, float maxValue){
+        float scaleMin = depthImage.getNativeScaleMin();
+        float scaleMax = depthImage.getNativeScaleMax();
+        float scale = scaleMax != scaleMin ? maxValue/(scaleMax-scaleMin) : 0;
+        const IplImage* cvImage = depthImage.getCvImage();
+        int width = depthImage.getWidth();
+        for (auto & region : regions){
+            for (int y = region.getMinY(); y < region.getMaxY(); y++){
+                const float* srcPtr = reinterpret_cast<const float*>(cvImage->imageData+y*cvImage->widthStep);
+                T* dstPtr = dst+y*width;
+                for (int x = region.getMinX(); x < region.getMaxX(); x++)
+                    dstPtr[x] = static_cast<T>(ofClamp(roundf((srcPtr[x]-scaleMin)*scale), 0, maxValue));
+            }
+        }
+    }
+}
+
 KinectProjector::KinectProjector(std::shared_ptr<ofAppBaseWindow> const& p)
 :ROIcalibrated(false),
 projKinectCalibrated(false),
@@ -32,9 +52,13 @@ calibrating (false),
 basePlaneUpdated (false),
 projKinectCalibrationUpdated (false),
 ROIUpdated (false),
+depthFrameUpdated (false),
 imageStabilized (false),
 waitingForFlattenSand (false),
-drawKinectView(false)
+drawKinectView(false),
+computeNormals(false),
+normalsFullUpload(false),
+shoreDistanceDirty(true)
 {
     projWindow = p;
 }
@@ -68,6 +92,16 @@ void KinectProjector::setup(bool sdisplayGui){
 	chessboardX = 5;
     chessboardY = 4;
     
+    // structured light calibration config
+    patternWaitFrames = 3;
+    patternShown = false;
+    patternShownFrame = 0;
+    receivedFrameNumber = 0;
+    maxStructuredLightPairs = 20000;
+    
+    // depth correction config
+    numDepthCorrectionLevels = 3;
+    
     // 	Gradient Field
 	gradFieldResolution = 10;
     arrowLength = 25;
@@ -91,6 +125,12 @@ void KinectProjector::setup(bool sdisplayGui){
 	spatialFiltering = true;
     followBigChanges = false;
     numAveragingSlots = 15;
+    highPrecisionDepth = true;
+    minStableFraction = 0.8f;
+    maxChangeRate = 0.002f;
+    minConvergedFrames = 5;
+    maxConvergenceWaitFrames = 300; // 10 s at 30 fps
+    convergenceWaitFrames = 0;
     
     // Get projector and kinect width & height
     projRes = ofVec2f(projWindow->getWidth(), projWindow->getHeight());
@@ -98,12 +138,20 @@ void KinectProjector::setup(bool sdisplayGui){
 	kinectROI = ofRectangle(0, 0, kinectRes.x, kinectRes.y);
     
     // Initialize the fbos and images
+    FilteredDepthImage.setUseTexture(false); // FilteredDepthTexture is uploaded by tiles instead
     FilteredDepthImage.allocate(kinectRes.x, kinectRes.y);
+    FilteredDepthImage.set(0);
+    depthTileSize = kinectgrabber.getChangedTileSize();
+    depthTilesCols = (kinectRes.x+depthTileSize-1)/depthTileSize;
+    depthTilesRows = (kinectRes.y+depthTileSize-1)/depthTileSize;
+    changedDepthTiles.assign(depthTilesCols*depthTilesRows, 0);
+    shoreDistanceField.setup(kinectRes.x, kinectRes.y);
     kinectColorImage.allocate(kinectRes.x, kinectRes.y);
     thresholdedImage.allocate(kinectRes.x, kinectRes.y);
     Dptimg.allocate(20, 20); // Small detailed ROI
     
 	kpt = new ofxKinectProjectorToolkit(projRes, kinectRes);
+    grayCode.setup(projRes, kinectRes);
 
 	//Try to load calibration file if possible
     if (kpt->loadCalibration("settings/calibration.xml"))
@@ -130,8 +178,30 @@ void KinectProjector::setup(bool sdisplayGui){
         ofLogVerbose("KinectProjector") << "KinectProjector.setup(): Settings could not be loaded " ;
     }
     
+    allocateFilteredDepthTexture();
+    
 	// finish kinectgrabber setup and start the grabber
     kinectgrabber.setupFramefilter(gradFieldResolution, maxOffset, kinectROI, spatialFiltering, followBigChanges, numAveragingSlots);
+    kinectgrabber.setConvergenceThresholds(minStableFraction, maxChangeRate, minConvergedFrames, maxConvergenceWaitFrames);
+    
+    // Try to load depth correction file if possible
+    depthCorrection.setup(kinectRes.x, kinectRes.y);
+    if (depthCorrection.load("settings/depthCorrection.bin"))
+    {
+        ofLogVerbose("KinectProjector") << "KinectProjector.setup(): Depth correction loaded " ;
+        kinectgrabber.setDepthCorrection(depthCorrection.getGains(), depthCorrection.getOffsets());
+    } else {
+        ofLogVerbose("KinectProjector") << "KinectProjector.setup(): Depth correction could not be loaded " ;
+    }
+    
+    // Try to warm start the filter from the last snapshot
+    if (kinectgrabber.loadFilterState("settings/filterState.bin"))
+    {
+        ofLogVerbose("KinectProjector") << "KinectProjector.setup(): Filter state loaded " ;
+    } else {
+        ofLogVerbose("KinectProjector") << "KinectProjector.setup(): Filter state could not be loaded " ;
+    }
+    kinectgrabber.setFilterStatePersistence("settings/filterState.bin", 60);
     kinectWorldMatrix = kinectgrabber.getWorldMatrix();
     ofLogVerbose("KinectProjector") << "KinectProjector.setup(): kinectWorldMatrix: " << kinectWorldMatrix ;
     
@@ -161,31 +231,27 @@ void KinectProjector::exit(ofEventArgs& e){
     } else {
         ofLogVerbose("KinectProjector") << "exit(): Settings could not be saved " ;
     }
+    kinectgrabber.waitForThread(true); // Stop the grabber, which saves the filter state
 }
 
 void KinectProjector::setupGradientField(){
     gradFieldcols = kinectRes.x / gradFieldResolution;
     gradFieldrows = kinectRes.y / gradFieldResolution;
     
-    gradField = new ofVec2f[gradFieldcols*gradFieldrows];
-    ofVec2f* gfPtr=gradField;
-    for(unsigned int y=0;y<gradFieldrows;++y)
-        for(unsigned int x=0;x<gradFieldcols;++x,++gfPtr)
-            *gfPtr=ofVec2f(0);
+    gradField.assign(gradFieldcols*gradFieldrows, ofVec2f(0));
 }
 
 void KinectProjector::setGradFieldResolution(int sgradFieldResolution){
     gradFieldResolution = sgradFieldResolution;
     setupGradientField();
-    kinectgrabber.performInThread([sgradFieldResolution](KinectGrabber & kg) {
-        kg.setGradFieldResolution(sgradFieldResolution);
-    });
+    kinectgrabber.setGradFieldResolution(sgradFieldResolution);
 }
 
 void KinectProjector::update(){
     // Clear updated state variables
     basePlaneUpdated = false;
     ROIUpdated = false;
+    depthFrameUpdated = false;
     projKinectCalibrationUpdated = false;
 
 	if (displayGui)
@@ -194,8 +260,26 @@ void KinectProjector::update(){
     // Get depth image from kinect grabber
     ofFloatPixels filteredframe;
     if (kinectgrabber.filtered.tryReceive(filteredframe)) {
-        FilteredDepthImage.setFromPixels(filteredframe.getData(), kinectRes.x, kinectRes.y);
-        FilteredDepthImage.updateTexture();
+        // Only the changed tiles are copied and uploaded, static frames are skipped
+        if (!kinectgrabber.changed.tryReceive(changedDepthTiles))
+            changedDepthTiles.assign(depthTilesCols*depthTilesRows, 1);
+        kinectgrabber.frameNumber.tryReceive(receivedFrameNumber);
+        if (updateFilteredDepth(filteredframe)){
+            depthFrameUpdated = true;
+            if (elevationDirtyTiles.size() == changedDepthTiles.size())
+                for (int i = 0; i < changedDepthTiles.size(); i++)
+                    elevationDirtyTiles[i] |= changedDepthTiles[i];
+        }
+        
+        // Get the normals sent with the frame, they changed in the same tiles
+        ofPixels normalsframe;
+        if (kinectgrabber.normals.tryReceive(normalsframe) && computeNormals){
+            if (normalsFullUpload)
+                uploadNormals(normalsframe, vector<ofRectangle>(1, ofRectangle(0, 0, kinectRes.x, kinectRes.y)));
+            else
+                uploadNormals(normalsframe, changedDepthRegions);
+            normalsFullUpload = false;
+        }
         
         // Get color image from kinect grabber
         ofPixels coloredframe;
@@ -213,6 +297,18 @@ void KinectProjector::update(){
         
         // Is the depth image stabilized
         imageStabilized = kinectgrabber.isImageStabilized();
+        if (calibrating && imageStabilized){ // Calibration steps need a converged image, not only an initialized filter
+            if (kinectgrabber.isImageConverged()){
+                convergenceWaitFrames = 0;
+            } else if (++convergenceWaitFrames == maxConvergenceWaitFrames){
+                ofLogWarning("KinectProjector") << "update(): Depth image not converged after " << maxConvergenceWaitFrames
+                    << " frames (stable pixels: " << kinectgrabber.getStableFraction() << ", changing pixels: "
+                    << kinectgrabber.getChangeRate() << "), calibrating with the current image";
+            }
+            imageStabilized = convergenceWaitFrames == 0 || convergenceWaitFrames >= maxConvergenceWaitFrames;
+        } else {
+            convergenceWaitFrames = 0;
+        }
         
         // Are we calibrating ?
         if (calibrating && !waitingForFlattenSand) {
@@ -221,7 +317,7 @@ void KinectProjector::update(){
 			//ofEnableAlphaBlending();
 			fboMainWindow.begin();
             if (drawKinectView){
-                FilteredDepthImage.draw(0, 0);
+                FilteredDepthTexture.draw(0, 0);
 				ofNoFill();
 				ofDrawRectangle(kinectROI);
 				ofDrawRectangle(0, 0, kinectRes.x, kinectRes.y);
@@ -244,6 +340,10 @@ void KinectProjector::updateCalibration(){
         updateProjKinectAutoCalibration();
     }else if (calibrationState == CALIBRATION_STATE_PROJ_KINECT_MANUAL_CALIBRATION) {
         updateProjKinectManualCalibration();
+    } else if (calibrationState == CALIBRATION_STATE_PROJ_KINECT_STRUCTURED_LIGHT_CALIBRATION) {
+        updateProjKinectStructuredLightCalibration();
+    } else if (calibrationState == CALIBRATION_STATE_DEPTH_CORRECTION) {
+        updateDepthCorrectionCalibration();
     }
 }
 
@@ -434,9 +534,7 @@ void KinectProjector::setNewKinectROI(){
 }
 
 void KinectProjector::updateKinectGrabberROI(ofRectangle ROI){
-    kinectgrabber.performInThread([ROI](KinectGrabber & kg) {
-        kg.setKinectROI(ROI);
-    });
+    kinectgrabber.setKinectROI(ROI);
 //    while (kinectgrabber.isImageStabilized()){
 //    } // Wait for kinectgrabber to reset buffers
     imageStabilized = false; // Now we can wait for a clean new depth frame
@@ -449,9 +547,7 @@ void KinectProjector::updateProjKinectAutoCalibration(){
         } else {
             calibModal->setMessage("Enlarging acquisition area & resetting buffers.");
             setMaxKinectGrabberROI();
-            kinectgrabber.performInThread([](KinectGrabber & kg) {
-                kg.setMaxOffset(0);
-            });
+            kinectgrabber.setMaxOffset(0);
             calibModal->setMessage("Stabilizing acquisition.");
             autoCalibState = AUTOCALIB_STATE_INIT_POINT;
         }
@@ -566,35 +662,103 @@ void KinectProjector::updateProjKinectAutoCalibration(){
             }
         }
     } else if (autoCalibState == AUTOCALIB_STATE_COMPUTE){
-        updateKinectGrabberROI(kinectROI); // Goes back to kinectROI and maxoffset
-        kinectgrabber.performInThread([this](KinectGrabber & kg) {
-            kg.setMaxOffset(this->maxOffset);
-        });
-        if (pairsKinect.size() == 0) {
-            ofLogVerbose("KinectProjector") << "autoCalib(): Error: No points acquired !!" ;
-            calibModal->hide();
-            confirmModal->setTitle("Calibration failed");
-            confirmModal->setMessage("No point could be acquired. ");
-            confirmModal->show();
-            calibrating = false;
-        } else {
-            ofLogVerbose("KinectProjector") << "autoCalib(): Calibrating" ;
-            kpt->calibrate(pairsKinect, pairsProjector);
-            kinectProjMatrix = kpt->getProjectionMatrix();
+        computeProjKinectCalibration();
+        autoCalibState = AUTOCALIB_STATE_DONE;
+    } else if (autoCalibState == AUTOCALIB_STATE_DONE){
+    }
+}
+void KinectProjector::computeProjKinectCalibration(){
+    updateKinectGrabberROI(kinectROI); // Goes back to kinectROI and maxoffset
+    kinectgrabber.setMaxOffset(maxOffset);
+    if (pairsKinect.size() == 0) {
+        ofLogVerbose("KinectProjector") << "computeProjKinectCalibration(): Error: No points acquired !!" ;
+        calibModal->hide();
+        confirmModal->setTitle("Calibration failed");
+        confirmModal->setMessage("No point could be acquired. ");
+        confirmModal->show();
+        calibrating = false;
+    } else {
+        ofLogVerbose("KinectProjector") << "computeProjKinectCalibration(): Calibrating with " << pairsKinect.size() << " point pairs" ;
+        kpt->calibrate(pairsKinect, pairsProjector);
+        kinectProjMatrix = kpt->getProjectionMatrix();
 
-			updateROIFromCalibration(); // Compute the limite of the ROI according to the projected area 
+        updateROIFromCalibration(); // Compute the limite of the ROI according to the projected area
 
-            projKinectCalibrated = true; // Update states variables
-            projKinectCalibrationUpdated = true;
-            calibrating = false;
-            calibModal->setMessage("Calibration successfull.");
+        projKinectCalibrated = true; // Update states variables
+        projKinectCalibrationUpdated = true;
+        calibrating = false;
+        calibModal->setMessage("Calibration successfull.");
+        calibModal->hide();
+        //saveCalibrationAndSettings(); // Already done in updateROIFromCalibration
+    }
+}
+
+void KinectProjector::updateProjKinectStructuredLightCalibration(){
+    if (structuredLightState == STRUCTURED_LIGHT_STATE_INIT){
+        calibModal->setMessage("Enlarging acquisition area & resetting buffers.");
+        setMaxKinectGrabberROI();
+        kinectgrabber.setMaxOffset(0);
+        calibModal->setMessage("Stabilizing acquisition.");
+        pairsKinect.clear();
+        pairsProjector.clear();
+        upframe = false;
+        structuredLightState = STRUCTURED_LIGHT_STATE_PROJECT;
+        currentPattern = -1; // Base plane still to be acquired
+    } else if (structuredLightState == STRUCTURED_LIGHT_STATE_PROJECT && imageStabilized){
+        if (currentPattern < 0){
+            calibModal->setMessage("Acquiring sea level plane.");
+            updateBasePlane();
+            currentPattern = 0;
+        }
+        string mess = "Projecting pattern "+std::to_string(currentPattern+1)+"/"+std::to_string(grayCode.getNumPatterns())+(upframe ? " on the board." : " on the sand.");
+        calibModal->setMessage(mess);
+        fboProjWindow.begin();
+        grayCode.drawPattern(currentPattern);
+        fboProjWindow.end();
+        patternShown = false; // Set when the projector window draws it
+        structuredLightState = STRUCTURED_LIGHT_STATE_CAPTURE;
+    } else if (structuredLightState == STRUCTURED_LIGHT_STATE_CAPTURE){
+        // Only a frame captured patternWaitFrames kinect frames after the pattern reached the projector shows it
+        if (patternShown && receivedFrameNumber >= patternShownFrame+patternWaitFrames){
+            grayCode.addCapture(kinectColorImage.getPixels());
+            currentPattern++;
+            if (grayCode.isComplete()){
+                structuredLightState = STRUCTURED_LIGHT_STATE_DECODE;
+            } else {
+                structuredLightState = STRUCTURED_LIGHT_STATE_PROJECT;
+            }
+        }
+    } else if (structuredLightState == STRUCTURED_LIGHT_STATE_DECODE){
+        calibModal->setMessage("Decoding patterns.");
+        fboProjWindow.begin(); // Clear projector
+        ofBackground(255);
+        fboProjWindow.end();
+        grayCode.decode();
+        int added = addStructuredLightPointPairs();
+        ofLogVerbose("KinectProjector") << "updateProjKinectStructuredLightCalibration(): " << added << " point pairs added" ;
+        grayCode.clearCaptures();
+        if (upframe){ // We are done
+            calibModal->setMessage("Updating acquision ceiling.");
+            updateMaxOffset(); // Find max offset
+            structuredLightState = STRUCTURED_LIGHT_STATE_COMPUTE;
+        } else { // We ask for higher points
+            structuredLightState = STRUCTURED_LIGHT_STATE_WAIT_FOR_BOARD;
             calibModal->hide();
-            //saveCalibrationAndSettings(); // Already done in updateROIFromCalibration
+            confirmModal->show();
+            confirmModal->setMessage("Please cover the sandbox with a board and press ok.");
         }
-        autoCalibState = AUTOCALIB_STATE_DONE;
-    } else if (autoCalibState == AUTOCALIB_STATE_DONE){
+    } else if (structuredLightState == STRUCTURED_LIGHT_STATE_WAIT_FOR_BOARD){
+        if (upframe){
+            currentPattern = 0;
+            structuredLightState = STRUCTURED_LIGHT_STATE_PROJECT;
+        }
+    } else if (structuredLightState == STRUCTURED_LIGHT_STATE_COMPUTE){
+        computeProjKinectCalibration();
+        structuredLightState = STRUCTURED_LIGHT_STATE_DONE;
+    } else if (structuredLightState == STRUCTURED_LIGHT_STATE_DONE){
     }
 }
+
 //TODO: Add manual Prj Kinect calibration
 void KinectProjector::updateProjKinectManualCalibration(){
     // Draw a Chessboard
@@ -672,9 +836,7 @@ void KinectProjector::updateMaxOffset(){
     maxOffsetBack = maxOffset;
     // Update max Offset
     ofLogVerbose("KinectProjector") << "updateMaxOffset(): maxOffset" << maxOffset ;
-    kinectgrabber.performInThread([this](KinectGrabber & kg) {
-        kg.setMaxOffset(this->maxOffset);
-    });
+    kinectgrabber.setMaxOffset(maxOffset);
 }
 
 bool KinectProjector::addPointPair() {
@@ -702,6 +864,112 @@ bool KinectProjector::addPointPair() {
     return okchess;
 }
 
+void KinectProjector::updateDepthCorrectionCalibration(){
+    if (depthCorrectionState == DEPTH_CORRECTION_STATE_INIT){
+        depthCorrection.clearSamples();
+        kinectgrabber.performInThread([](KinectGrabber & kg) {
+            kg.clearDepthCorrection(); // We learn from the raw kinect depth
+        });
+        depthCorrectionState = DEPTH_CORRECTION_STATE_RESET_BUFFERS;
+    } else if (depthCorrectionState == DEPTH_CORRECTION_STATE_RESET_BUFFERS){
+        calibModal->setMessage("Stabilizing acquisition.");
+        kinectgrabber.performInThread([](KinectGrabber & kg) {
+            kg.resetBuffers();
+        });
+        imageStabilized = false; // Now we can wait for a clean new depth frame
+        depthCorrectionState = DEPTH_CORRECTION_STATE_ACQUIRE;
+    } else if (depthCorrectionState == DEPTH_CORRECTION_STATE_ACQUIRE && imageStabilized){
+        string mess = "Acquiring flat surface "+std::to_string(depthCorrection.getNumAcquisitions()+1)+"/"+std::to_string(numDepthCorrectionLevels)+".";
+        calibModal->setMessage(mess);
+        addDepthCorrectionSamples();
+        if (depthCorrection.getNumAcquisitions() < numDepthCorrectionLevels){
+            depthCorrectionState = DEPTH_CORRECTION_STATE_WAIT_FOR_NEXT_LEVEL;
+            calibModal->hide();
+            confirmModal->show();
+            confirmModal->setMessage("Please put a flat board at a different height over the sand and press ok.");
+        } else {
+            depthCorrectionState = DEPTH_CORRECTION_STATE_COMPUTE;
+        }
+    } else if (depthCorrectionState == DEPTH_CORRECTION_STATE_COMPUTE){
+        if (depthCorrection.compute()){
+            if (depthCorrection.save("settings/depthCorrection.bin"))
+            {
+                ofLogVerbose("KinectProjector") << "updateDepthCorrectionCalibration(): Depth correction saved " ;
+            } else {
+                ofLogVerbose("KinectProjector") << "updateDepthCorrectionCalibration(): Depth correction could not be saved " ;
+            }
+            vector<float> gains = depthCorrection.getGains();
+            vector<float> offsets = depthCorrection.getOffsets();
+            kinectgrabber.performInThread([gains, offsets](KinectGrabber & kg) {
+                kg.setDepthCorrection(gains, offsets);
+                kg.resetBuffers();
+            });
+            imageStabilized = false;
+            calibModal->setMessage("Depth correction successfull.");
+            calibModal->hide();
+        } else {
+            calibModal->hide();
+            confirmModal->setTitle("Calibration failed");
+            confirmModal->setMessage("The depth correction could not be computed.");
+            confirmModal->show();
+        }
+        calibrating = false;
+        depthCorrectionState = DEPTH_CORRECTION_STATE_DONE;
+    } else if (depthCorrectionState == DEPTH_CORRECTION_STATE_DONE){
+    }
+}
+
+void KinectProjector::addDepthCorrectionSamples(){
+    // Fit a plane on the central part of the flat surface
+    ofRectangle smallROI = kinectROI;
+    smallROI.scaleFromCenter(0.75); // Reduce ROI to avoid problems with borders
+    int sw = static_cast<int>(smallROI.width);
+    int sh = static_cast<int>(smallROI.height);
+    int sl = static_cast<int>(smallROI.getLeft());
+    int st = static_cast<int>(smallROI.getTop());
+    if (sw*sh == 0) {
+        ofLogVerbose("KinectProjector") << "addDepthCorrectionSamples(): smallROI is null, cannot compute plane" ;
+        return;
+    }
+    vector<ofVec3f> points;
+    for (int x = 0; x<sw; x++){
+        for (int y = 0; y<sh; y ++){
+            ofVec3f wc = kinectCoordToWorldCoord(x+sl, y+st);
+            if (wc.z > 0)
+                points.push_back(wc);
+        }
+    }
+    ofVec4f planeEq = plane_from_points(points.data(), points.size());
+    
+    // Depth of the plane seen from each kinect pixel: the world coordinates of
+    // kinect pixel (x, y) at depth z are z*(m00*x+m03, m11*y+m13, 1)
+    float* depthPtr = FilteredDepthImage.getFloatPixelsRef().getData();
+    for (int y = kinectROI.getTop(); y < kinectROI.getBottom(); y++){
+        for (int x = kinectROI.getLeft(); x < kinectROI.getRight(); x++){
+            ofVec3f ray = ofVec3f(kinectWorldMatrix(0, 0)*x+kinectWorldMatrix(0, 3), kinectWorldMatrix(1, 1)*y+kinectWorldMatrix(1, 3), 1);
+            float den = ofVec3f(planeEq).dot(ray);
+            if (den != 0)
+                depthCorrection.addSample(x, y, depthPtr[y*(int)kinectRes.x+x], -planeEq.w/den);
+        }
+    }
+    depthCorrection.endAcquisition();
+}
+
+int KinectProjector::addStructuredLightPointPairs() {
+    const vector<GrayCodeCalibration::Correspondence> & correspondences = grayCode.getCorrespondences();
+    int step = max(1, (int)correspondences.size()/maxStructuredLightPairs); // Subsample to keep the least square problem small
+    int added = 0;
+    for (int i=0; i<correspondences.size(); i+=step) {
+        ofVec3f worldPoint = kinectCoordToWorldCoord(correspondences[i].kinect.x, correspondences[i].kinect.y);
+        if (worldPoint.z > 0) {
+            pairsKinect.push_back(worldPoint);
+            pairsProjector.push_back(correspondences[i].projector);
+            added++;
+        }
+    }
+    return added;
+}
+
 void KinectProjector::askToFlattenSand(){
     fboProjWindow.begin();
     ofBackground(255);
@@ -713,6 +981,12 @@ void KinectProjector::askToFlattenSand(){
 
 void KinectProjector::drawProjectorWindow(){
     fboProjWindow.draw(0,0);
+    // The kinect frames captured from now on can see the pattern drawn in the projector window
+    if (calibrating && calibrationState == CALIBRATION_STATE_PROJ_KINECT_STRUCTURED_LIGHT_CALIBRATION
+        && structuredLightState == STRUCTURED_LIGHT_STATE_CAPTURE && !patternShown){
+        patternShownFrame = kinectgrabber.getNumCapturedFrames();
+        patternShown = true;
+    }
 }
 
 void KinectProjector::drawMainWindow(float x, float y, float width, float height){
@@ -761,6 +1035,8 @@ void KinectProjector::drawGradField()
             float y = rowPos*gradFieldResolution  + gradFieldResolution/2;
             ofVec2f projectedPoint = kinectCoordToProjCoord(x, y);
             int ind = colPos + rowPos * gradFieldcols;
+            if (ind >= gradField.size()) // The grabber did not send the field of the new resolution yet
+                return;
             ofVec2f v2 = gradField[ind];
             v2 *= arrowLength;
 
@@ -788,8 +1064,144 @@ void KinectProjector::drawArrow(ofVec2f projectedPoint, ofVec2f v1)
     ofPopMatrix();
 }
 
+void KinectProjector::allocateFilteredDepthTexture(){
+    // 16 bits normalized or 8 bits texture, both sampled as 0..1 by the shaders
+    if (highPrecisionDepth){
+        ofShortPixels emptyDepth;
+        emptyDepth.allocate(kinectRes.x, kinectRes.y, 1);
+        emptyDepth.set(0);
+        FilteredDepthTexture.allocate(emptyDepth);
+    } else {
+        ofPixels emptyDepth;
+        emptyDepth.allocate(kinectRes.x, kinectRes.y, 1);
+        emptyDepth.set(0);
+        FilteredDepthTexture.allocate(emptyDepth);
+    }
+    int bytesPerPixel = highPrecisionDepth ? 2 : 1;
+    FilteredDepthPbos.resize(3);
+    for (auto & pbo : FilteredDepthPbos)
+        pbo.allocate(kinectRes.x*kinectRes.y*bytesPerPixel, GL_STREAM_DRAW);
+    FilteredDepthPboIndex = 0;
+    uploadFilteredDepth(vector<ofRectangle>(1, ofRectangle(0, 0, kinectRes.x, kinectRes.y)));
+    ofLogVerbose("KinectProjector") << "allocateFilteredDepthTexture(): " << 8*bytesPerPixel << " bits depth texture";
+}
+
+void KinectProjector::setHighPrecisionDepth(bool shighPrecisionDepth){
+    if (shighPrecisionDepth == highPrecisionDepth)
+        return;
+    highPrecisionDepth = shighPrecisionDepth;
+    allocateFilteredDepthTexture();
+    depthFrameUpdated = true; // The surface has to be rendered again
+}
+
 void KinectProjector::updateNativeScale(float scaleMin, float scaleMax){
     FilteredDepthImage.setNativeScale(scaleMin, scaleMax);
+    uploadFilteredDepth(vector<ofRectangle>(1, ofRectangle(0, 0, kinectRes.x, kinectRes.y))); // The whole texture is rescaled
+}
+
+bool KinectProjector::updateFilteredDepth(const ofFloatPixels & filteredframe){
+    if (changedDepthTiles.size() != depthTilesCols*depthTilesRows)
+        changedDepthTiles.assign(depthTilesCols*depthTilesRows, 1);
+    IplImage* cvImage = FilteredDepthImage.getCvImage();
+    const float* framePtr = filteredframe.getData();
+    int width = kinectRes.x;
+    vector<ofRectangle> & regions = changedDepthRegions;
+    regions.clear();
+    for (int ty = 0; ty < depthTilesRows; ty++){
+        int tx = 0;
+        while (tx < depthTilesCols){
+            if (!changedDepthTiles[ty*depthTilesCols+tx]){
+                tx++;
+                continue;
+            }
+            // Runs of changed tiles are copied and uploaded together
+            int startTx = tx;
+            while (tx < depthTilesCols && changedDepthTiles[ty*depthTilesCols+tx])
+                tx++;
+            int x0 = startTx*depthTileSize;
+            int x1 = min(tx*depthTileSize, width);
+            int y0 = ty*depthTileSize;
+            int y1 = min((ty+1)*depthTileSize, (int)kinectRes.y);
+            for (int y = y0; y < y1; y++)
+                memcpy(reinterpret_cast<float*>(cvImage->imageData+y*cvImage->widthStep)+x0, framePtr+y*width+x0, (x1-x0)*sizeof(float));
+            regions.push_back(ofRectangle(x0, y0, x1-x0, y1-y0));
+        }
+    }
+    if (regions.empty())
+        return false;
+    FilteredDepthImage.flagImageChanged();
+    uploadFilteredDepth(regions);
+    return true;
+}
+
+void KinectProjector::uploadFilteredDepth(const vector<ofRectangle> & regions){
+    // The regions are written in the next pixel buffer of the ring, orphaned first so that
+    // mapping never waits for the GPU, and copied to the texture asynchronously by the driver
+    ofBufferObject & pbo = FilteredDepthPbos[FilteredDepthPboIndex];
+    FilteredDepthPboIndex = (FilteredDepthPboIndex+1)%FilteredDepthPbos.size();
+    int width = kinectRes.x;
+    int bytesPerPixel = highPrecisionDepth ? 2 : 1;
+    pbo.setData(width*kinectRes.y*bytesPerPixel, NULL, GL_STREAM_DRAW);
+    void* pboData = pbo.map(GL_WRITE_ONLY);
+    if (pboData == NULL){
+        ofLogError("KinectProjector") << "uploadFilteredDepth(): could not map the pixel buffer";
+        return;
+    }
+    if (highPrecisionDepth)
+        convertDepthRegions(FilteredDepthImage, regions, static_cast<unsigned short*>(pboData), 65535);
+    else
+        convertDepthRegions(FilteredDepthImage, regions, static_cast<unsigned char*>(pboData), 255);
+    pbo.unmap();
+    
+    ofTextureData & texData = FilteredDepthTexture.getTextureData();
+    pbo.bind(GL_PIXEL_UNPACK_BUFFER);
+    glBindTexture(texData.textureTarget, texData.textureID);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, bytesPerPixel);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+    for (auto & region : regions){
+        size_t offset = (region.getMinY()*width+region.getMinX())*bytesPerPixel; // Offset in the bound pixel buffer
+        glTexSubImage2D(texData.textureTarget, 0, region.x, region.y, region.width, region.height,
+                        ofGetGLFormatFromInternal(texData.glInternalFormat), highPrecisionDepth ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE,
+                        reinterpret_cast<const void*>(offset));
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(texData.textureTarget, 0);
+    pbo.unbind(GL_PIXEL_UNPACK_BUFFER);
+}
+
+void KinectProjector::setComputeNormals(bool scomputeNormals){
+    if (scomputeNormals && !computeNormals)
+        normalsFullUpload = true; // The texture missed the changes made while the normals were off
+    computeNormals = scomputeNormals;
+    if (computeNormals && !NormalsTexture.isAllocated()){
+        ofPixels flatNormals; // Flat surface until the first normals are received
+        flatNormals.allocate(kinectRes.x, kinectRes.y, 3);
+        for (int i = 0; i < flatNormals.size(); i += 3){
+            flatNormals[i] = 128;
+            flatNormals[i+1] = 128;
+            flatNormals[i+2] = 255;
+        }
+        NormalsTexture.allocate(flatNormals);
+    }
+    kinectgrabber.setComputeNormals(computeNormals);
+}
+
+void KinectProjector::uploadNormals(const ofPixels & normalsframe, const vector<ofRectangle> & regions){
+    // Usually the same regions as the depth, uploaded straight from the received frame
+    int width = kinectRes.x;
+    ofTextureData & texData = NormalsTexture.getTextureData();
+    glBindTexture(texData.textureTarget, texData.textureID);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+    for (auto & region : regions){
+        const unsigned char* regionPtr = normalsframe.getData()+3*(static_cast<int>(region.getMinY())*width+static_cast<int>(region.getMinX()));
+        glTexSubImage2D(texData.textureTarget, 0, region.x, region.y, region.width, region.height,
+                        GL_RGB, GL_UNSIGNED_BYTE, regionPtr);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(texData.textureTarget, 0);
 }
 
 ofVec2f KinectProjector::kinectCoordToProjCoord(float x, float y) // x, y in kinect pixel coord
@@ -856,6 +1268,55 @@ float KinectProjector::elevationAtKinectCoord(float x, float y) // x, y in kinec
     return elevation;
 }
 
+float KinectProjector::kinectPixelSizeOnSand()
+{
+    // At the sand depth, or at the calibrated base plane depth before the first frame
+    ofVec2f center = kinectROI.getCenter();
+    ofVec3f a = kinectCoordToWorldCoord(center.x, center.y);
+    float depth = a.z > 0 ? a.z : basePlaneOffset.z;
+    if (depth <= 0)
+        return 0;
+    return abs(kinectWorldMatrix(0, 0))*depth;
+}
+
+const ofFloatPixels & KinectProjector::getElevationPixels()
+{
+    if (!elevationPixels.isAllocated() || basePlaneEq != elevationBasePlaneEq || kinectROI != elevationROI){
+        elevationPixels.allocate(kinectRes.x, kinectRes.y, 1);
+        elevationDirtyTiles.assign(depthTilesCols*depthTilesRows, 1);
+        elevationBasePlaneEq = basePlaneEq;
+        elevationROI = kinectROI;
+    }
+    const float* depthPtr = FilteredDepthImage.getFloatPixelsRef().getData();
+    float* elevationPtr = elevationPixels.getData();
+    int width = kinectRes.x;
+    for (int ty = 0; ty < depthTilesRows; ty++){
+        for (int tx = 0; tx < depthTilesCols; tx++){
+            if (!elevationDirtyTiles[ty*depthTilesCols+tx])
+                continue;
+            elevationDirtyTiles[ty*depthTilesCols+tx] = 0;
+            shoreDistanceDirty = true;
+            int x1 = min((tx+1)*depthTileSize, width);
+            int y1 = min((ty+1)*depthTileSize, (int)kinectRes.y);
+            for (int y = ty*depthTileSize; y < y1; y++){
+                for (int x = tx*depthTileSize; x < x1; x++){
+                    int ind = y*width+x;
+                    if (!kinectROI.inside(x, y)){
+                        elevationPtr[ind] = NAN;
+                        continue;
+                    }
+                    // Same as elevationAtKinectCoord
+                    ofVec4f kc(x, y, depthPtr[ind], 1);
+                    ofVec4f wc = kinectWorldMatrix*kc*kc.z;
+                    wc.w = 1;
+                    elevationPtr[ind] = -basePlaneEq.dot(wc);
+                }
+            }
+        }
+    }
+    return elevationPixels;
+}
+
 float KinectProjector::elevationToKinectDepth(float elevation, float x, float y) // x, y in kinect pixel coordinate
 {
     ofVec4f wc = kinectCoordToWorldCoord(x, y);
@@ -868,9 +1329,38 @@ float KinectProjector::elevationToKinectDepth(float elevation, float x, float y)
 ofVec2f KinectProjector::gradientAtKinectCoord(float x, float y){
     int ind = static_cast<int>(floor(x/gradFieldResolution)) + gradFieldcols*static_cast<int>(floor(y/gradFieldResolution));
     fishInd = ind;
+    if (ind < 0 || ind >= gradField.size()) // Outside, or field of the new resolution not received yet
+        return ofVec2f(0);
     return gradField[ind];
 }
 
+void KinectProjector::updateShoreDistance(){
+    const ofFloatPixels & elevation = getElevationPixels();
+    if (!shoreDistanceDirty)
+        return;
+    shoreDistanceField.update(elevation);
+    shoreDistanceDirty = false;
+}
+
+float KinectProjector::shoreDistanceAtKinectCoord(float x, float y){
+    updateShoreDistance();
+    int ix = ofClamp(static_cast<int>(x), 0, kinectRes.x-1);
+    int iy = ofClamp(static_cast<int>(y), 0, kinectRes.y-1);
+    return shoreDistanceField.getDistance(ix, iy);
+}
+
+ofVec2f KinectProjector::shoreGradientAtKinectCoord(float x, float y){
+    updateShoreDistance();
+    int ix = ofClamp(static_cast<int>(x), 0, kinectRes.x-1);
+    int iy = ofClamp(static_cast<int>(y), 0, kinectRes.y-1);
+    return shoreDistanceField.getGradient(ix, iy);
+}
+
+const ShoreDistanceField & KinectProjector::getShoreDistanceField(){
+    updateShoreDistance();
+    return shoreDistanceField;
+}
+
 void KinectProjector::setupGui(){
     // instantiate and position the gui //
     gui = new ofxDatGui( ofxDatGuiAnchor::TOP_RIGHT );
@@ -888,8 +1378,11 @@ void KinectProjector::setupGui(){
     advancedFolder->addToggle("Spatial filtering", spatialFiltering);
     advancedFolder->addToggle("Quick reaction", followBigChanges);
     advancedFolder->addSlider("Averaging", 1, 40, numAveragingSlots)->setPrecision(0);
+    advancedFolder->addToggle("16 bits depth texture", highPrecisionDepth)->setName("High precision depth");
     advancedFolder->addBreak();
     advancedFolder->addButton("Calibrate")->setName("Full Calibration");
+    advancedFolder->addButton("Calibrate with structured light")->setName("Structured Light Calibration");
+    advancedFolder->addButton("Calibrate depth correction")->setName("Depth Correction Calibration");
 //	advancedFolder->addButton("Update ROI from calibration");
 //    gui->addButton("Automatically detect sand region");
 //    calibrationFolder->addButton("Manually define sand region");
@@ -940,23 +1433,43 @@ void KinectProjector::startAutomaticKinectProjectorCalibration(){
     ofLogVerbose("KinectProjector") << "startAutomaticKinectProjectorCalibration(): Starting autocalib" ;
 }
 
+void KinectProjector::startStructuredLightCalibration(){
+    calibrating = true;
+    calibrationState = CALIBRATION_STATE_PROJ_KINECT_STRUCTURED_LIGHT_CALIBRATION;
+    structuredLightState = STRUCTURED_LIGHT_STATE_INIT;
+    confirmModal->setTitle("Calibrate projector");
+    calibModal->setTitle("Calibrate projector");
+    askToFlattenSand();
+    ofLogVerbose("KinectProjector") << "startStructuredLightCalibration(): Starting structured light calibration" ;
+}
+
+void KinectProjector::startDepthCorrectionCalibration(){
+    calibrating = true;
+    calibrationState = CALIBRATION_STATE_DEPTH_CORRECTION;
+    depthCorrectionState = DEPTH_CORRECTION_STATE_INIT;
+    confirmModal->setTitle("Depth correction");
+    calibModal->setTitle("Depth correction");
+    askToFlattenSand();
+    ofLogVerbose("KinectProjector") << "startDepthCorrectionCalibration(): Starting depth correction calibration" ;
+}
+
 void KinectProjector::setSpatialFiltering(bool sspatialFiltering){
     spatialFiltering = sspatialFiltering;
-    kinectgrabber.performInThread([sspatialFiltering](KinectGrabber & kg) {
-        kg.setSpatialFiltering(sspatialFiltering);
-    });
+    kinectgrabber.setSpatialFiltering(sspatialFiltering);
 }
 
 void KinectProjector::setFollowBigChanges(bool sfollowBigChanges){
     followBigChanges = sfollowBigChanges;
-    kinectgrabber.performInThread([sfollowBigChanges](KinectGrabber & kg) {
-        kg.setFollowBigChange(sfollowBigChanges);
-    });
+    kinectgrabber.setFollowBigChange(sfollowBigChanges);
 }
 
 void KinectProjector::onButtonEvent(ofxDatGuiButtonEvent e){
     if (e.target->is("Full Calibration")) {
         startFullCalibration();
+    } else if (e.target->is("Structured Light Calibration")) {
+        startStructuredLightCalibration();
+    } else if (e.target->is("Depth Correction Calibration")) {
+        startDepthCorrectionCalibration();
     } else if (e.target->is("Update ROI from calibration")) {
 		updateROIFromCalibration();
 	} else if (e.target->is("Automatically detect sand region")) {
@@ -985,6 +1498,8 @@ void KinectProjector::onToggleEvent(ofxDatGuiToggleEvent e){
         setFollowBigChanges(e.checked);
     } else if (e.target->is("Draw kinect depth view")){
         drawKinectView = e.checked;
+    } else if (e.target->is("High precision depth")){
+        setHighPrecisionDepth(e.checked);
     }
 }
 
@@ -1001,14 +1516,10 @@ void KinectProjector::onSliderEvent(ofxDatGuiSliderEvent e){
     } else if (e.target->is("Ceiling")){
         maxOffset = maxOffsetBack-e.value;
         ofLogVerbose("KinectProjector") << "onSliderEvent(): maxOffset" << maxOffset ;
-        kinectgrabber.performInThread([this](KinectGrabber & kg) {
-            kg.setMaxOffset(this->maxOffset);
-        });
+        kinectgrabber.setMaxOffset(maxOffset);
     } else if(e.target->is("Averaging")){
         numAveragingSlots = e.value;
-        kinectgrabber.performInThread([e](KinectGrabber & kg) {
-            kg.setAveragingSlotsNumber(e.value);
-        });
+        kinectgrabber.setAveragingSlotsNumber(e.value);
     }
 }
 
@@ -1038,6 +1549,12 @@ void KinectProjector::onConfirmModalEvent(ofxModalEvent e){
                 if (!upframe){
                     upframe = true;
                 }
+            } else if (calibrationState == CALIBRATION_STATE_PROJ_KINECT_STRUCTURED_LIGHT_CALIBRATION
+                       && structuredLightState == STRUCTURED_LIGHT_STATE_WAIT_FOR_BOARD){
+                upframe = true;
+            } else if (calibrationState == CALIBRATION_STATE_DEPTH_CORRECTION
+                       && depthCorrectionState == DEPTH_CORRECTION_STATE_WAIT_FOR_NEXT_LEVEL){
+                depthCorrectionState = DEPTH_CORRECTION_STATE_RESET_BUFFERS;
             }
         }
 		if (!kinectOpened) {
@@ -1091,6 +1608,11 @@ bool KinectProjector::loadSettings(){
     spatialFiltering = xml.getValue<bool>("spatialFiltering");
     followBigChanges = xml.getValue<bool>("followBigChanges");
     numAveragingSlots = xml.getValue<int>("numAveragingSlots");
+    highPrecisionDepth = xml.getValue<bool>("highPrecisionDepth", true);
+    minStableFraction = xml.getValue<float>("minStableFraction", 0.8f);
+    maxChangeRate = xml.getValue<float>("maxChangeRate", 0.002f);
+    minConvergedFrames = xml.getValue<int>("minConvergedFrames", 5);
+    maxConvergenceWaitFrames = xml.getValue<int>("maxConvergenceWaitFrames", 300);
     return true;
 }
 
@@ -1108,6 +1630,11 @@ bool KinectProjector::saveSettings(){
     xml.addValue("spatialFiltering", spatialFiltering);
     xml.addValue("followBigChanges", followBigChanges);
     xml.addValue("numAveragingSlots", numAveragingSlots);
+    xml.addValue("highPrecisionDepth", highPrecisionDepth);
+    xml.addValue("minStableFraction", minStableFraction);
+    xml.addValue("maxChangeRate", maxChangeRate);
+    xml.addValue("minConvergedFrames", minConvergedFrames);
+    xml.addValue("maxConvergenceWaitFrames", maxConvergenceWaitFrames);
     xml.setToParent();
     return xml.save(settingsFile);
 }
\ No newline at end of file
@@ -32,6 +32,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #include "ofxModal.h"
 
 #include "KinectProjectorCalibration.h"
+#include "GrayCodeCalibration.h"
+#include "DepthCorrection.h"
+#include "ShoreDistanceField.h"
 #include "Utils.h"
 
 class ofxModalThemeProjKinect : public ofxModalTheme {
@@ -65,15 +68,29 @@ public:
 	ofVec3f RawKinectCoordToWorldCoord(float x, float y);
     float elevationAtKinectCoord(float x, float y);
     float elevationToKinectDepth(float elevation, float x, float y);
+    float kinectPixelSizeOnSand(); // Width (mm) of a kinect pixel on the sand (or the base plane) at the ROI center, 0 if unknown
+    // Elevation of every kinect pixel (same as elevationAtKinectCoord, NaN outside of the ROI),
+    // only the depth tiles changed since the previous call are computed again
+    const ofFloatPixels & getElevationPixels();
     ofVec2f gradientAtKinectCoord(float x, float y);
+    // Signed distance (kinect pixels) to the shoreline, positive on land and negative in the water,
+    // and its gradient (away from the water on land, toward the land in the water).
+    // The field is computed again by the first call after the elevation changed.
+    float shoreDistanceAtKinectCoord(float x, float y);
+    ofVec2f shoreGradientAtKinectCoord(float x, float y);
+    const ShoreDistanceField & getShoreDistanceField(); // Up to date with the elevation, for batch lookups
     
     // Setup & calibration functions
     void startFullCalibration();
     void startAutomaticROIDetection();
     void startAutomaticKinectProjectorCalibration();
+    void startStructuredLightCalibration();
+    void startDepthCorrectionCalibration();
     void setGradFieldResolution(int gradFieldResolution);
     void setSpatialFiltering(bool sspatialFiltering);
     void setFollowBigChanges(bool sfollowBigChanges);
+    void setHighPrecisionDepth(bool shighPrecisionDepth);
+    void setComputeNormals(bool scomputeNormals); // Surface normals computed by the grabber for the hillshading
     
     // Gui and event functions
     void setupGui();
@@ -85,10 +102,10 @@ public:
     
     // Functions for shaders
     void bind(){
-        FilteredDepthImage.getTexture().bind();
+        FilteredDepthTexture.bind();
     }
     void unbind(){
-        FilteredDepthImage.getTexture().unbind();
+        FilteredDepthTexture.unbind();
     }
     ofMatrix4x4 getTransposedKinectWorldMatrix(){
         return kinectWorldMatrix.getTransposedOf(kinectWorldMatrix);
@@ -99,7 +116,10 @@ public:
     
     // Getter and setter
     ofTexture & getTexture(){
-        return FilteredDepthImage.getTexture();
+        return FilteredDepthTexture;
+    }
+    ofTexture & getNormalsTexture(){ // Allocated once the normals are computed
+        return NormalsTexture;
     }
     ofRectangle getKinectROI(){
         return kinectROI;
@@ -125,9 +145,28 @@ public:
     bool isImageStabilized(){
         return imageStabilized;
     }
+    float getStabilizationProgress(){
+        return kinectgrabber.getStabilizationProgress();
+    }
     bool isBasePlaneUpdated(){ // To be called after update()
         return basePlaneUpdated;
     }
+    bool isDepthFrameUpdated(){ // To be called after update()
+        return depthFrameUpdated;
+    }
+    
+    const ofFloatPixels & getFilteredDepthPixels(){
+        return FilteredDepthImage.getFloatPixelsRef();
+    }
+    
+    // Changed tiles of the last depth frame (one byte per tile, row major), to be called after update()
+    const vector<unsigned char> & getChangedDepthTiles(){
+        return changedDepthTiles;
+    }
+    int getDepthTileSize(){
+        return depthTileSize;
+    }
+    
     bool isROIUpdated(){ // To be called after update()
         return ROIUpdated;
     }
@@ -142,7 +181,9 @@ private:
         CALIBRATION_STATE_ROI_AUTO_DETERMINATION,
         CALIBRATION_STATE_ROI_MANUAL_DETERMINATION,
         CALIBRATION_STATE_PROJ_KINECT_AUTO_CALIBRATION,
-        CALIBRATION_STATE_PROJ_KINECT_MANUAL_CALIBRATION
+        CALIBRATION_STATE_PROJ_KINECT_MANUAL_CALIBRATION,
+        CALIBRATION_STATE_PROJ_KINECT_STRUCTURED_LIGHT_CALIBRATION,
+        CALIBRATION_STATE_DEPTH_CORRECTION
     };
     enum Full_Calibration_state
     {
@@ -165,6 +206,25 @@ private:
         AUTOCALIB_STATE_COMPUTE,
         AUTOCALIB_STATE_DONE
     };
+    enum Structured_light_state
+    {
+        STRUCTURED_LIGHT_STATE_INIT,
+        STRUCTURED_LIGHT_STATE_PROJECT,
+        STRUCTURED_LIGHT_STATE_CAPTURE,
+        STRUCTURED_LIGHT_STATE_DECODE,
+        STRUCTURED_LIGHT_STATE_WAIT_FOR_BOARD,
+        STRUCTURED_LIGHT_STATE_COMPUTE,
+        STRUCTURED_LIGHT_STATE_DONE
+    };
+    enum Depth_correction_state
+    {
+        DEPTH_CORRECTION_STATE_INIT,
+        DEPTH_CORRECTION_STATE_RESET_BUFFERS,
+        DEPTH_CORRECTION_STATE_ACQUIRE,
+        DEPTH_CORRECTION_STATE_WAIT_FOR_NEXT_LEVEL,
+        DEPTH_CORRECTION_STATE_COMPUTE,
+        DEPTH_CORRECTION_STATE_DONE
+    };
 
     // Private methods
     void exit(ofEventArgs& e);
@@ -183,9 +243,19 @@ private:
     
     void updateProjKinectAutoCalibration();
     void updateProjKinectManualCalibration();
+    void updateProjKinectStructuredLightCalibration();
+    void computeProjKinectCalibration();
     bool addPointPair();
+    int addStructuredLightPointPairs();
+    void updateDepthCorrectionCalibration();
+    void addDepthCorrectionSamples();
     void updateMaxOffset();
     void updateBasePlane();
+    bool updateFilteredDepth(const ofFloatPixels & filteredframe); // Copy and upload the changed tiles
+    void uploadFilteredDepth(const vector<ofRectangle> & regions);
+    void uploadNormals(const ofPixels & normalsframe, const vector<ofRectangle> & regions);
+    void updateShoreDistance();
+    void allocateFilteredDepthTexture();
     void askToFlattenSand();
 
     void drawChessboard(int x, int y, int chessboardSize);
@@ -202,6 +272,7 @@ private:
     bool projKinectCalibrated;
     bool calibrating;
     bool ROIUpdated;
+    bool depthFrameUpdated;
     bool projKinectCalibrationUpdated;
     bool basePlaneUpdated;
     bool imageStabilized;
@@ -211,6 +282,8 @@ private:
     ROI_calibration_state ROICalibState;
     Auto_calibration_state autoCalibState;
     Full_Calibration_state fullCalibState;
+    Structured_light_state structuredLightState;
+    Depth_correction_state depthCorrectionState;
 
     // Projector window
     std::shared_ptr<ofAppBaseWindow> projWindow;
@@ -220,11 +293,33 @@ private:
     bool                        spatialFiltering;
     bool                        followBigChanges;
     int                         numAveragingSlots;
+    bool                        highPrecisionDepth; // 16 bits depth texture instead of 8 bits
+    float                       minStableFraction; // Convergence thresholds of the grabber
+    float                       maxChangeRate;
+    int                         minConvergedFrames;
+    int                         maxConvergenceWaitFrames; // Startup and calibration steps go on with a warning after this wait
+    int                         convergenceWaitFrames;
 
     //kinect buffer
     ofxCvFloatImage             FilteredDepthImage;
+    ofTexture                   FilteredDepthTexture; // Native scale range mapped to 0..1 (8 or 16 bits), uploaded by tiles
+    vector<ofBufferObject>      FilteredDepthPbos; // Ring of pixel buffers streaming FilteredDepthTexture
+    int                         FilteredDepthPboIndex;
+    vector<unsigned char>       changedDepthTiles;
+    vector<ofRectangle>         changedDepthRegions; // Regions covering the changed tiles of the last frame
+    ofFloatPixels               elevationPixels;
+    vector<unsigned char>       elevationDirtyTiles; // Changed depth tiles accumulated until getElevationPixels()
+    ofVec4f                     elevationBasePlaneEq; // Base plane and ROI of elevationPixels
+    ofRectangle                 elevationROI;
+    ShoreDistanceField          shoreDistanceField;
+    bool                        shoreDistanceDirty; // The elevation changed since the last shoreDistanceField update
+    int                         depthTileSize;
+    int                         depthTilesCols, depthTilesRows;
+    bool                        computeNormals;
+    bool                        normalsFullUpload; // The first normals received after they are turned on are uploaded whole
+    ofTexture                   NormalsTexture; // Packed normals, uploaded by tiles like FilteredDepthTexture
     ofxCvColorImage             kinectColorImage;
-    ofVec2f*                    gradField;
+    vector<ofVec2f>             gradField;
     
     // Projector and kinect variables
     ofVec2f projRes;
@@ -283,6 +378,19 @@ private:
     int   chessboardSize;
     int   chessboardX;
     int   chessboardY;
+    
+    // Structured light (Gray code) calibration variables
+    GrayCodeCalibration         grayCode;
+    int                         currentPattern;
+    bool                        patternShown; // The current pattern was drawn in the projector window
+    unsigned int                patternShownFrame; // Last kinect frame captured before the pattern was shown
+    unsigned int                receivedFrameNumber; // Kinect frame of the last received filtered frame
+    int                         patternWaitFrames; // Kinect frames captured after the pattern was shown to wait (projector latency)
+    int                         maxStructuredLightPairs; // Max number of point pairs kept per acquisition
+    
+    // Depth correction variables
+    DepthCorrection             depthCorrection;
+    int                         numDepthCorrectionLevels; // Number of flat surface heights to acquire
 
     // GUI Modal window & interface
 	bool displayGui;
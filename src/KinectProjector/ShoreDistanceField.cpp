@@ -0,0 +1,167 @@
+/***********************************************************************
+ShoreDistanceField - ShoreDistanceField computes the signed distance to
+the shoreline of every kinect pixel and its gradient.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "ShoreDistanceField.h"
+#include <thread>
+
+namespace {
+    const float farAwayLine = 1e10; // Distance to the features of a column without any
+    const float farAway = farAwayLine*farAwayLine;
+
+    // Squared distance transform of a line of n samples spaced by stride, in place.
+    // f is 0 on the features and farAway elsewhere; v, z and values are scratch buffers.
+    void transformLine(float* f, int n, int stride, vector<int> & v, vector<float> & z, vector<float> & values){
+        for (int q = 0; q < n; q++)
+            values[q] = f[q*stride];
+        // Lower envelope of the parabolas rooted at each sample
+        int k = 0;
+        v[0] = 0;
+        z[0] = -farAway;
+        z[1] = farAway;
+        for (int q = 1; q < n; q++){
+            float s = ((values[q]+q*q)-(values[v[k]]+v[k]*v[k]))/(2*q-2*v[k]);
+            while (s <= z[k]){
+                k--;
+                s = ((values[q]+q*q)-(values[v[k]]+v[k]*v[k]))/(2*q-2*v[k]);
+            }
+            k++;
+            v[k] = q;
+            z[k] = s;
+            z[k+1] = farAway;
+        }
+        k = 0;
+        for (int q = 0; q < n; q++){
+            while (z[k+1] < q)
+                k++;
+            f[q*stride] = (q-v[k])*(q-v[k])+values[v[k]];
+        }
+    }
+}
+
+ShoreDistanceField::ShoreDistanceField()
+:width(0),
+height(0),
+numThreads(1)
+{
+}
+
+void ShoreDistanceField::setup(int swidth, int sheight, int snumThreads){
+    width = swidth;
+    height = sheight;
+    numThreads = snumThreads > 0 ? snumThreads : max(1u, std::thread::hardware_concurrency());
+    water.assign(width*height, 0);
+    toWater.assign(width*height, farAway);
+    toLand.assign(width*height, farAway);
+    distance.allocate(width, height, 1);
+    distance.set(0);
+    gradient.allocate(width, height, 2);
+    gradient.set(0);
+    ofLogVerbose("ShoreDistanceField") << "setup(): " << width << "x" << height << " threads: " << numThreads;
+}
+
+void ShoreDistanceField::update(const ofFloatPixels & elevation){
+    if (width == 0 || elevation.getWidth() != width || elevation.getHeight() != height)
+        return;
+    const float* elevationPtr = elevation.getData();
+    for (int i = 0; i < width*height; i++)
+        water[i] = elevationPtr[i] < 0; // NaN is land
+    runInBands(width, [this](int start, int end){
+        transformColumns(start, end);
+    });
+    runInBands(height, [this](int start, int end){
+        transformRows(start, end);
+    });
+    runInBands(height, [this](int start, int end){
+        computeGradient(start, end);
+    });
+}
+
+void ShoreDistanceField::transformColumns(int startColumn, int endColumn){
+    // Distance to the nearest feature of the column: a downward then an upward
+    // sweep, row by row so that the memory is read in order
+    for (int x = startColumn; x < endColumn; x++){
+        toWater[x] = water[x] ? 0 : farAwayLine;
+        toLand[x] = water[x] ? farAwayLine : 0;
+    }
+    for (int y = 1; y < height; y++)
+        for (int i = y*width+startColumn; i < y*width+endColumn; i++){
+            toWater[i] = water[i] ? 0 : toWater[i-width]+1;
+            toLand[i] = water[i] ? toLand[i-width]+1 : 0;
+        }
+    for (int y = height-2; y >= 0; y--)
+        for (int i = y*width+startColumn; i < y*width+endColumn; i++){
+            toWater[i] = min(toWater[i], toWater[i+width]+1);
+            toLand[i] = min(toLand[i], toLand[i+width]+1);
+        }
+    for (int y = 0; y < height; y++)
+        for (int i = y*width+startColumn; i < y*width+endColumn; i++){
+            toWater[i] *= toWater[i];
+            toLand[i] *= toLand[i];
+        }
+}
+
+void ShoreDistanceField::transformRows(int startRow, int endRow){
+    vector<int> v(width);
+    vector<float> z(width+1);
+    vector<float> values(width);
+    float maxDistance = width+height; // Without any shore
+    float* distancePtr = distance.getData();
+    for (int y = startRow; y < endRow; y++){
+        int rowStart = y*width;
+        transformLine(&toWater[rowStart], width, 1, v, z, values);
+        transformLine(&toLand[rowStart], width, 1, v, z, values);
+        for (int i = rowStart; i < rowStart+width; i++){
+            if (water[i])
+                distancePtr[i] = -min(maxDistance, sqrt(toLand[i])-0.5f);
+            else
+                distancePtr[i] = min(maxDistance, sqrt(toWater[i])-0.5f);
+        }
+    }
+}
+
+void ShoreDistanceField::computeGradient(int startRow, int endRow){
+    // Central differences, one sided on the image borders
+    const float* distancePtr = distance.getData();
+    float* gradientPtr = gradient.getData();
+    for (int y = startRow; y < endRow; y++){
+        int up = max(0, y-1);
+        int down = min(height-1, y+1);
+        for (int x = 0; x < width; x++){
+            int left = max(0, x-1);
+            int right = min(width-1, x+1);
+            int i = y*width+x;
+            gradientPtr[2*i] = (distancePtr[y*width+right]-distancePtr[y*width+left])/(right-left);
+            gradientPtr[2*i+1] = (distancePtr[down*width+x]-distancePtr[up*width+x])/(down-up);
+        }
+    }
+}
+
+void ShoreDistanceField::runInBands(int size, std::function<void(int, int)> work){
+    // Each thread processes a band of rows or columns
+    int numBands = min(numThreads, size);
+    vector<std::thread> workers;
+    for (int i = 1; i < numBands; i++)
+        workers.push_back(std::thread(work, i*size/numBands, (i+1)*size/numBands));
+    work(0, size/numBands);
+    for (auto & worker : workers)
+        worker.join();
+}
@@ -0,0 +1,66 @@
+/***********************************************************************
+ShoreDistanceField - ShoreDistanceField computes the signed distance to
+the shoreline of every kinect pixel and its gradient.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+// Exact euclidean distance transforms in linear time: the distance along
+// the columns, then the lower envelope of parabolas (Felzenszwalb and
+// Huttenlocher) along the rows, split in bands of columns then rows, one
+// per thread.
+// The land cells get their distance to the water and the water cells their
+// distance to the land, the shoreline is half a cell from both.
+class ShoreDistanceField {
+public:
+    ShoreDistanceField();
+
+    void setup(int width, int height, int numThreads = 0);
+    // elevation: height of the sand (mm), the water is under 0, NaN (outside of the sandbox) is land
+    void update(const ofFloatPixels & elevation);
+
+    // Signed distance (cells) to the shoreline, positive on land and negative in the water
+    float getDistance(int x, int y) const {
+        return distance[y*width+x];
+    }
+    // Gradient of the distance: away from the water on land, toward the land in the water
+    ofVec2f getGradient(int x, int y) const {
+        int i = 2*(y*width+x);
+        return ofVec2f(gradient[i], gradient[i+1]);
+    }
+    const ofFloatPixels & getDistancePixels() const {
+        return distance;
+    }
+
+private:
+    void transformColumns(int startColumn, int endColumn);
+    void transformRows(int startRow, int endRow);
+    void computeGradient(int startRow, int endRow);
+    void runInBands(int size, std::function<void(int, int)> work);
+
+    int width, height;
+    int numThreads;
+
+    vector<unsigned char> water;
+    vector<float> toWater, toLand; // Squared distances along the columns, then in the plane
+    ofFloatPixels distance;
+    ofFloatPixels gradient; // 2 channels
+};
@@ -0,0 +1,268 @@
+/***********************************************************************
+LakeDetector - LakeDetector labels the connected water bodies of the
+sandbox (sand under the sea level) and follows them across frames.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "LakeDetector.h"
+#include <thread>
+#include <set>
+
+namespace {
+    int findLocalRoot(vector<int> & parent, int i){
+        while (parent[i] != i){
+            parent[i] = parent[parent[i]]; // Path halving
+            i = parent[i];
+        }
+        return i;
+    }
+}
+
+LakeDetector::LakeDetector()
+:width(0),
+height(0),
+tileSize(32),
+tilesCols(0),
+tilesRows(0),
+numThreads(1),
+cellSize(1.7), // A kinect pixel at 1 m
+initialized(false),
+nextLakeId(1)
+{
+}
+
+void LakeDetector::setup(int swidth, int sheight, int stileSize, int snumThreads){
+    width = swidth;
+    height = sheight;
+    tileSize = stileSize;
+    tilesCols = (width+tileSize-1)/tileSize;
+    tilesRows = (height+tileSize-1)/tileSize;
+    numThreads = snumThreads > 0 ? snumThreads : max(1u, std::thread::hardware_concurrency());
+    localLabels.assign(width*height, 0);
+    tileComponents.assign(tilesCols*tilesRows, vector<TileComponent>());
+    lakes.clear();
+    lakeIndices.clear();
+    initialized = false;
+    ofLogVerbose("LakeDetector") << "setup(): " << width << "x" << height << " tiles: " << tilesCols << "x" << tilesRows << " threads: " << numThreads;
+}
+
+void LakeDetector::update(const ofFloatPixels & elevation, const vector<unsigned char>* changedTiles){
+    if (width == 0 || elevation.getWidth() != width || elevation.getHeight() != height)
+        return;
+    if (!initialized)
+        changedTiles = NULL;
+    initialized = true;
+
+    // The components of the unchanged tiles were in their lake
+    for (int tile = 0; tile < tilesCols*tilesRows; tile++)
+        if (changedTiles != NULL && !(*changedTiles)[tile])
+            for (auto & component : tileComponents[tile])
+                component.previousLakeId = component.lakeId;
+
+    const float* elevationPtr = elevation.getData();
+    runInBands([&](int startTileRow, int endTileRow){
+        for (int tile = startTileRow*tilesCols; tile < endTileRow*tilesCols; tile++)
+            if (changedTiles == NULL || (*changedTiles)[tile])
+                labelTile(tile, elevationPtr);
+    });
+    mergeTiles();
+}
+
+void LakeDetector::labelTile(int tile, const float* elevation){
+    int x0 = (tile%tilesCols)*tileSize;
+    int y0 = (tile/tilesCols)*tileSize;
+    int tileWidth = min(tileSize, width-x0);
+    int tileHeight = min(tileSize, height-y0);
+
+    // Local union-find of the water cells (-1: dry)
+    vector<int> localParent(tileWidth*tileHeight, -1);
+    for (int y = 0; y < tileHeight; y++)
+        for (int x = 0; x < tileWidth; x++){
+            int i = y*tileWidth+x;
+            if (!(elevation[(y0+y)*width+x0+x] < 0)) // NaN is dry
+                continue;
+            localParent[i] = i;
+            if (x > 0 && localParent[i-1] != -1)
+                localParent[findLocalRoot(localParent, i)] = findLocalRoot(localParent, i-1);
+            if (y > 0 && localParent[i-tileWidth] != -1)
+                localParent[findLocalRoot(localParent, i)] = findLocalRoot(localParent, i-tileWidth);
+        }
+
+    // Compact labels and component statistics, the previous lake of each cell votes
+    const vector<TileComponent> & previousComponents = tileComponents[tile];
+    vector<TileComponent> components;
+    vector<unsigned short> rootLabels(tileWidth*tileHeight, 0);
+    std::map<std::pair<int, int>, int> votes; // (component, previous lake id) -> cells
+    for (int y = 0; y < tileHeight; y++)
+        for (int x = 0; x < tileWidth; x++){
+            int i = y*tileWidth+x;
+            int cell = (y0+y)*width+x0+x;
+            int previousLabel = localLabels[cell];
+            if (localParent[i] == -1){
+                localLabels[cell] = 0;
+                continue;
+            }
+            int root = findLocalRoot(localParent, i);
+            if (rootLabels[root] == 0){
+                TileComponent component = {0, 0, 0, x0+x, y0+y, x0+x, y0+y, 0, 0, 0, 0};
+                components.push_back(component);
+                rootLabels[root] = components.size();
+            }
+            int label = rootLabels[root];
+            TileComponent & component = components[label-1];
+            float depth = -elevation[cell];
+            component.area++;
+            component.depthSum += depth;
+            component.maxDepth = max(component.maxDepth, depth);
+            component.minX = min(component.minX, x0+x);
+            component.minY = min(component.minY, y0+y);
+            component.maxX = max(component.maxX, x0+x);
+            component.maxY = max(component.maxY, y0+y);
+            component.sumX += x0+x;
+            component.sumY += y0+y;
+            if (previousLabel != 0 && previousLabel <= previousComponents.size())
+                votes[std::make_pair(label-1, previousComponents[previousLabel-1].lakeId)]++;
+            localLabels[cell] = label;
+        }
+    vector<int> bestVotes(components.size(), 0);
+    for (auto & vote : votes)
+        if (vote.second > bestVotes[vote.first.first]){
+            bestVotes[vote.first.first] = vote.second;
+            components[vote.first.first].previousLakeId = vote.first.second;
+        }
+    tileComponents[tile] = std::move(components);
+}
+
+int LakeDetector::findRoot(int component){
+    return findLocalRoot(parent, component);
+}
+
+void LakeDetector::mergeTiles(){
+    int numTiles = tilesCols*tilesRows;
+    componentOffset.resize(numTiles);
+    int numComponents = 0;
+    for (int tile = 0; tile < numTiles; tile++){
+        componentOffset[tile] = numComponents;
+        numComponents += tileComponents[tile].size();
+    }
+    parent.resize(numComponents);
+    for (int c = 0; c < numComponents; c++)
+        parent[c] = c;
+
+    // Union of the components touching across the tile borders
+    auto component = [&](int x, int y){
+        return componentOffset[(y/tileSize)*tilesCols+x/tileSize]+localLabels[y*width+x]-1;
+    };
+    for (int x = tileSize; x < width; x += tileSize)
+        for (int y = 0; y < height; y++)
+            if (localLabels[y*width+x-1] != 0 && localLabels[y*width+x] != 0)
+                parent[findRoot(component(x-1, y))] = findRoot(component(x, y));
+    for (int y = tileSize; y < height; y += tileSize)
+        for (int x = 0; x < width; x++)
+            if (localLabels[(y-1)*width+x] != 0 && localLabels[y*width+x] != 0)
+                parent[findRoot(component(x, y-1))] = findRoot(component(x, y));
+
+    // One lake per root
+    vector<Lake> newLakes;
+    vector<double> depthSums, sumsX, sumsY;
+    vector<int> rootLakes(numComponents, -1);
+    std::map<std::pair<int, int>, int> overlaps; // (new lake, previous lake id) -> cells
+    for (int tile = 0; tile < numTiles; tile++)
+        for (int k = 0; k < tileComponents[tile].size(); k++){
+            const TileComponent & c = tileComponents[tile][k];
+            int root = findRoot(componentOffset[tile]+k);
+            if (rootLakes[root] == -1){
+                rootLakes[root] = newLakes.size();
+                Lake lake = {0, 0, 0, 0, ofRectangle(c.minX, c.minY, 0, 0), ofVec2f()};
+                newLakes.push_back(lake);
+                depthSums.push_back(0);
+                sumsX.push_back(0);
+                sumsY.push_back(0);
+            }
+            int l = rootLakes[root];
+            Lake & lake = newLakes[l];
+            lake.area += c.area;
+            lake.maxDepth = max(lake.maxDepth, c.maxDepth);
+            float minX = min(lake.boundingBox.getMinX(), (float)c.minX);
+            float minY = min(lake.boundingBox.getMinY(), (float)c.minY);
+            float maxX = max(lake.boundingBox.getMaxX(), c.maxX+1.0f);
+            float maxY = max(lake.boundingBox.getMaxY(), c.maxY+1.0f);
+            lake.boundingBox = ofRectangle(minX, minY, maxX-minX, maxY-minY);
+            depthSums[l] += c.depthSum;
+            sumsX[l] += c.sumX;
+            sumsY[l] += c.sumY;
+            if (c.previousLakeId != 0)
+                overlaps[std::make_pair(l, c.previousLakeId)] += c.area;
+        }
+
+    // Largest overlaps first: a lake keeps its id, the smaller parts of a split get new ones
+    vector<std::pair<int, std::pair<int, int> > > candidates;
+    for (auto & overlap : overlaps)
+        candidates.push_back(std::make_pair(-overlap.second, overlap.first));
+    std::sort(candidates.begin(), candidates.end());
+    std::set<int> usedIds;
+    for (auto & candidate : candidates){
+        Lake & lake = newLakes[candidate.second.first];
+        int previousId = candidate.second.second;
+        if (lake.id == 0 && usedIds.count(previousId) == 0){
+            lake.id = previousId;
+            usedIds.insert(previousId);
+        }
+    }
+    lakeIndices.clear();
+    for (int l = 0; l < newLakes.size(); l++){
+        Lake & lake = newLakes[l];
+        if (lake.id == 0)
+            lake.id = nextLakeId++;
+        lake.volume = depthSums[l]*cellSize*cellSize/1e6;
+        lake.centroid = ofVec2f(sumsX[l]/lake.area, sumsY[l]/lake.area);
+        lakeIndices[lake.id] = l;
+    }
+    for (int tile = 0; tile < numTiles; tile++)
+        for (int k = 0; k < tileComponents[tile].size(); k++)
+            tileComponents[tile][k].lakeId = newLakes[rootLakes[findRoot(componentOffset[tile]+k)]].id;
+    lakes = std::move(newLakes);
+}
+
+void LakeDetector::runInBands(std::function<void(int, int)> work){
+    // Each thread processes a band of tile rows
+    int numBands = min(numThreads, tilesRows);
+    vector<std::thread> workers;
+    for (int i = 1; i < numBands; i++)
+        workers.push_back(std::thread(work, i*tilesRows/numBands, (i+1)*tilesRows/numBands));
+    work(0, tilesRows/numBands);
+    for (auto & worker : workers)
+        worker.join();
+}
+
+int LakeDetector::getLakeId(int x, int y) const{
+    if (x < 0 || x >= width || y < 0 || y >= height)
+        return 0;
+    int label = localLabels[y*width+x];
+    if (label == 0)
+        return 0;
+    return tileComponents[(y/tileSize)*tilesCols+x/tileSize][label-1].lakeId;
+}
+
+const LakeDetector::Lake* LakeDetector::getLake(int id) const{
+    auto it = lakeIndices.find(id);
+    if (it == lakeIndices.end())
+        return NULL;
+    return &lakes[it->second];
+}
@@ -0,0 +1,96 @@
+/***********************************************************************
+LakeDetector - LakeDetector labels the connected water bodies of the
+sandbox (sand under the sea level) and follows them across frames.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include <unordered_map>
+
+// The changed tiles are labelled again in parallel, each with a local
+// union-find over its 4-connected water cells. The components of all the
+// tiles are then merged across the tile borders by a global union-find.
+// A lake keeps its id while it overlaps the lake of the previous frame with
+// the largest overlap; the smaller parts of a split lake get new ids.
+// A cell knows the component of its tile, which knows its lake, so the
+// lake of a cell is found in constant time.
+class LakeDetector {
+public:
+    struct Lake {
+        int id; // Stable across frames, never reused
+        int area; // Cells
+        float volume; // Liters under the sea level
+        float maxDepth; // mm
+        ofRectangle boundingBox; // Kinect image coordinates
+        ofVec2f centroid;
+    };
+
+    LakeDetector();
+
+    void setup(int width, int height, int tileSize = 32, int numThreads = 0);
+    void setCellSize(float scellSize){ // Width of a cell in mm
+        cellSize = scellSize;
+    }
+
+    // elevation: height of the sand (mm, NaN outside of the sandbox), water is under 0.
+    // changedTiles: one byte per tileSize tile, non zero where the elevation changed (NULL: everything changed).
+    void update(const ofFloatPixels & elevation, const vector<unsigned char>* changedTiles = NULL);
+
+    int getLakeId(int x, int y) const; // 0 for dry sand and outside of the image
+    const Lake* getLake(int id) const; // NULL if the lake disappeared
+    const Lake* getLakeAt(int x, int y) const {
+        return getLake(getLakeId(x, y));
+    }
+    const vector<Lake> & getLakes() const {
+        return lakes;
+    }
+
+private:
+    struct TileComponent {
+        int area;
+        double depthSum; // mm
+        float maxDepth;
+        int minX, minY, maxX, maxY;
+        double sumX, sumY;
+        int previousLakeId; // Lake of most of its cells in the previous frame
+        int lakeId;
+    };
+
+    void labelTile(int tile, const float* elevation);
+    void mergeTiles();
+    int findRoot(int component);
+    void runInBands(std::function<void(int, int)> work);
+
+    int width, height;
+    int tileSize;
+    int tilesCols, tilesRows;
+    int numThreads;
+    float cellSize;
+    bool initialized;
+
+    vector<unsigned short> localLabels; // Per cell, 0: dry, k: component k-1 of its tile
+    vector<vector<TileComponent> > tileComponents;
+    vector<int> componentOffset; // First global component of each tile
+    vector<int> parent; // Global union-find
+
+    vector<Lake> lakes;
+    std::unordered_map<int, int> lakeIndices; // By id
+    int nextLakeId;
+};
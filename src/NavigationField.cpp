@@ -0,0 +1,235 @@
+/***********************************************************************
+NavigationField - NavigationField computes the shortest paths from every
+cell of the sandbox to a target, through the water or over the land.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "NavigationField.h"
+#include <thread>
+
+namespace {
+    const float unreachable = std::numeric_limits<float>::infinity();
+    const float hysteresis = 1; // mm around the sea level before a cell changes of medium
+
+    // The 4 straight neighbours first, then the diagonals
+    const int neighbourX[8] = {1, -1, 0, 0, 1, 1, -1, -1};
+    const int neighbourY[8] = {0, 0, 1, -1, 1, -1, 1, -1};
+    const float moveCost[8] = {1, 1, 1, 1, M_SQRT2, M_SQRT2, M_SQRT2, M_SQRT2};
+}
+
+NavigationField::NavigationField()
+:width(0),
+height(0),
+throughWater(true),
+targetDirty(false)
+{
+}
+
+void NavigationField::setup(int swidth, int sheight){
+    width = swidth;
+    height = sheight;
+    passable.assign(width*height, 0);
+    distance.assign(width*height, unreachable);
+    next.assign(width*height, -1);
+    targetCells.clear();
+    targetDirty = false;
+    ofLogVerbose("NavigationField") << "setup(): " << width << "x" << height;
+}
+
+void NavigationField::setTarget(const ofVec2f & target, bool sthroughWater, float radius){
+    if (width == 0)
+        return;
+    targetCells.clear();
+    int center = index(target.x, target.y);
+    int cx = center%width;
+    int cy = center/width;
+    int r = radius;
+    for (int y = max(0, cy-r); y <= min(height-1, cy+r); y++)
+        for (int x = max(0, cx-r); x <= min(width-1, cx+r); x++)
+            if ((x-cx)*(x-cx)+(y-cy)*(y-cy) <= radius*radius)
+                targetCells.push_back(y*width+x);
+    throughWater = sthroughWater;
+    targetDirty = true;
+    ofLogVerbose("NavigationField") << "setTarget(): " << target << (throughWater ? " through the water" : " over the land");
+}
+
+void NavigationField::clearTarget(){
+    targetCells.clear();
+    targetDirty = false;
+    std::fill(distance.begin(), distance.end(), unreachable);
+    std::fill(next.begin(), next.end(), -1);
+}
+
+void NavigationField::update(const ofFloatPixels & elevation, const vector<unsigned char>* changedTiles, int tileSize){
+    if (width == 0 || !hasTarget() || elevation.getWidth() != width || elevation.getHeight() != height)
+        return;
+    if (targetDirty)
+        changedTiles = NULL;
+
+    // Cells changing of medium, with some hysteresis around the sea level (NaN is an obstacle)
+    const float* elevationPtr = elevation.getData();
+    vector<int> blocked, freed;
+    auto updateCell = [&](int i){
+        float level = throughWater ? -elevationPtr[i] : elevationPtr[i]; // Inside of the medium when positive
+        bool nowPassable = passable[i] ? level > -hysteresis : level > hysteresis;
+        if (nowPassable != (passable[i] != 0)){
+            passable[i] = nowPassable;
+            if (nowPassable)
+                freed.push_back(i);
+            else
+                blocked.push_back(i);
+        }
+    };
+    if (changedTiles == NULL){
+        for (int i = 0; i < width*height; i++)
+            updateCell(i);
+    } else {
+        int tilesCols = (width+tileSize-1)/tileSize;
+        for (int tile = 0; tile < changedTiles->size(); tile++){
+            if (!(*changedTiles)[tile])
+                continue;
+            int x0 = (tile%tilesCols)*tileSize;
+            int y0 = (tile/tilesCols)*tileSize;
+            for (int y = y0; y < min(y0+tileSize, height); y++)
+                for (int x = x0; x < min(x0+tileSize, width); x++)
+                    updateCell(y*width+x);
+        }
+    }
+
+    Queue queue;
+    if (changedTiles == NULL){
+        std::fill(distance.begin(), distance.end(), unreachable);
+        std::fill(next.begin(), next.end(), -1);
+        for (int cell : targetCells){
+            distance[cell] = 0;
+            queue.push(QueueNode(0, cell));
+        }
+        targetDirty = false;
+    } else {
+        if (blocked.empty() && freed.empty())
+            return;
+        // The paths through the new obstacles are lost, the cells around them and
+        // around the new passages are flooded again
+        vector<int> invalidated;
+        for (int cell : blocked)
+            invalidatePaths(cell, invalidated);
+        invalidated.insert(invalidated.end(), freed.begin(), freed.end());
+        for (int cell : invalidated){
+            int x = cell%width;
+            int y = cell/width;
+            for (int k = 0; k < 8; k++){
+                int nx = x+neighbourX[k];
+                int ny = y+neighbourY[k];
+                if (nx < 0 || nx >= width || ny < 0 || ny >= height)
+                    continue;
+                int n = ny*width+nx;
+                if (distance[n] < unreachable)
+                    queue.push(QueueNode(distance[n], n));
+            }
+        }
+    }
+    flood(queue);
+}
+
+void NavigationField::updateAll(const vector<NavigationField*> & fields, const ofFloatPixels & elevation, const vector<unsigned char>* changedTiles, int tileSize){
+    vector<std::thread> workers;
+    for (int i = 1; i < fields.size(); i++)
+        workers.push_back(std::thread(&NavigationField::update, fields[i], std::cref(elevation), changedTiles, tileSize));
+    if (!fields.empty())
+        fields[0]->update(elevation, changedTiles, tileSize);
+    for (auto & worker : workers)
+        worker.join();
+}
+
+ofVec2f NavigationField::getDirection(float x, float y) const{
+    int i = index(x, y);
+    if (next[i] == -1)
+        return ofVec2f(0, 0);
+    return ofVec2f(next[i]%width-i%width, next[i]/width-i/width).getNormalized();
+}
+
+bool NavigationField::canMove(int from, int k) const{
+    int x = from%width;
+    int y = from/width;
+    int nx = x+neighbourX[k];
+    int ny = y+neighbourY[k];
+    if (nx < 0 || nx >= width || ny < 0 || ny >= height || !passable[ny*width+nx])
+        return false;
+    // No corner cutting along the diagonals
+    return k < 4 || (passable[y*width+nx] && passable[ny*width+x]);
+}
+
+void NavigationField::invalidatePaths(int blockedCell, vector<int> & invalidated){
+    // The blocked cell, the diagonal moves around its corners and everything downstream
+    vector<int> stack(1, blockedCell);
+    int bx = blockedCell%width;
+    int by = blockedCell/width;
+    for (int k = 0; k < 4; k++){
+        int nx = bx+neighbourX[k];
+        int ny = by+neighbourY[k];
+        if (nx < 0 || nx >= width || ny < 0 || ny >= height)
+            continue;
+        int n = ny*width+nx;
+        if (next[n] == -1)
+            continue;
+        int mx = next[n]%width;
+        int my = next[n]/width;
+        if ((mx == bx && ny == by) || (nx == bx && my == by))
+            if (mx != nx && my != ny)
+                stack.push_back(n);
+    }
+    while (!stack.empty()){
+        int cell = stack.back();
+        stack.pop_back();
+        if (distance[cell] == 0 || distance[cell] == unreachable) // The target cells stay
+            continue;
+        distance[cell] = unreachable;
+        next[cell] = -1;
+        invalidated.push_back(cell);
+        int x = cell%width;
+        int y = cell/width;
+        for (int k = 0; k < 8; k++){
+            int nx = x+neighbourX[k];
+            int ny = y+neighbourY[k];
+            if (nx >= 0 && nx < width && ny >= 0 && ny < height && next[ny*width+nx] == cell)
+                stack.push_back(ny*width+nx);
+        }
+    }
+}
+
+void NavigationField::flood(Queue & queue){
+    while (!queue.empty()){
+        QueueNode node = queue.top();
+        queue.pop();
+        int cell = node.second;
+        if (node.first > distance[cell])
+            continue;
+        for (int k = 0; k < 8; k++){
+            if (!canMove(cell, k))
+                continue;
+            int n = cell+neighbourY[k]*width+neighbourX[k];
+            float d = node.first+moveCost[k];
+            if (d < distance[n]){
+                distance[n] = d;
+                next[n] = cell;
+                queue.push(QueueNode(d, n));
+            }
+        }
+    }
+}
@@ -0,0 +1,85 @@
+/***********************************************************************
+NavigationField - NavigationField computes the shortest paths from every
+cell of the sandbox to a target, through the water or over the land.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include <queue>
+#include <limits>
+
+// A Dijkstra flood from the target cells over the passable cells (8-connected,
+// no corner cutting) gives each cell its path length and the next cell of
+// its path. When the terrain changes, the cells whose path went through a
+// cell that became an obstacle are reset and flooded again from their
+// border, and the cells that became passable are flooded from their
+// neighbours. The water/land mask has a small hysteresis so that the noise
+// of the shoreline does not change it every frame.
+class NavigationField {
+public:
+    NavigationField();
+
+    void setup(int width, int height);
+    // Kinect image coordinates, the cells within radius of the target are the goal
+    void setTarget(const ofVec2f & target, bool throughWater, float radius = 0);
+    void clearTarget();
+    bool hasTarget() const {
+        return !targetCells.empty();
+    }
+    bool needsFullUpdate() const { // The target changed since the last update
+        return targetDirty;
+    }
+
+    // elevation: height of the sand (mm, NaN outside of the sandbox). Only the changed tiles
+    // (one byte per tileSize tile, NULL: everything changed) are checked for new obstacles and passages.
+    void update(const ofFloatPixels & elevation, const vector<unsigned char>* changedTiles = NULL, int tileSize = 32);
+    // Updates the fields in parallel, one thread per field
+    static void updateAll(const vector<NavigationField*> & fields, const ofFloatPixels & elevation, const vector<unsigned char>* changedTiles = NULL, int tileSize = 32);
+
+    bool isReachable(float x, float y) const {
+        return distance[index(x, y)] < std::numeric_limits<float>::infinity();
+    }
+    float getDistance(float x, float y) const { // Cells along the shortest path, infinity if the target cannot be reached
+        return distance[index(x, y)];
+    }
+    ofVec2f getDirection(float x, float y) const; // Unit vector toward the next cell of the shortest path, 0 on the target cells and when unreachable
+
+private:
+    typedef std::pair<float, int> QueueNode; // (distance, cell)
+    typedef std::priority_queue<QueueNode, vector<QueueNode>, std::greater<QueueNode> > Queue;
+
+    int index(float x, float y) const {
+        int ix = ofClamp(static_cast<int>(x), 0, width-1);
+        int iy = ofClamp(static_cast<int>(y), 0, height-1);
+        return iy*width+ix;
+    }
+    bool canMove(int from, int k) const; // Move from a cell toward its neighbour k
+    void invalidatePaths(int blockedCell, vector<int> & invalidated);
+    void flood(Queue & queue);
+
+    int width, height;
+    vector<int> targetCells; // Distance 0, even on an obstacle: the vehicles come as close as they can
+    bool throughWater;
+    bool targetDirty;
+
+    vector<unsigned char> passable;
+    vector<float> distance;
+    vector<int> next; // Next cell toward the target, -1 for the target cells and the unreachable cells
+};
@@ -0,0 +1,261 @@
+/***********************************************************************
+AdaptiveMesh - AdaptiveMesh computes a level of detail triangulation of
+the sand surface grid from a quadtree refined by the terrain curvature.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "AdaptiveMesh.h"
+
+AdaptiveMesh::AdaptiveMesh()
+:gridWidth(0),
+gridHeight(0),
+maxLevel(0),
+tileSize(1),
+numTilesX(0),
+numTilesY(0),
+levelWidth(0),
+levelHeight(0),
+depth(NULL),
+tolerance(1.0),
+minFootprint(2.0),
+needsFullUpdate(true),
+numVertices(0)
+{
+}
+
+void AdaptiveMesh::setup(int sgridWidth, int sgridHeight, int smaxLevel){
+    gridWidth = sgridWidth;
+    gridHeight = sgridHeight;
+    maxLevel = smaxLevel;
+    tileSize = 1 << maxLevel;
+    setROI(ofRectangle(0, 0, gridWidth, gridHeight));
+}
+
+void AdaptiveMesh::setROI(ofRectangle sROI){
+    ROI = sROI;
+    // Cells lie between grid vertices: a ROI of w x h pixels has (w-1) x (h-1) cells
+    numTilesX = max(1, ((int)ROI.width-1+tileSize-1)/tileSize);
+    numTilesY = max(1, ((int)ROI.height-1+tileSize-1)/tileSize);
+    levelWidth = numTilesX*tileSize;
+    levelHeight = numTilesY*tileSize;
+    refinedLevel.assign(levelWidth*levelHeight, maxLevel);
+    cellLevel.assign(levelWidth*levelHeight, maxLevel);
+    needsFullUpdate = true;
+    ofLogVerbose("AdaptiveMesh") << "setROI(): ROI: " << ROI << " tiles: " << numTilesX << "x" << numTilesY;
+}
+
+float AdaptiveMesh::getDepth(int gx, int gy) const{
+    int x = ROI.x+min(gx, (int)ROI.width-1);
+    int y = ROI.y+min(gy, (int)ROI.height-1);
+    return depth->getData()[y*depth->getWidth()+x];
+}
+
+ofIndexType AdaptiveMesh::vertexIndex(int gx, int gy) const{
+    // Vertices past the ROI are clamped on its border, like in the vertex shaders
+    return min(gy, (int)ROI.height-1)*gridWidth+min(gx, (int)ROI.width-1);
+}
+
+bool AdaptiveMesh::needsSplit(int cx, int cy, int level) const{
+    if (level == 0)
+        return false;
+    int s = 1 << level;
+
+    // Children smaller than the minimal footprint would not be visible on the sand
+    if (kinectToProj){
+        ofVec2f p0 = kinectToProj(ROI.x+min(cx, (int)ROI.width-1), ROI.y+min(cy, (int)ROI.height-1));
+        ofVec2f p1 = kinectToProj(ROI.x+min(cx+s, (int)ROI.width-1), ROI.y+min(cy+s, (int)ROI.height-1));
+        float footprint = max(abs(p1.x-p0.x), abs(p1.y-p0.y));
+        if (footprint/2 < minFootprint)
+            return false;
+    }
+
+    // Deviation of the depth from the two triangles of the leaf (diagonal from top-left to bottom-right)
+    float d00 = getDepth(cx, cy);
+    float d10 = getDepth(cx+s, cy);
+    float d01 = getDepth(cx, cy+s);
+    float d11 = getDepth(cx+s, cy+s);
+    for (int j = 0; j <= s; j++){
+        for (int i = 0; i <= s; i++){
+            float interp;
+            if (i >= j)
+                interp = d00+(d10-d00)*i/s+(d11-d10)*j/s;
+            else
+                interp = d00+(d01-d00)*j/s+(d11-d01)*i/s;
+            if (abs(getDepth(cx+i, cy+j)-interp) > tolerance)
+                return true;
+        }
+    }
+    return false;
+}
+
+void AdaptiveMesh::refine(int cx, int cy, int level){
+    if (needsSplit(cx, cy, level)){
+        int h = 1 << (level-1);
+        refine(cx, cy, level-1);
+        refine(cx+h, cy, level-1);
+        refine(cx, cy+h, level-1);
+        refine(cx+h, cy+h, level-1);
+    } else {
+        int s = 1 << level;
+        for (int y = cy; y < cy+s; y++)
+            memset(&refinedLevel[y*levelWidth+cx], level, s);
+    }
+}
+
+void AdaptiveMesh::refineTile(int tx, int ty){
+    refine(tx*tileSize, ty*tileSize, maxLevel);
+
+    // Store the depth the tile was refined from
+    int x0 = ROI.x+min(tx*tileSize, (int)ROI.width-1);
+    int x1 = ROI.x+min((tx+1)*tileSize, (int)ROI.width-1);
+    int y0 = ROI.y+min(ty*tileSize, (int)ROI.height-1);
+    int y1 = ROI.y+min((ty+1)*tileSize, (int)ROI.height-1);
+    int w = depth->getWidth();
+    for (int y = y0; y <= y1; y++)
+        memcpy(refinedDepth.getData()+y*w+x0, depth->getData()+y*w+x0, (x1-x0+1)*sizeof(float));
+}
+
+void AdaptiveMesh::balance(){
+    // Split the leaves having a neighbour more than one level finer until the quadtree is balanced
+    cellLevel = refinedLevel;
+    bool changed = true;
+    while (changed){
+        changed = false;
+        for (int cy = 0; cy < levelHeight; cy++){
+            for (int cx = 0; cx < levelWidth; cx++){
+                int l = getLevel(cx, cy);
+                int s = 1 << l;
+                if (l < 2 || cx % s != 0 || cy % s != 0) // Not the origin of a leaf that can be unbalanced
+                    continue;
+                bool split = false;
+                for (int i = 0; i < s && !split; i++){
+                    split = (cy > 0 && getLevel(cx+i, cy-1) < l-1)
+                        || (cy+s < levelHeight && getLevel(cx+i, cy+s) < l-1)
+                        || (cx > 0 && getLevel(cx-1, cy+i) < l-1)
+                        || (cx+s < levelWidth && getLevel(cx+s, cy+i) < l-1);
+                }
+                if (split){
+                    for (int y = cy; y < cy+s; y++)
+                        memset(&cellLevel[y*levelWidth+cx], l-1, s);
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+void AdaptiveMesh::triangulate(){
+    indices.clear();
+    vector<bool> vertexUsed(gridWidth*gridHeight, false);
+    int numCellsX = ROI.width-1;
+    int numCellsY = ROI.height-1;
+    for (int cy = 0; cy < numCellsY; cy++){
+        for (int cx = 0; cx < numCellsX; cx++){
+            int l = getLevel(cx, cy);
+            int s = 1 << l;
+            if (cx % s != 0 || cy % s != 0)
+                continue;
+            int x1 = cx+s, y1 = cy+s;
+            int h = s/2;
+
+            // Edges bordering finer leaves get their midpoint (one level finer at most)
+            bool topMid = l > 0 && cy > 0 && (getLevel(cx, cy-1) < l || getLevel(cx+h, cy-1) < l);
+            bool bottomMid = l > 0 && y1 < levelHeight && (getLevel(cx, y1) < l || getLevel(cx+h, y1) < l);
+            bool leftMid = l > 0 && cx > 0 && (getLevel(cx-1, cy) < l || getLevel(cx-1, cy+h) < l);
+            bool rightMid = l > 0 && x1 < levelWidth && (getLevel(x1, cy) < l || getLevel(x1, cy+h) < l);
+
+            vector<ofIndexType> ring;
+            ring.push_back(vertexIndex(cx, cy));
+            if (topMid)
+                ring.push_back(vertexIndex(cx+h, cy));
+            ring.push_back(vertexIndex(x1, cy));
+            if (rightMid)
+                ring.push_back(vertexIndex(x1, cy+h));
+            ring.push_back(vertexIndex(x1, y1));
+            if (bottomMid)
+                ring.push_back(vertexIndex(cx+h, y1));
+            ring.push_back(vertexIndex(cx, y1));
+            if (leftMid)
+                ring.push_back(vertexIndex(cx, cy+h));
+
+            if (ring.size() == 4){
+                // Same diagonal as the one used to measure the deviation
+                ofIndexType quad[6] = {ring[0], ring[1], ring[2], ring[0], ring[2], ring[3]};
+                indices.insert(indices.end(), quad, quad+6);
+            } else {
+                // Fan around the leaf center
+                ofIndexType center = vertexIndex(cx+h, cy+h);
+                vertexUsed[center] = true;
+                for (int i = 0; i < ring.size(); i++){
+                    indices.push_back(center);
+                    indices.push_back(ring[i]);
+                    indices.push_back(ring[(i+1) % ring.size()]);
+                }
+            }
+            for (auto & v : ring)
+                vertexUsed[v] = true;
+        }
+    }
+    numVertices = std::count(vertexUsed.begin(), vertexUsed.end(), true);
+}
+
+bool AdaptiveMesh::update(const ofFloatPixels & sdepth, std::function<ofVec2f(float, float)> skinectToProj){
+    if (cellLevel.empty() || ROI.width < 2 || ROI.height < 2)
+        return false;
+    depth = &sdepth;
+    kinectToProj = skinectToProj;
+    if (refinedDepth.getWidth() != depth->getWidth() || refinedDepth.getHeight() != depth->getHeight()){
+        refinedDepth.allocate(depth->getWidth(), depth->getHeight(), 1);
+        needsFullUpdate = true;
+    }
+
+    int numRefined = 0;
+    int w = depth->getWidth();
+    for (int ty = 0; ty < numTilesY; ty++){
+        for (int tx = 0; tx < numTilesX; tx++){
+            bool changed = needsFullUpdate;
+            int x0 = ROI.x+min(tx*tileSize, (int)ROI.width-1);
+            int x1 = ROI.x+min((tx+1)*tileSize, (int)ROI.width-1);
+            int y0 = ROI.y+min(ty*tileSize, (int)ROI.height-1);
+            int y1 = ROI.y+min((ty+1)*tileSize, (int)ROI.height-1);
+            for (int y = y0; y <= y1 && !changed; y++){
+                const float* depthPtr = depth->getData()+y*w+x0;
+                const float* refinedPtr = refinedDepth.getData()+y*w+x0;
+                for (int x = x0; x <= x1; x++, depthPtr++, refinedPtr++)
+                    if (abs(*depthPtr-*refinedPtr) > tolerance/2){
+                        changed = true;
+                        break;
+                    }
+            }
+            if (changed){
+                refineTile(tx, ty);
+                numRefined++;
+            }
+        }
+    }
+    needsFullUpdate = false;
+    if (numRefined == 0)
+        return false;
+
+    balance();
+    triangulate();
+    if (numRefined == numTilesX*numTilesY)
+        ofLogVerbose("AdaptiveMesh") << "update(): full refinement: " << numVertices << " vertices, " << indices.size()/3 << " triangles";
+    return true;
+}
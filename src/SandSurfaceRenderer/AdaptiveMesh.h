@@ -0,0 +1,91 @@
+/***********************************************************************
+AdaptiveMesh - AdaptiveMesh computes a level of detail triangulation of
+the sand surface grid from a quadtree refined by the terrain curvature.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+// The ROI is covered by square tiles of 2^maxLevel cells, each tile being the
+// root of a quadtree. A leaf is split while the depth deviates from its two
+// triangles by more than the tolerance and its children stay larger than the
+// minimal projector footprint. The quadtree is balanced (neighbour leaves
+// differ by at most one level) and leaves bordering finer leaves are drawn as
+// fans through their edge midpoints so that the mesh has no T-junction cracks.
+// Indices refer to the vertices of the static grid of the sand surface renderer.
+class AdaptiveMesh {
+public:
+    AdaptiveMesh();
+
+    void setup(int gridWidth, int gridHeight, int maxLevel = 5);
+    void setROI(ofRectangle ROI); // Forces a full refinement at the next update
+
+    void setTolerance(float stolerance){ // Maximal depth deviation in mm
+        tolerance = stolerance;
+        needsFullUpdate = true;
+    }
+    void setMinFootprint(float sminFootprint){ // Minimal leaf size in projector pixels
+        minFootprint = sminFootprint;
+        needsFullUpdate = true;
+    }
+
+    // Refine the tiles whose depth changed by more than half the tolerance since their
+    // last refinement. kinectToProj maps a kinect pixel to projector coordinates.
+    // Returns true if the indices changed.
+    bool update(const ofFloatPixels & depth, std::function<ofVec2f(float, float)> kinectToProj);
+
+    const vector<ofIndexType> & getIndices() const { // GL_TRIANGLES
+        return indices;
+    }
+    int getNumVertices() const {
+        return numVertices;
+    }
+
+private:
+    float getDepth(int gx, int gy) const; // Depth at grid vertex (clamped to the ROI)
+    int getLevel(int cx, int cy) const {
+        return cellLevel[cy*levelWidth+cx];
+    }
+    bool needsSplit(int cx, int cy, int level) const;
+    void refineTile(int tx, int ty);
+    void refine(int cx, int cy, int level);
+    void balance();
+    void triangulate();
+    ofIndexType vertexIndex(int gx, int gy) const;
+
+    int gridWidth, gridHeight;
+    int maxLevel, tileSize;
+    ofRectangle ROI;
+    int numTilesX, numTilesY;
+    int levelWidth, levelHeight; // Size of the level maps (tiles x tileSize)
+
+    vector<unsigned char> refinedLevel; // Level of the leaf covering each cell before balancing
+    vector<unsigned char> cellLevel; // Level of the leaf covering each cell after balancing
+    ofFloatPixels refinedDepth; // Depth at the last refinement of each tile
+
+    const ofFloatPixels* depth;
+    std::function<ofVec2f(float, float)> kinectToProj;
+    float tolerance;
+    float minFootprint;
+    bool needsFullUpdate;
+
+    vector<ofIndexType> indices;
+    int numVertices;
+};
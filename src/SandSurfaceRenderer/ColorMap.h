@@ -59,6 +59,9 @@ public:
     HeightMapKey operator[](int scalar) const; // Return a key
     int size() const;
     ofTexture getTexture(); // return color map texture
+    const ofPixels & getPixels() const { // return color map entries
+        return entries;
+    }
 
     // Utilities
     bool scaleRange(float factor); // Rescale the range
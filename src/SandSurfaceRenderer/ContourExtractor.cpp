@@ -0,0 +1,369 @@
+/***********************************************************************
+ContourExtractor - ContourExtractor computes the contour lines of the
+sand surface as polylines with a tiled, multi-threaded marching squares.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "ContourExtractor.h"
+#include <thread>
+#include <deque>
+#include <unordered_map>
+
+ContourExtractor::ContourExtractor()
+:width(0),
+height(0),
+tileSize(32),
+numTilesX(0),
+numTilesY(0),
+numThreads(1),
+needsFullUpdate(true),
+depth(NULL),
+numSegments(0)
+{
+    parameters.depthMin = 0;
+    parameters.depthMax = 0;
+    parameters.contourLineDistance = 10;
+}
+
+void ContourExtractor::setup(int swidth, int sheight, int stileSize, int snumThreads){
+    width = swidth;
+    height = sheight;
+    tileSize = stileSize;
+    numTilesX = (width+tileSize-1)/tileSize;
+    numTilesY = (height+tileSize-1)/tileSize;
+    numThreads = snumThreads > 0 ? snumThreads : max(1u, std::thread::hardware_concurrency());
+    elevation.assign(width*height, NAN);
+    clampedDepth.assign(width*height, 0);
+    tileSegments.assign(numTilesX*numTilesY, vector<Segment>());
+    numSegments = 0;
+    contours.clear();
+    needsFullUpdate = true;
+    ofLogVerbose("ContourExtractor") << "setup(): " << width << "x" << height << " tiles: " << numTilesX << "x" << numTilesY << " threads: " << numThreads;
+}
+
+bool ContourExtractor::setParameters(const Parameters & sparameters){
+    bool changed = memcmp(sparameters.kinectWorldMatrix.getPtr(), parameters.kinectWorldMatrix.getPtr(), 16*sizeof(float)) != 0
+        || sparameters.basePlaneEq != parameters.basePlaneEq
+        || sparameters.depthMin != parameters.depthMin || sparameters.depthMax != parameters.depthMax
+        || sparameters.contourLineDistance != parameters.contourLineDistance
+        || sparameters.kinectROI != parameters.kinectROI;
+    if (changed){
+        parameters = sparameters;
+        needsFullUpdate = true;
+    }
+    return changed;
+}
+
+void ContourExtractor::runOnTiles(const vector<int> & tiles, std::function<void(int, int)> work){
+    // Each thread processes an interleaved subset of the tiles
+    auto worker = [&](int first){
+        for (int i = first; i < tiles.size(); i += numThreads)
+            work(tiles[i]%numTilesX, tiles[i]/numTilesX);
+    };
+    vector<std::thread> workers;
+    for (int i = 1; i < min(numThreads, (int)tiles.size()); i++)
+        workers.push_back(std::thread(worker, i));
+    worker(0);
+    for (auto & w : workers)
+        w.join();
+}
+
+ofVec3f ContourExtractor::kinectToWorld(const ofVec3f & p) const{
+    const ofMatrix4x4 & W = parameters.kinectWorldMatrix;
+    float d = p.z;
+    return ofVec3f((W(0, 0)*p.x+W(0, 1)*p.y+W(0, 2)*d+W(0, 3))*d,
+                   (W(1, 0)*p.x+W(1, 1)*p.y+W(1, 2)*d+W(1, 3))*d,
+                   (W(2, 0)*p.x+W(2, 1)*p.y+W(2, 2)*d+W(2, 3))*d);
+}
+
+void ContourExtractor::computeElevation(int tx, int ty){
+    const ofVec4f & plane = parameters.basePlaneEq;
+    const float* depthData = depth->getData();
+    int x1 = min((tx+1)*tileSize, width);
+    int y1 = min((ty+1)*tileSize, height);
+    for (int y = ty*tileSize; y < y1; y++){
+        for (int x = tx*tileSize; x < x1; x++){
+            int ind = y*width+x;
+            if (!parameters.kinectROI.inside(x+0.5f, y+0.5f)){
+                elevation[ind] = NAN;
+                continue;
+            }
+            float d = ofClamp(depthData[ind], parameters.depthMin, parameters.depthMax);
+            ofVec3f world = kinectToWorld(ofVec3f(x, y, d));
+            clampedDepth[ind] = d;
+            elevation[ind] = plane.x*world.x+plane.y*world.y+plane.z*world.z+plane.w;
+        }
+    }
+}
+
+uint64_t ContourExtractor::edgeKey(int x, int y, bool vertical, int level) const{
+    uint64_t edge = static_cast<uint64_t>(y*width+x)*2+(vertical ? 1 : 0);
+    return (edge << 24) | (static_cast<uint32_t>(level+(1 << 23)) & 0xffffff);
+}
+
+ofVec3f ContourExtractor::edgePoint(int x0, int y0, int x1, int y1, float level) const{
+    // Always called with the same corner order for a given edge: both cells sharing it get the same point
+    float e0 = elevation[y0*width+x0];
+    float e1 = elevation[y1*width+x1];
+    float t = (level-e0)/(e1-e0);
+    float d0 = clampedDepth[y0*width+x0];
+    float d1 = clampedDepth[y1*width+x1];
+    return ofVec3f(x0+t*(x1-x0), y0+t*(y1-y0), d0+t*(d1-d0));
+}
+
+void ContourExtractor::addCellSegments(int x, int y, vector<Segment> & segments){
+    float c[4] = {elevation[y*width+x], elevation[y*width+x+1], elevation[(y+1)*width+x+1], elevation[(y+1)*width+x]};
+    float lo = min(min(c[0], c[1]), min(c[2], c[3]));
+    float hi = max(max(c[0], c[1]), max(c[2], c[3]));
+    float distance = parameters.contourLineDistance;
+    int minLevel = floor(lo/distance)+1;
+    int maxLevel = floor(hi/distance);
+    for (int level = minLevel; level <= maxLevel; level++){
+        float l = level*distance;
+        bool inside[4] = {c[0] >= l, c[1] >= l, c[2] >= l, c[3] >= l};
+
+        /* Crossing points on the top, right, bottom and left edges: */
+        ofVec3f p[4];
+        uint64_t k[4];
+        bool crossed[4];
+        crossed[0] = inside[0] != inside[1];
+        crossed[1] = inside[1] != inside[2];
+        crossed[2] = inside[3] != inside[2];
+        crossed[3] = inside[0] != inside[3];
+        if (crossed[0]){
+            p[0] = edgePoint(x, y, x+1, y, l);
+            k[0] = edgeKey(x, y, false, level);
+        }
+        if (crossed[1]){
+            p[1] = edgePoint(x+1, y, x+1, y+1, l);
+            k[1] = edgeKey(x+1, y, true, level);
+        }
+        if (crossed[2]){
+            p[2] = edgePoint(x, y+1, x+1, y+1, l);
+            k[2] = edgeKey(x, y+1, false, level);
+        }
+        if (crossed[3]){
+            p[3] = edgePoint(x, y, x, y+1, l);
+            k[3] = edgeKey(x, y, true, level);
+        }
+
+        int edges[4];
+        int numEdges = 0;
+        for (int i = 0; i < 4; i++)
+            if (crossed[i])
+                edges[numEdges++] = i;
+        if (numEdges == 2){
+            segments.push_back({p[edges[0]], p[edges[1]], k[edges[0]], k[edges[1]], level});
+        } else if (numEdges == 4){
+            /* Saddle: the cell center decides which corners are connected: */
+            bool centerInside = (c[0]+c[1]+c[2]+c[3])*0.25f >= l;
+            if (inside[0] == centerInside){ // Cut corners 1 and 3
+                segments.push_back({p[0], p[1], k[0], k[1], level});
+                segments.push_back({p[2], p[3], k[2], k[3], level});
+            } else { // Cut corners 0 and 2
+                segments.push_back({p[3], p[0], k[3], k[0], level});
+                segments.push_back({p[1], p[2], k[1], k[2], level});
+            }
+        }
+    }
+}
+
+void ContourExtractor::extractTile(int tx, int ty){
+    // Cells of the tile inside the ROI (a cell needs its right and bottom neighbour pixels)
+    vector<Segment> & segments = tileSegments[ty*numTilesX+tx];
+    segments.clear();
+    int minX = max(tx*tileSize, (int)parameters.kinectROI.getMinX());
+    int maxX = min((tx+1)*tileSize, (int)parameters.kinectROI.getMaxX()-1);
+    int minY = max(ty*tileSize, (int)parameters.kinectROI.getMinY());
+    int maxY = min((ty+1)*tileSize, (int)parameters.kinectROI.getMaxY()-1);
+    for (int y = minY; y < maxY; y++)
+        for (int x = minX; x < maxX; x++)
+            addCellSegments(x, y, segments);
+}
+
+bool ContourExtractor::update(const ofFloatPixels & sdepth, const vector<unsigned char>* changedTiles){
+    if (sdepth.getWidth() != width || sdepth.getHeight() != height || parameters.contourLineDistance <= 0)
+        return false;
+    depth = &sdepth;
+    int numTiles = numTilesX*numTilesY;
+    bool full = needsFullUpdate || changedTiles == NULL || changedTiles->size() != numTiles;
+
+    /* Elevation of the changed depth tiles, and cells tiles reading them (left and top neighbours): */
+    vector<int> elevationTiles, cellTiles;
+    vector<unsigned char> dirtyCells(numTiles, full ? 1 : 0);
+    for (int t = 0; t < numTiles; t++){
+        if (!full && !(*changedTiles)[t])
+            continue;
+        elevationTiles.push_back(t);
+        int tx = t%numTilesX;
+        int ty = t/numTilesX;
+        for (int y = max(ty-1, 0); y <= ty; y++)
+            for (int x = max(tx-1, 0); x <= tx; x++)
+                dirtyCells[y*numTilesX+x] = 1;
+    }
+    if (elevationTiles.empty())
+        return false;
+    for (int t = 0; t < numTiles; t++)
+        if (dirtyCells[t])
+            cellTiles.push_back(t);
+
+    runOnTiles(elevationTiles, [this](int tx, int ty){
+        computeElevation(tx, ty);
+    });
+    runOnTiles(cellTiles, [this](int tx, int ty){
+        extractTile(tx, ty);
+    });
+    stitch();
+    if (full)
+        ofLogVerbose("ContourExtractor") << "update(): full extraction, " << numSegments << " segments, " << contours.size() << " contours";
+    needsFullUpdate = false;
+    return true;
+}
+
+void ContourExtractor::stitch(){
+    // Each end point key is shared by at most two segments
+    vector<const Segment*> segments;
+    for (auto & tile : tileSegments)
+        for (auto & segment : tile)
+            segments.push_back(&segment);
+    numSegments = segments.size();
+    std::unordered_map<uint64_t, std::pair<int, int> > ends;
+    ends.reserve(2*segments.size());
+    auto addEnd = [&](uint64_t key, int i){
+        auto it = ends.find(key);
+        if (it == ends.end())
+            ends[key] = std::make_pair(i, -1);
+        else
+            it->second.second = i;
+    };
+    for (int i = 0; i < segments.size(); i++){
+        addEnd(segments[i]->keyA, i);
+        addEnd(segments[i]->keyB, i);
+    }
+
+    contours.clear();
+    vector<bool> used(segments.size(), false);
+    std::deque<ofVec3f> points;
+    for (int i = 0; i < segments.size(); i++){
+        if (used[i])
+            continue;
+        used[i] = true;
+        points.clear();
+        points.push_back(segments[i]->a);
+        points.push_back(segments[i]->b);
+
+        /* Follow the line from both ends: */
+        bool closed = false;
+        for (int side = 0; side < 2 && !closed; side++){
+            uint64_t key = side == 0 ? segments[i]->keyB : segments[i]->keyA;
+            int current = i;
+            while (true){
+                const std::pair<int, int> & end = ends[key];
+                int next = end.first == current ? end.second : end.first;
+                if (next < 0)
+                    break;
+                if (used[next]){
+                    closed = next == i && key == segments[i]->keyA;
+                    break;
+                }
+                used[next] = true;
+                const Segment & segment = *segments[next];
+                bool forward = segment.keyA == key;
+                const ofVec3f & point = forward ? segment.b : segment.a;
+                key = forward ? segment.keyB : segment.keyA;
+                if (side == 0)
+                    points.push_back(point);
+                else
+                    points.push_front(point);
+                current = next;
+            }
+        }
+        if (closed)
+            points.pop_back(); // Same point as the first one
+
+        Contour contour;
+        contour.level = segments[i]->level;
+        contour.elevation = contour.level*parameters.contourLineDistance;
+        contour.closed = closed;
+        contour.depths.reserve(points.size());
+        for (auto & point : points){
+            contour.line.addVertex(point.x, point.y);
+            contour.depths.push_back(point.z);
+        }
+        contour.line.setClosed(closed);
+        contours.push_back(contour);
+    }
+}
+
+bool ContourExtractor::findClosestPoint(const ofVec2f & point, float selevation, ofVec2f & closest) const{
+    int level = round(selevation/parameters.contourLineDistance);
+    float minDistance = -1;
+    for (auto & contour : contours){
+        if (contour.level != level || contour.line.size() < 2)
+            continue;
+        ofPoint candidate = contour.line.getClosestPoint(ofPoint(point.x, point.y));
+        float distance = point.squareDistance(ofVec2f(candidate.x, candidate.y));
+        if (minDistance < 0 || distance < minDistance){
+            minDistance = distance;
+            closest = ofVec2f(candidate.x, candidate.y);
+        }
+    }
+    return minDistance >= 0;
+}
+
+void ContourExtractor::buildLineMesh(ofMesh & mesh, std::function<ofVec2f(const ofVec3f &)> worldToProj) const{
+    mesh.clear();
+    mesh.setMode(OF_PRIMITIVE_LINES);
+    for (auto & contour : contours){
+        int n = contour.line.size();
+        if (n < 2)
+            continue;
+        vector<ofVec3f> projected(n);
+        for (int i = 0; i < n; i++)
+            projected[i] = worldToProj(kinectToWorld(ofVec3f(contour.line[i].x, contour.line[i].y, contour.depths[i])));
+        int numLines = contour.closed ? n : n-1;
+        for (int i = 0; i < numLines; i++){
+            mesh.addVertex(projected[i]);
+            mesh.addVertex(projected[(i+1)%n]);
+        }
+    }
+}
+
+bool ContourExtractor::saveSvg(string path) const{
+    const ofRectangle & ROI = parameters.kinectROI;
+    std::ostringstream svg;
+    svg << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    svg << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << ROI.width << "\" height=\"" << ROI.height
+        << "\" viewBox=\"" << ROI.x << " " << ROI.y << " " << ROI.width << " " << ROI.height << "\">\n";
+    for (auto & contour : contours){
+        svg << (contour.closed ? "<polygon" : "<polyline") << " data-elevation=\"" << contour.elevation
+            << "\" fill=\"none\" stroke=\"black\" stroke-width=\"0.5\" points=\"";
+        for (auto & point : contour.line.getVertices())
+            svg << point.x << "," << point.y << " ";
+        svg << "\"/>\n";
+    }
+    svg << "</svg>\n";
+
+    ofDirectory::createDirectory(ofFilePath::getEnclosingDirectory(path), true, true);
+    string content = svg.str();
+    ofBuffer buffer(content.data(), content.size());
+    bool saved = ofBufferToFile(path, buffer);
+    ofLogVerbose("ContourExtractor") << "saveSvg(): " << contours.size() << " contours saved to " << path << (saved ? "" : " FAILED");
+    return saved;
+}
@@ -0,0 +1,109 @@
+/***********************************************************************
+ContourExtractor - ContourExtractor computes the contour lines of the
+sand surface as polylines with a tiled, multi-threaded marching squares.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+// The elevation map (same elevation as the shaders: signed distance to the
+// base plane) is computed for the kinect ROI and split in square tiles. Each
+// tile keeps the marching squares segments of its cells, only the tiles
+// touching changed depth tiles are extracted again. Segments end points are
+// keyed by their grid edge so that the segments of all tiles are stitched
+// in polylines without any tolerance.
+class ContourExtractor {
+public:
+    struct Parameters {
+        ofMatrix4x4 kinectWorldMatrix; // Kinect image space to kinect world space
+        ofVec4f basePlaneEq;
+        float depthMin, depthMax; // Depths are clamped to this range, like in the shaders
+        float contourLineDistance;
+        ofRectangle kinectROI;
+    };
+
+    struct Contour {
+        int level; // Elevation = level*contourLineDistance
+        float elevation;
+        bool closed;
+        ofPolyline line; // Kinect image coordinates
+        vector<float> depths; // Interpolated depth of each vertex of the line
+    };
+
+    ContourExtractor();
+
+    void setup(int width, int height, int tileSize = 32, int numThreads = 0);
+    bool setParameters(const Parameters & parameters); // Returns true (and forces a full extraction) if they changed
+
+    // changedTiles: one byte per tileSize tile of the depth image, non zero where the depth
+    // changed since the last update (NULL: everything changed). Returns true if the contours changed.
+    bool update(const ofFloatPixels & depth, const vector<unsigned char>* changedTiles = NULL);
+
+    const vector<Contour> & getContours() const {
+        return contours;
+    }
+    float getElevation(int x, int y) const { // Elevation map (inside the ROI)
+        return elevation[y*width+x];
+    }
+    int getNumSegments() const {
+        return numSegments;
+    }
+
+    // Closest point (kinect coordinates) of the contour lines at the given elevation, e.g. 0 for the shoreline
+    bool findClosestPoint(const ofVec2f & point, float elevation, ofVec2f & closest) const;
+
+    // Line batch (OF_PRIMITIVE_LINES) of all the contours, worldToProj maps world points to the projector
+    void buildLineMesh(ofMesh & mesh, std::function<ofVec2f(const ofVec3f &)> worldToProj) const;
+
+    // Contours in kinect image coordinates, one polyline per contour with its elevation
+    bool saveSvg(string path) const;
+
+private:
+    struct Segment {
+        ofVec3f a, b; // x, y in kinect image coordinates, z: depth
+        uint64_t keyA, keyB; // Grid edge and level of the end points
+        int level;
+    };
+
+    void computeElevation(int tx, int ty);
+    void extractTile(int tx, int ty);
+    void addCellSegments(int x, int y, vector<Segment> & segments);
+    ofVec3f edgePoint(int x0, int y0, int x1, int y1, float level) const;
+    uint64_t edgeKey(int x, int y, bool vertical, int level) const;
+    void stitch();
+    ofVec3f kinectToWorld(const ofVec3f & p) const;
+    void runOnTiles(const vector<int> & tiles, std::function<void(int, int)> work);
+
+    int width, height;
+    int tileSize;
+    int numTilesX, numTilesY;
+    int numThreads;
+
+    Parameters parameters;
+    bool needsFullUpdate;
+    const ofFloatPixels* depth;
+
+    vector<float> elevation; // Per pixel, NaN outside of the ROI
+    vector<float> clampedDepth;
+    vector<vector<Segment> > tileSegments; // Segments of the cells of each tile
+    int numSegments;
+
+    vector<Contour> contours;
+};
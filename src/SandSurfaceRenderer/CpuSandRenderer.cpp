@@ -0,0 +1,245 @@
+/***********************************************************************
+CpuSandRenderer - CpuSandRenderer rasterises the projector image of the
+sand surface on the CPU, as a reference for the shaders and a fallback
+when no GPU rendering is available.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "CpuSandRenderer.h"
+#include <thread>
+
+CpuSandRenderer::CpuSandRenderer()
+:projResX(0),
+projResY(0),
+bufferWidth(0),
+bufferHeight(0),
+numThreads(1),
+lutResolution(8),
+numColorMapEntries(0),
+depth(NULL),
+gridWidth(0),
+gridHeight(0)
+{
+}
+
+void CpuSandRenderer::setup(int sprojResX, int sprojResY, int snumThreads){
+    projResX = sprojResX;
+    projResY = sprojResY;
+    bufferWidth = projResX+1;
+    bufferHeight = projResY+1;
+    numThreads = snumThreads > 0 ? snumThreads : max(1u, std::thread::hardware_concurrency());
+    elevationBuffer.resize(bufferWidth*bufferHeight);
+    ofLogVerbose("CpuSandRenderer") << "setup(): " << projResX << "x" << projResY << " threads: " << numThreads;
+}
+
+void CpuSandRenderer::setColorMap(const ofPixels & colorMapEntries){
+    // Pre-interpolate the color map (GL_LINEAR, clamped to edge) so that the
+    // shading loop only needs a clamped index per pixel
+    numColorMapEntries = colorMapEntries.getWidth();
+    int channels = colorMapEntries.getNumChannels();
+    const unsigned char* entries = colorMapEntries.getData();
+    colorLUT.resize(numColorMapEntries*lutResolution);
+    for (int k = 0; k < colorLUT.size(); k++){
+        float u = (k+0.5f)/lutResolution-0.5f; // Texel coordinate relative to the texel centers
+        int i0 = ofClamp(floor(u), 0, numColorMapEntries-1);
+        int i1 = ofClamp(floor(u)+1, 0, numColorMapEntries-1);
+        float w = u-floor(u);
+        uint32_t color = 0;
+        for (int c = 0; c < 3; c++){
+            float val = entries[i0*channels+c]*(1-w)+entries[i1*channels+c]*w;
+            color |= static_cast<uint32_t>(val+0.5f) << (8*c);
+        }
+        colorLUT[k] = color | 0xff000000u;
+    }
+}
+
+void CpuSandRenderer::runInBands(int numRows, std::function<void(int, int)> work){
+    // Each thread processes a band of rows
+    vector<std::thread> workers;
+    for (int i = 1; i < numThreads; i++)
+        workers.push_back(std::thread(work, i*numRows/numThreads, (i+1)*numRows/numThreads));
+    work(0, numRows/numThreads);
+    for (auto & worker : workers)
+        worker.join();
+}
+
+void CpuSandRenderer::projectRows(int startRow, int endRow){
+    const ofMatrix4x4 & W = parameters.kinectWorldMatrix;
+    const ofMatrix4x4 & P = parameters.kinectProjMatrix;
+    const ofVec4f & plane = parameters.basePlaneEq;
+    int depthWidth = depth->getWidth();
+    const float* depthData = depth->getData();
+    for (int gy = startRow; gy < endRow; gy++){
+        ProjectedVertex* vertexPtr = &vertices[gy*gridWidth];
+        for (int gx = 0; gx < gridWidth; gx++, vertexPtr++){
+            // Vertices are moved of half a pixel and read the depth texture at their position, like in the vertex shaders
+            float kx = parameters.kinectROI.x+gx-0.5f;
+            float ky = parameters.kinectROI.y+gy-0.5f;
+            int tx = max(0, (int)parameters.kinectROI.x+gx-1);
+            int ty = max(0, (int)parameters.kinectROI.y+gy-1);
+            float d = ofClamp(depthData[ty*depthWidth+tx], parameters.depthMin, parameters.depthMax);
+
+            /* Transform the vertex from depth image space to world space: */
+            float wx = (W(0, 0)*kx+W(0, 1)*ky+W(0, 2)*d+W(0, 3))*d;
+            float wy = (W(1, 0)*kx+W(1, 1)*ky+W(1, 2)*d+W(1, 3))*d;
+            float wz = (W(2, 0)*kx+W(2, 1)*ky+W(2, 2)*d+W(2, 3))*d;
+
+            vertexPtr->elevation = plane.x*wx+plane.y*wy+plane.z*wz+plane.w;
+
+            /* Transform vertex to proj coordinates: */
+            float sx = P(0, 0)*wx+P(0, 1)*wy+P(0, 2)*wz+P(0, 3);
+            float sy = P(1, 0)*wx+P(1, 1)*wy+P(1, 2)*wz+P(1, 3);
+            float sz = P(2, 0)*wx+P(2, 1)*wy+P(2, 2)*wz+P(2, 3);
+            vertexPtr->x = sx/sz;
+            vertexPtr->y = sy/sz;
+        }
+    }
+}
+
+void CpuSandRenderer::rasterizeTriangle(const ProjectedVertex & v0, const ProjectedVertex & v1, const ProjectedVertex & v2, int startRow, int endRow){
+    float area = (v1.x-v0.x)*(v2.y-v0.y)-(v2.x-v0.x)*(v1.y-v0.y);
+    if (area == 0 || area != area) // Degenerate or invalid projection
+        return;
+    int minX = max(0, (int)ceil(min(v0.x, min(v1.x, v2.x))-0.5f));
+    int maxX = min(bufferWidth-1, (int)floor(max(v0.x, max(v1.x, v2.x))-0.5f));
+    int minY = max(startRow, (int)ceil(min(v0.y, min(v1.y, v2.y))-0.5f));
+    int maxY = min(endRow-1, (int)floor(max(v0.y, max(v1.y, v2.y))-0.5f));
+    float invArea = 1.0f/area;
+    for (int y = minY; y <= maxY; y++){
+        float py = y+0.5f;
+        float* rowPtr = &elevationBuffer[y*bufferWidth];
+        for (int x = minX; x <= maxX; x++){
+            // Barycentric coordinates of the pixel center
+            float px = x+0.5f;
+            float w0 = ((v1.x-px)*(v2.y-py)-(v2.x-px)*(v1.y-py))*invArea;
+            float w1 = ((v2.x-px)*(v0.y-py)-(v0.x-px)*(v2.y-py))*invArea;
+            float w2 = 1-w0-w1;
+            if (w0 < 0 || w1 < 0 || w2 < 0)
+                continue;
+            rowPtr[x] = w0*v0.elevation+w1*v1.elevation+w2*v2.elevation;
+        }
+    }
+}
+
+void CpuSandRenderer::rasterizeBand(int startRow, int endRow){
+    std::fill(elevationBuffer.begin()+startRow*bufferWidth, elevationBuffer.begin()+endRow*bufferWidth, NAN);
+    // Triangles in the order of the mesh triangle strips, later triangles cover earlier ones
+    for (int gy = 0; gy < gridHeight-1; gy++){
+        for (int gx = 0; gx < gridWidth-1; gx++){
+            const ProjectedVertex & v00 = vertices[gy*gridWidth+gx];
+            const ProjectedVertex & v10 = vertices[gy*gridWidth+gx+1];
+            const ProjectedVertex & v01 = vertices[(gy+1)*gridWidth+gx];
+            const ProjectedVertex & v11 = vertices[(gy+1)*gridWidth+gx+1];
+            float minY = min(min(v00.y, v10.y), min(v01.y, v11.y));
+            float maxY = max(max(v00.y, v10.y), max(v01.y, v11.y));
+            if (maxY < startRow || minY > endRow) // Quad outside of the band
+                continue;
+            rasterizeTriangle(v00, v01, v10, startRow, endRow);
+            rasterizeTriangle(v01, v10, v11, startRow, endRow);
+        }
+    }
+}
+
+void CpuSandRenderer::shadeBand(int startRow, int endRow, unsigned char* imagePtr){
+    float contourScale = parameters.elevationMin-parameters.elevationMax;
+    float contourLineFactor = contourScale/parameters.contourLineDistance;
+    int lutSize = colorLUT.size();
+    float lutScale = lutResolution;
+    const uint32_t* lut = colorLUT.data();
+
+    // Contour interval of each buffer pixel, from the 8-bit elevation fbo value (1 where nothing was drawn)
+    vector<float> corners(2*bufferWidth);
+    auto contourRow = [&](int y, float* rowCorners){
+        const float* elevationPtr = &elevationBuffer[y*bufferWidth];
+        for (int x = 0; x < bufferWidth; x++){
+            float val = elevationPtr[x] == elevationPtr[x] ? ofClamp((elevationPtr[x]-parameters.elevationMax)/contourScale, 0, 1) : 1;
+            rowCorners[x] = floor(round(val*255)/255*contourLineFactor);
+        }
+    };
+    if (parameters.drawContourLines)
+        contourRow(startRow, &corners[0]);
+
+    for (int y = startRow; y < endRow; y++){
+        const float* elevationPtr = &elevationBuffer[y*bufferWidth];
+        uint32_t* outPtr = reinterpret_cast<uint32_t*>(imagePtr)+y*projResX;
+
+        /* Color map lookup: */
+        for (int x = 0; x < projResX; x++){
+            float t = elevationPtr[x]*parameters.heightMapScale+parameters.heightMapOffset;
+            int k = (int)ofClamp(t*lutScale, 0, lutSize-1);
+            outPtr[x] = elevationPtr[x] == elevationPtr[x] ? lut[k] : 0xff000000u;
+        }
+
+        if (!parameters.drawContourLines)
+            continue;
+        float* corners0 = &corners[(y-startRow)%2*bufferWidth];
+        float* corners1 = &corners[(y-startRow+1)%2*bufferWidth];
+        contourRow(y+1, corners1);
+        for (int x = 0; x < projResX; x++){
+            /* Find all pixel edges that cross at least one contour line: */
+            int edgeMask = 0;
+            int numEdges = 0;
+            if (corners0[x] != corners0[x+1]){
+                edgeMask += 1;
+                ++numEdges;
+            }
+            if (corners1[x] != corners1[x+1]){
+                edgeMask += 2;
+                ++numEdges;
+            }
+            if (corners0[x] != corners1[x]){
+                edgeMask += 4;
+                ++numEdges;
+            }
+            if (corners0[x+1] != corners1[x+1]){
+                edgeMask += 8;
+                ++numEdges;
+            }
+            /* Same cases as heightMapShader (the GL window origin is at the bottom): */
+            int glY = projResY-1-y;
+            if (numEdges > 2 || edgeMask == 3 || edgeMask == 12 || (numEdges == 2 && (x+glY)%2 == 0))
+                outPtr[x] = 0xff000000u;
+        }
+    }
+}
+
+void CpuSandRenderer::render(const ofFloatPixels & sdepth, const Parameters & sparameters, ofPixels & image){
+    depth = &sdepth;
+    parameters = sparameters;
+    gridWidth = parameters.kinectROI.width;
+    gridHeight = parameters.kinectROI.height;
+    if (!image.isAllocated() || image.getWidth() != projResX || image.getHeight() != projResY || image.getNumChannels() != 4)
+        image.allocate(projResX, projResY, 4);
+    if (colorLUT.empty() || gridWidth < 2 || gridHeight < 2){
+        image.set(0);
+        return;
+    }
+    vertices.resize(gridWidth*gridHeight);
+
+    runInBands(gridHeight, [this](int startRow, int endRow){
+        projectRows(startRow, endRow);
+    });
+    runInBands(bufferHeight, [this](int startRow, int endRow){
+        rasterizeBand(startRow, endRow);
+    });
+    unsigned char* imagePtr = image.getData();
+    runInBands(projResY, [this, imagePtr](int startRow, int endRow){
+        shadeBand(startRow, endRow, imagePtr);
+    });
+}
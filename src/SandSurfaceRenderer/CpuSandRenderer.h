@@ -0,0 +1,79 @@
+/***********************************************************************
+CpuSandRenderer - CpuSandRenderer rasterises the projector image of the
+sand surface on the CPU, as a reference for the shaders and a fallback
+when no GPU rendering is available.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+// Follows the GPU pipeline of the SandSurfaceRenderer: the ROI grid is
+// projected and rasterised in an elevation buffer one pixel larger than
+// the projector image (like contourLineFramebufferObject, including its
+// 8-bit quantisation), which is then shaded with the color map and the
+// contour lines of heightMapShader.
+class CpuSandRenderer {
+public:
+    struct Parameters {
+        ofMatrix4x4 kinectWorldMatrix; // Kinect image space to kinect world space
+        ofMatrix4x4 kinectProjMatrix; // Kinect world space to projector image space
+        ofVec4f basePlaneEq;
+        float depthMin, depthMax; // Range of the depth texture, depths are clamped to it
+        float heightMapScale, heightMapOffset; // Elevation to color map texture coordinate
+        float elevationMin, elevationMax; // Range of the contour line buffer
+        float contourLineDistance;
+        bool drawContourLines;
+        ofRectangle kinectROI;
+    };
+
+    CpuSandRenderer();
+
+    void setup(int projResX, int projResY, int numThreads = 0);
+    void setColorMap(const ofPixels & colorMapEntries); // One row of RGB(A) entries
+
+    // Render depth (kinect resolution, mm) in an RGBA image of projector size
+    void render(const ofFloatPixels & depth, const Parameters & parameters, ofPixels & image);
+
+private:
+    struct ProjectedVertex {
+        float x, y; // Projector coordinates
+        float elevation;
+    };
+
+    void projectRows(int startRow, int endRow);
+    void rasterizeBand(int startRow, int endRow);
+    void rasterizeTriangle(const ProjectedVertex & v0, const ProjectedVertex & v1, const ProjectedVertex & v2, int startRow, int endRow);
+    void shadeBand(int startRow, int endRow, unsigned char* imagePtr);
+    void runInBands(int numRows, std::function<void(int, int)> work);
+
+    int projResX, projResY;
+    int bufferWidth, bufferHeight; // Elevation buffer size (projector size + 1)
+    int numThreads;
+
+    vector<uint32_t> colorLUT; // RGBA colors, lutResolution entries per color map entry
+    int lutResolution;
+    int numColorMapEntries;
+
+    const ofFloatPixels* depth;
+    Parameters parameters;
+    int gridWidth, gridHeight;
+    vector<ProjectedVertex> vertices;
+    vector<float> elevationBuffer; // NaN where no triangle was rasterised
+};
@@ -0,0 +1,363 @@
+/***********************************************************************
+Hydrology - Hydrology computes where the rain flows on the sand surface:
+D8 flow directions, depression breaching, flow accumulation and rivers.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "Hydrology.h"
+#include <queue>
+
+namespace {
+    const int neighbourDx[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+    const int neighbourDy[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+    const float neighbourDistance[8] = {1, 1.41421356f, 1, 1.41421356f, 1, 1.41421356f, 1, 1.41421356f};
+
+    typedef std::pair<float, int> FloodNode; // (elevation, index): same order as Hydrology::isLower
+    typedef std::priority_queue<FloodNode, vector<FloodNode>, std::greater<FloodNode> > FloodQueue;
+}
+
+// No cycle can appear in the flow: the key (elevation, index) of a cell, or of
+// its pit for a carved cell, strictly decreases along the flow except along a
+// carved path, and a path ends on an outlet with a key lower than its pit.
+Hydrology::Hydrology()
+:width(0),
+height(0),
+tileSize(32),
+tilesCols(0),
+tilesRows(0),
+maxFloodCells(4096), // Larger depressions are lakes
+riverThreshold(400),
+initialized(false),
+numSinks(0),
+currentStamp(0)
+{
+}
+
+void Hydrology::setup(int swidth, int sheight, int stileSize){
+    width = swidth;
+    height = sheight;
+    tileSize = stileSize;
+    tilesCols = (width+tileSize-1)/tileSize;
+    tilesRows = (height+tileSize-1)/tileSize;
+    int size = width*height;
+    elevation.assign(size, NAN);
+    receiver.assign(size, -1);
+    carvedBy.assign(size, -1);
+    carvedPaths.clear();
+    outletPits.clear();
+    floodStamp.assign(size, 0);
+    floodPredecessor.assign(size, -1);
+    currentStamp = 0;
+    accumulation.assign(size, 0);
+    rivers.clear();
+    numSinks = 0;
+    initialized = false;
+    ofLogVerbose("Hydrology") << "setup(): " << width << "x" << height << " tiles: " << tilesCols << "x" << tilesRows;
+}
+
+void Hydrology::setRiverThreshold(float sriverThreshold){
+    riverThreshold = sriverThreshold;
+    if (initialized)
+        extractRivers();
+}
+
+bool Hydrology::update(const ofFloatPixels & selevation, const vector<unsigned char>* changedTiles){
+    if (width == 0 || selevation.getWidth() != width || selevation.getHeight() != height)
+        return false;
+    int numTiles = tilesCols*tilesRows;
+    vector<unsigned char> allTiles;
+    if (!initialized || changedTiles == NULL){
+        allTiles.assign(numTiles, 1);
+        changedTiles = &allTiles;
+        carvedPaths.clear();
+        outletPits.clear();
+        std::fill(carvedBy.begin(), carvedBy.end(), -1);
+        initialized = true;
+    }
+    const vector<unsigned char> & tiles = *changedTiles;
+    if (std::count(tiles.begin(), tiles.end(), 0) == numTiles)
+        return false;
+
+    const float* elevationPtr = selevation.getData();
+    for (int ty = 0; ty < tilesRows; ty++)
+        for (int tx = 0; tx < tilesCols; tx++){
+            if (!tiles[ty*tilesCols+tx])
+                continue;
+            int maxX = min(width, (tx+1)*tileSize);
+            for (int y = ty*tileSize; y < min(height, (ty+1)*tileSize); y++)
+                for (int x = tx*tileSize; x < maxX; x++)
+                    elevation[y*width+x] = elevationPtr[y*width+x];
+        }
+
+    // Paths crossing or ending in the changed tiles are no longer valid
+    auto tileChanged = [&](int i){
+        return tiles[((i/width)/tileSize)*tilesCols+(i%width)/tileSize] != 0;
+    };
+    vector<int> pitsToBreach;
+    vector<int> brokenPits;
+    for (auto & path : carvedPaths){
+        bool broken = tileChanged(path.second.outlet);
+        for (int i = 0; !broken && i < path.second.cells.size(); i++)
+            broken = tileChanged(path.second.cells[i]);
+        if (broken)
+            brokenPits.push_back(path.first);
+    }
+    for (auto pit : brokenPits)
+        resetPath(pit, pitsToBreach);
+
+    // Flow directions of the changed tiles and of the cells around them, whose
+    // steepest neighbour may have changed
+    for (int ty = 0; ty < tilesRows; ty++)
+        for (int tx = 0; tx < tilesCols; tx++){
+            if (!tiles[ty*tilesCols+tx])
+                continue;
+            int minX = max(0, tx*tileSize-1);
+            int maxX = min(width, (tx+1)*tileSize+1);
+            int maxY = min(height, (ty+1)*tileSize+1);
+            for (int y = max(0, ty*tileSize-1); y < maxY; y++)
+                for (int x = minX; x < maxX; x++){
+                    int i = y*width+x;
+                    if (carvedBy[i] != -1)
+                        continue;
+                    receiver[i] = steepestDescent(i);
+                    if (receiver[i] == -1 && !std::isnan(elevation[i]))
+                        pitsToBreach.push_back(i);
+                }
+        }
+
+    // Lowest pits first, their paths become outlets for the higher ones
+    std::sort(pitsToBreach.begin(), pitsToBreach.end());
+    pitsToBreach.erase(std::unique(pitsToBreach.begin(), pitsToBreach.end()), pitsToBreach.end());
+    FloodQueue pits;
+    for (auto pit : pitsToBreach)
+        pits.push(FloodNode(elevation[pit], pit));
+    int numBreached = 0;
+    while (!pits.empty()){
+        int pit = pits.top().second;
+        pits.pop();
+        if (carvedBy[pit] != -1 || receiver[pit] != -1 || std::isnan(elevation[pit]))
+            continue;
+        brokenPits.clear();
+        if (breach(pit, brokenPits))
+            numBreached++;
+        for (auto brokenPit : brokenPits)
+            pits.push(FloodNode(elevation[brokenPit], brokenPit));
+    }
+
+    computeAccumulation();
+    extractRivers();
+    ofLogVerbose("Hydrology") << "update(): breached pits: " << numBreached << " sinks: " << numSinks << " rivers: " << rivers.size();
+    return true;
+}
+
+int Hydrology::steepestDescent(int i) const{
+    float h = elevation[i];
+    if (std::isnan(h))
+        return -1;
+    int x = i%width;
+    int y = i/width;
+    int steepest = -1;
+    float steepestSlope = 0;
+    for (int k = 0; k < 8; k++){
+        int nx = x+neighbourDx[k];
+        int ny = y+neighbourDy[k];
+        if (nx < 0 || nx >= width || ny < 0 || ny >= height)
+            continue;
+        int j = ny*width+nx;
+        float slope = (h-elevation[j])/neighbourDistance[k]; // NaN for walls
+        if (slope > steepestSlope){
+            steepestSlope = slope;
+            steepest = j;
+        }
+    }
+    return steepest;
+}
+
+bool Hydrology::isLower(int i, int j) const{
+    return elevation[i] < elevation[j] || (elevation[i] == elevation[j] && i < j);
+}
+
+int Hydrology::potential(int i) const{
+    return carvedBy[i] != -1 ? carvedBy[i] : i;
+}
+
+bool Hydrology::breach(int pit, vector<int> & brokenPits){
+    // Flood from the pit in elevation order until a cell draining lower than the pit
+    currentStamp++;
+    FloodQueue queue;
+    floodStamp[pit] = currentStamp;
+    floodPredecessor[pit] = -1;
+    queue.push(FloodNode(elevation[pit], pit));
+    int outlet = -1;
+    for (int numFlooded = 0; !queue.empty() && numFlooded < maxFloodCells; numFlooded++){
+        int i = queue.top().second;
+        queue.pop();
+        if (i != pit && isLower(potential(i), pit)){
+            outlet = i;
+            break;
+        }
+        int x = i%width;
+        int y = i/width;
+        for (int k = 0; k < 8; k++){
+            int nx = x+neighbourDx[k];
+            int ny = y+neighbourDy[k];
+            if (nx < 0 || nx >= width || ny < 0 || ny >= height)
+                continue;
+            int j = ny*width+nx;
+            if (floodStamp[j] == currentStamp || std::isnan(elevation[j]))
+                continue;
+            floodStamp[j] = currentStamp;
+            floodPredecessor[j] = i;
+            queue.push(FloodNode(elevation[j], j));
+        }
+    }
+    if (outlet == -1)
+        return false; // Sink
+
+    CarvedPath path;
+    path.outlet = outlet;
+    for (int i = floodPredecessor[outlet]; i != -1; i = floodPredecessor[i])
+        path.cells.push_back(i);
+    std::reverse(path.cells.begin(), path.cells.end());
+    // The path goes through cells carved by higher pits, they have to find another way
+    for (auto i : path.cells)
+        if (carvedBy[i] != -1)
+            resetPath(carvedBy[i], brokenPits);
+    for (int n = 0; n < path.cells.size(); n++){
+        int i = path.cells[n];
+        carvedBy[i] = pit;
+        receiver[i] = n+1 < path.cells.size() ? path.cells[n+1] : outlet;
+    }
+    outletPits.insert(std::make_pair(outlet, pit));
+    carvedPaths[pit] = std::move(path);
+    return true;
+}
+
+void Hydrology::resetPath(int pit, vector<int> & pitsToBreach){
+    auto pathIt = carvedPaths.find(pit);
+    if (pathIt == carvedPaths.end())
+        return;
+    CarvedPath path = std::move(pathIt->second);
+    carvedPaths.erase(pathIt);
+    auto outletRange = outletPits.equal_range(path.outlet);
+    for (auto it = outletRange.first; it != outletRange.second; ++it)
+        if (it->second == pit){
+            outletPits.erase(it);
+            break;
+        }
+    for (auto i : path.cells)
+        carvedBy[i] = -1;
+    for (auto i : path.cells)
+        receiver[i] = steepestDescent(i);
+    pitsToBreach.push_back(pit);
+
+    // The paths draining into this one relied on its lower key
+    vector<int> drainingPits;
+    for (auto i : path.cells){
+        auto range = outletPits.equal_range(i);
+        for (auto it = range.first; it != range.second; ++it)
+            drainingPits.push_back(it->second);
+    }
+    for (auto drainingPit : drainingPits)
+        resetPath(drainingPit, pitsToBreach);
+}
+
+void Hydrology::computeAccumulation(){
+    // Cells are added to their receiver once all their donors have been added to them
+    int size = width*height;
+    vector<int> numDonors(size, 0);
+    for (int i = 0; i < size; i++)
+        if (receiver[i] != -1)
+            numDonors[receiver[i]]++;
+    vector<int> ready;
+    numSinks = 0;
+    for (int i = 0; i < size; i++){
+        bool wall = std::isnan(elevation[i]);
+        accumulation[i] = wall ? 0 : 1;
+        if (!wall && receiver[i] == -1)
+            numSinks++;
+        if (numDonors[i] == 0)
+            ready.push_back(i);
+    }
+    while (!ready.empty()){
+        int i = ready.back();
+        ready.pop_back();
+        int r = receiver[i];
+        if (r == -1)
+            continue;
+        accumulation[r] += accumulation[i];
+        if (--numDonors[r] == 0)
+            ready.push_back(r);
+    }
+}
+
+void Hydrology::extractRivers(){
+    // A river starts on a river cell without river donors and stops at the
+    // first already traced cell (a confluence) or at a sink
+    rivers.clear();
+    int size = width*height;
+    vector<unsigned char> hasRiverDonor(size, 0);
+    for (int i = 0; i < size; i++)
+        if (accumulation[i] >= riverThreshold && receiver[i] != -1)
+            hasRiverDonor[receiver[i]] = 1;
+    vector<unsigned char> traced(size, 0);
+    for (int start = 0; start < size; start++){
+        if (accumulation[start] < riverThreshold || hasRiverDonor[start])
+            continue;
+        River river;
+        int i = start;
+        while (true){
+            river.line.addVertex(i%width+0.5f, i/width+0.5f);
+            if (traced[i])
+                break;
+            traced[i] = 1;
+            if (receiver[i] == -1)
+                break;
+            i = receiver[i];
+        }
+        river.discharge = accumulation[i];
+        if (river.line.size() >= 2)
+            rivers.push_back(river);
+    }
+}
+
+void Hydrology::getRiverPixels(ofPixels & pixels) const{
+    if (pixels.getWidth() != width || pixels.getHeight() != height || pixels.getNumChannels() != 1)
+        pixels.allocate(width, height, 1);
+    unsigned char* pixelsPtr = pixels.getData();
+    float scale = 127/log(max(2.0f, width*height/riverThreshold));
+    for (int i = 0; i < width*height; i++, pixelsPtr++){
+        float a = accumulation[i];
+        *pixelsPtr = a < riverThreshold ? 0 : static_cast<unsigned char>(128+min(127.0f, log(a/riverThreshold)*scale));
+    }
+}
+
+void Hydrology::buildLineMesh(ofMesh & mesh, std::function<ofVec2f(const ofVec2f &)> kinectToProj) const{
+    mesh.clear();
+    mesh.setMode(OF_PRIMITIVE_LINES);
+    for (auto & river : rivers){
+        ofVec2f previous = kinectToProj(river.line[0]);
+        for (int i = 1; i < river.line.size(); i++){
+            ofVec2f current = kinectToProj(river.line[i]);
+            mesh.addVertex(ofVec3f(previous));
+            mesh.addVertex(ofVec3f(current));
+            previous = current;
+        }
+    }
+}
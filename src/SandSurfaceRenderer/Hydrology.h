@@ -0,0 +1,104 @@
+/***********************************************************************
+Hydrology - Hydrology computes where the rain flows on the sand surface:
+D8 flow directions, depression breaching, flow accumulation and rivers.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+// Each cell (one kinect pixel) flows to its steepest lower neighbour (D8).
+// Pits are breached: a flood in elevation order from the pit finds the
+// cheapest path to a cell draining lower than the pit, and the cells of the
+// path are redirected along it. Pits whose flood exceeds maxFloodCells are
+// kept as sinks (lakes). Only the changed tiles and the paths crossing them
+// are computed again. The accumulation is the number of cells draining
+// through each cell, cells over the river threshold form the rivers.
+class Hydrology {
+public:
+    struct River {
+        ofPolyline line; // Kinect image coordinates, from upstream to downstream
+        float discharge; // Accumulation at the downstream end (cells)
+    };
+
+    Hydrology();
+
+    void setup(int width, int height, int tileSize = 32);
+    void setRiverThreshold(float sriverThreshold); // Accumulation (cells) of the smallest river
+
+    // elevation: height of the sand (mm, NaN outside of the sandbox). changedTiles: one byte per
+    // tileSize tile, non zero where the elevation changed (NULL: everything changed).
+    // Returns true if the flow accumulation changed.
+    bool update(const ofFloatPixels & elevation, const vector<unsigned char>* changedTiles = NULL);
+
+    int getReceiver(int x, int y) const { // Index (y*width+x) of the downstream cell, -1 for sinks
+        return receiver[y*width+x];
+    }
+    float getAccumulation(int x, int y) const {
+        return accumulation[y*width+x];
+    }
+    int getNumSinks() const {
+        return numSinks;
+    }
+    const vector<River> & getRivers() const {
+        return rivers;
+    }
+
+    // 8 bits river image: 0 outside of the rivers, 128 to 255 with the log of the accumulation
+    void getRiverPixels(ofPixels & pixels) const;
+
+    // Line batch (OF_PRIMITIVE_LINES) of the rivers, kinectToProj maps kinect image points to the projector
+    void buildLineMesh(ofMesh & mesh, std::function<ofVec2f(const ofVec2f &)> kinectToProj) const;
+
+private:
+    struct CarvedPath {
+        vector<int> cells; // From the pit, each cell flows to the next one
+        int outlet; // The last cell flows to the outlet
+    };
+
+    int steepestDescent(int i) const;
+    bool isLower(int i, int j) const; // Strict order on (elevation, index)
+    int potential(int i) const; // Cell whose key bounds the keys of all the cells downstream of i
+    bool breach(int pit, vector<int> & brokenPits); // False if the pit is a sink
+    void resetPath(int pit, vector<int> & pitsToBreach);
+    void computeAccumulation();
+    void extractRivers();
+
+    int width, height;
+    int tileSize;
+    int tilesCols, tilesRows;
+    int maxFloodCells;
+    float riverThreshold;
+    bool initialized;
+
+    vector<float> elevation; // NaN for walls
+    vector<int> receiver;
+    vector<int> carvedBy; // Pit whose path goes through the cell, -1 if none
+    std::map<int, CarvedPath> carvedPaths; // By pit
+    std::multimap<int, int> outletPits; // Pits by outlet
+    int numSinks;
+
+    // Flood buffers, reused by all the breaches
+    vector<int> floodStamp;
+    vector<int> floodPredecessor;
+    int currentStamp;
+
+    vector<float> accumulation;
+    vector<River> rivers;
+};
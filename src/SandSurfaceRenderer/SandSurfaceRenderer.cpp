@@ -29,7 +29,28 @@ using namespace ofxCSG;
 
 SandSurfaceRenderer::SandSurfaceRenderer(std::shared_ptr<KinectProjector> const& k, std::shared_ptr<ofAppBaseWindow> const& p)
 :settingsLoaded(false),
-editColorMap(false){
+editColorMap(false),
+useAdaptiveMesh(false),
+adaptiveMeshDrawCount(0),
+useCpuRenderer(false),
+useVectorContourLines(false),
+singlePassContourLines(true),
+useHillshading(false),
+hillshadingStrength(1),
+lightDirection(ofVec3f(-1, -1, sqrt(2.0f)).normalize()), // Cartographic convention: light from the upper left, 45 degrees high
+useWaterSimulation(false),
+waterTerrainDirty(true),
+rainRate(0),
+waterDisplayDepth(20),
+waterColor(30, 90, 220, 200),
+useRivers(false),
+useVectorRivers(false),
+hydrologyDirty(true),
+riversDirty(false),
+riverThreshold(400),
+riverColor(10, 40, 160, 230),
+surfaceDirty(true),
+contourLinesDirty(true){
     kinectProjector = k;
     projWindow = p;
 }
@@ -57,6 +78,17 @@ void SandSurfaceRenderer::setup(bool sdisplayGui){
     } else {
         ofLogVerbose("SandSurfaceRenderer") << "SandSurfaceRenderer.setup(): sandSurfaceRendererSettings.xml could not be loaded " ;
     }
+    kinectProjector->setComputeNormals(useHillshading);
+    
+    // Water simulation on the kinect grid
+    waterSimulation.setup(kinectProjector->getKinectRes().x, kinectProjector->getKinectRes().y);
+    waterSimulation.setRain(rainRate/60);
+    setWaterSimulation(useWaterSimulation);
+    
+    // Rivers on the kinect grid, following the tiles of the depth change detection
+    hydrology.setup(kinectProjector->getKinectRes().x, kinectProjector->getKinectRes().y, kinectProjector->getDepthTileSize());
+    hydrology.setRiverThreshold(riverThreshold);
+    setRivers(useRivers);
 
     // Load colormap folder and set heightmap
     colorMapPath = "colorMaps/";
@@ -126,7 +158,10 @@ void SandSurfaceRenderer::setup(bool sdisplayGui){
     if (!loaded)
     {
         ofLogError("GreatSand") << "setup(): shader not loaded" ;
+        useCpuRenderer = true; // Fall back to the CPU rendering path
     }
+    cpuRenderer.setup(projResX, projResY);
+    cpuRenderedImage.allocate(projResX, projResY, OF_IMAGE_COLOR_ALPHA);
     
     //Prepare fbo
     fboProjWindow.allocate(projResX, projResY, GL_RGBA);
@@ -175,45 +210,109 @@ void SandSurfaceRenderer::updateRangesAndBasePlane(){
 }
 
 void SandSurfaceRenderer::setupMesh(){
-    // Initialise mesh
-    ofRectangle kinectROI = kinectProjector->getKinectROI();
+    // Initialise the grid once at kinect resolution
     ofVec2f kinectRes = kinectProjector->getKinectRes();
-    meshwidth = kinectROI.width;
-    meshheight = kinectROI.height;
-    mesh.clear();
+    meshwidth = kinectRes.x;
+    meshheight = kinectRes.y;
+    vector<ofVec3f> vertices;
+    vertices.reserve(meshwidth*meshheight);
     for(unsigned int y=0;y<meshheight;y++)
         for(unsigned int x=0;x<meshwidth;x++)
-        {
-            ofPoint pt = ofPoint(x+kinectROI.x,y+kinectROI.y,0.0f)-ofPoint(0.5,0.5,0); // We move of a half pixel to center the color pixel (more beautiful)
-            mesh.addVertex(pt); // make a new vertex
-            mesh.addTexCoord(pt);
-        }
+            vertices.push_back(ofVec3f(x, y, 0.0f));
+    
+    // One triangle strip per grid row, rows are joined by degenerate triangles
+    // so that the first n rows are a contiguous range of the index buffer
+    meshRowIndices = 2*meshwidth+2;
+    numMeshIndices = (meshheight-1)*meshRowIndices-2;
+    vector<ofIndexType> indices;
+    indices.reserve(numMeshIndices);
     for(unsigned int y=0;y<meshheight-1;y++)
-        for(unsigned int x=0;x<meshwidth-1;x++)
+    {
+        if (y > 0)
+            indices.push_back(y*meshwidth); // Degenerate: repeat the first vertex of the row
+        for(unsigned int x=0;x<meshwidth;x++)
         {
-            mesh.addIndex(x+y*meshwidth);         // 0
-            mesh.addIndex((x+1)+y*meshwidth);     // 1
-            mesh.addIndex(x+(y+1)*meshwidth);     // 10
-            
-            mesh.addIndex((x+1)+y*meshwidth);     // 1
-            mesh.addIndex((x+1)+(y+1)*meshwidth); // 11
-            mesh.addIndex(x+(y+1)*meshwidth);     // 10
+            indices.push_back(x+y*meshwidth);
+            indices.push_back(x+(y+1)*meshwidth);
         }
+        if (y < meshheight-2)
+            indices.push_back((meshwidth-1)+(y+1)*meshwidth); // Degenerate: repeat the last vertex of the row
+    }
+    meshVbo.setVertexData(vertices.data(), vertices.size(), GL_STATIC_DRAW);
+    meshVbo.setIndexData(indices.data(), indices.size(), GL_STATIC_DRAW);
+    adaptiveMeshVbo.setVertexData(vertices.data(), vertices.size(), GL_STATIC_DRAW);
+    adaptiveMesh.setup(meshwidth, meshheight);
+    contourExtractor.setup(meshwidth, meshheight, kinectProjector->getDepthTileSize());
+    
+    updateMeshROI();
+}
+
+void SandSurfaceRenderer::updateMeshROI(){
+    // Only the grid offset and the drawn range depend on the ROI
+    ofRectangle kinectROI = kinectProjector->getKinectROI();
+    ofPoint origin = ofPoint(kinectROI.x, kinectROI.y)-ofPoint(0.5, 0.5); // We move of a half pixel to center the color pixel (more beautiful)
+    meshROI = ofVec4f(origin.x, origin.y, origin.x+kinectROI.width-1, origin.y+kinectROI.height-1);
+    int numRows = ofClamp(kinectROI.height-1, 0, meshheight-1);
+    meshDrawCount = min(numRows*meshRowIndices-1, numMeshIndices);
+    if (numRows == 0)
+        meshDrawCount = 0;
+    adaptiveMesh.setROI(kinectROI);
+    ofLogVerbose("SandSurfaceRenderer") << "updateMeshROI(): kinectROI: " << kinectROI << " indices drawn: " << meshDrawCount;
+}
+
+void SandSurfaceRenderer::updateAdaptiveMesh(){
+    // Only the quadtree tiles where the depth changed are refined
+    std::shared_ptr<KinectProjector> k = kinectProjector;
+    bool updated = adaptiveMesh.update(kinectProjector->getFilteredDepthPixels(), [k](float x, float y){
+        return k->kinectCoordToProjCoord(x, y);
+    });
+    if (updated){
+        const vector<ofIndexType> & indices = adaptiveMesh.getIndices();
+        adaptiveMeshVbo.setIndexData(indices.data(), indices.size(), GL_DYNAMIC_DRAW);
+        adaptiveMeshDrawCount = indices.size();
+    }
+}
+
+void SandSurfaceRenderer::drawMesh(){
+    if (useAdaptiveMesh)
+        adaptiveMeshVbo.drawElements(GL_TRIANGLES, adaptiveMeshDrawCount);
+    else
+        meshVbo.drawElements(GL_TRIANGLE_STRIP, meshDrawCount);
 }
 
 void SandSurfaceRenderer::update(){
     // Update Renderer state if needed
     if (kinectProjector->isROIUpdated())
-        setupMesh();
+        updateMeshROI();
     if (kinectProjector->isBasePlaneUpdated())
         updateRangesAndBasePlane();
     if (kinectProjector->isCalibrationUpdated())
         updateConversionMatrices();
+    if (useAdaptiveMesh && kinectProjector->isDepthFrameUpdated())
+        updateAdaptiveMesh();
+    if (kinectProjector->isDepthFrameUpdated() || kinectProjector->isROIUpdated()
+        || kinectProjector->isBasePlaneUpdated() || kinectProjector->isCalibrationUpdated())
+        setDirty();
+    if (drawContourLines && useVectorContourLines)
+        updateVectorContourLines();
+    if (kinectProjector->isDepthFrameUpdated()){ // Kept until the water and the rivers follow the sand, whatever their state
+        accumulateChangedTiles(waterChangedTiles);
+        accumulateChangedTiles(riversChangedTiles);
+    }
+    if (useWaterSimulation && kinectProjector->isImageStabilized())
+        updateWaterSimulation();
+    if (useRivers && kinectProjector->isImageStabilized())
+        updateRivers();
     
-    // Draw sandbox
-    if (drawContourLines)
+    // Draw sandbox, only when its inputs changed: the fbos keep the last rendering
+    if (drawContourLines && !useVectorContourLines && !singlePassContourLines && !useCpuRenderer && contourLinesDirty){
         prepareContourLinesFbo();
-    drawSandbox();
+        contourLinesDirty = false;
+    }
+    if (surfaceDirty){
+        drawSandbox();
+        surfaceDirty = false;
+    }
     
     // GUI
 	if (displayGui) {
@@ -226,6 +325,11 @@ void SandSurfaceRenderer::update(){
 	}
 }
 
+void SandSurfaceRenderer::setDirty(){
+    surfaceDirty = true;
+    contourLinesDirty = true;
+}
+
 void SandSurfaceRenderer::drawMainWindow(float x, float y, float width, float height){
     fboProjWindow.draw(x, y, width, height);
     
@@ -244,7 +348,168 @@ void SandSurfaceRenderer::drawProjectorWindow(){
 	fboProjWindow.draw(0,0);
 }
 
+CpuSandRenderer::Parameters SandSurfaceRenderer::getCpuRendererParameters(){
+    CpuSandRenderer::Parameters parameters;
+    parameters.kinectWorldMatrix = ofMatrix4x4::getTransposedOf(transposedKinectWorldMatrix);
+    parameters.kinectProjMatrix = ofMatrix4x4::getTransposedOf(transposedKinectProjMatrix);
+    parameters.basePlaneEq = basePlaneEq;
+    parameters.depthMin = min(FilteredDepthOffset, FilteredDepthOffset+FilteredDepthScale);
+    parameters.depthMax = max(FilteredDepthOffset, FilteredDepthOffset+FilteredDepthScale);
+    parameters.heightMapScale = heightMapScale;
+    parameters.heightMapOffset = heightMapOffset;
+    parameters.elevationMin = elevationMin;
+    parameters.elevationMax = elevationMax;
+    parameters.contourLineDistance = contourLineDistance;
+    parameters.drawContourLines = drawContourLines && !useVectorContourLines;
+    parameters.kinectROI = kinectProjector->getKinectROI();
+    return parameters;
+}
+
+ContourExtractor::Parameters SandSurfaceRenderer::getContourExtractorParameters(){
+    ContourExtractor::Parameters parameters;
+    parameters.kinectWorldMatrix = ofMatrix4x4::getTransposedOf(transposedKinectWorldMatrix);
+    parameters.basePlaneEq = basePlaneEq;
+    parameters.depthMin = min(FilteredDepthOffset, FilteredDepthOffset+FilteredDepthScale);
+    parameters.depthMax = max(FilteredDepthOffset, FilteredDepthOffset+FilteredDepthScale);
+    parameters.contourLineDistance = contourLineDistance;
+    parameters.kinectROI = kinectProjector->getKinectROI();
+    return parameters;
+}
+
+void SandSurfaceRenderer::updateVectorContourLines(bool force){
+    // Only the tiles where the depth changed are extracted again
+    bool parametersChanged = contourExtractor.setParameters(getContourExtractorParameters());
+    if (!force && !parametersChanged && !kinectProjector->isDepthFrameUpdated())
+        return;
+    const vector<unsigned char>* changedTiles = force ? NULL : &kinectProjector->getChangedDepthTiles();
+    if (contourExtractor.update(kinectProjector->getFilteredDepthPixels(), changedTiles)){
+        std::shared_ptr<KinectProjector> k = kinectProjector;
+        contourExtractor.buildLineMesh(contourLinesMesh, [k](const ofVec3f & world){
+            return k->worldCoordToProjCoord(world);
+        });
+        surfaceDirty = true;
+    }
+}
+
+void SandSurfaceRenderer::drawVectorContourLines(){
+    if (!drawContourLines || !useVectorContourLines)
+        return;
+    ofPushStyle();
+    ofSetColor(0);
+    contourLinesMesh.draw();
+    ofPopStyle();
+}
+
+void SandSurfaceRenderer::setWaterSimulation(bool suseWaterSimulation){
+    useWaterSimulation = suseWaterSimulation;
+    waterSimulation.finishUpdate();
+    if (useWaterSimulation && !waterDepthTexture.isAllocated()){
+        waterSimulation.getWaterDepthPixels(waterDepthPixels, waterDisplayDepth);
+        waterDepthTexture.allocate(waterDepthPixels);
+    }
+    waterTerrainDirty = true; // The terrain was not followed while disabled
+}
+
+void SandSurfaceRenderer::accumulateChangedTiles(vector<unsigned char> & pendingTiles){
+    const vector<unsigned char> & changedTiles = kinectProjector->getChangedDepthTiles();
+    if (pendingTiles.size() != changedTiles.size()){
+        pendingTiles.assign(changedTiles.size(), 1); // New tiling: everything changed
+        return;
+    }
+    for (int i = 0; i < changedTiles.size(); i++)
+        pendingTiles[i] |= changedTiles[i];
+}
+
+void SandSurfaceRenderer::updateWaterSimulation(){
+    // The update started by the previous frame ran while it was drawn
+    waterSimulation.finishUpdate();
+    waterSimulation.getWaterDepthPixels(waterDepthPixels, waterDisplayDepth);
+    waterDepthTexture.loadData(waterDepthPixels);
+    surfaceDirty = true;
+    
+    // The terrain follows the sand, only the tiles changed since the last copy are copied
+    if (waterTerrainDirty || kinectProjector->isBasePlaneUpdated() || kinectProjector->isROIUpdated()){
+        float cellSize = kinectProjector->kinectPixelSizeOnSand();
+        if (cellSize > 0)
+            waterSimulation.setCellSize(cellSize);
+        waterSimulation.setTerrain(kinectProjector->getElevationPixels());
+        waterTerrainDirty = false;
+        std::fill(waterChangedTiles.begin(), waterChangedTiles.end(), 0);
+    } else if (std::find(waterChangedTiles.begin(), waterChangedTiles.end(), 1) != waterChangedTiles.end()){
+        waterSimulation.setTerrain(kinectProjector->getElevationPixels(), &waterChangedTiles, kinectProjector->getDepthTileSize());
+        std::fill(waterChangedTiles.begin(), waterChangedTiles.end(), 0);
+    }
+    waterSimulation.startUpdate(min(ofGetLastFrameTime(), 1/15.0)); // Slow motion rather than big steps on slow frames
+}
+
+void SandSurfaceRenderer::addWaterSource(bool spring){
+    // Springs on the highest hill, drains in the lowest valley
+    WaterSimulation::Source source;
+    if (!waterSimulation.findTerrainExtremum(spring, source.position))
+        return;
+    source.radius = 5;
+    source.rate = spring ? 50 : -50;
+    waterSimulation.addSource(source);
+}
+
+void SandSurfaceRenderer::setRivers(bool suseRivers){
+    useRivers = suseRivers;
+    if (useRivers && !riverTexture.isAllocated()){
+        hydrology.getRiverPixels(riverPixels);
+        riverTexture.allocate(riverPixels);
+    }
+    hydrologyDirty = true; // The elevation was not followed while disabled
+}
+
+void SandSurfaceRenderer::updateRivers(){
+    // Only the tiles where the depth changed since the last update are processed again
+    bool updated = riversDirty || kinectProjector->isCalibrationUpdated(); // The lines are in projector coordinates
+    if (hydrologyDirty || kinectProjector->isBasePlaneUpdated() || kinectProjector->isROIUpdated()){
+        updated = hydrology.update(kinectProjector->getElevationPixels()) || updated;
+        hydrologyDirty = false;
+        std::fill(riversChangedTiles.begin(), riversChangedTiles.end(), 0);
+    } else if (std::find(riversChangedTiles.begin(), riversChangedTiles.end(), 1) != riversChangedTiles.end()){
+        updated = hydrology.update(kinectProjector->getElevationPixels(), &riversChangedTiles) || updated;
+        std::fill(riversChangedTiles.begin(), riversChangedTiles.end(), 0);
+    }
+    if (!updated)
+        return;
+    riversDirty = false;
+    hydrology.getRiverPixels(riverPixels);
+    riverTexture.loadData(riverPixels);
+    std::shared_ptr<KinectProjector> k = kinectProjector;
+    hydrology.buildLineMesh(riversMesh, [k](const ofVec2f & kinectPoint){
+        return k->worldCoordToProjCoord(k->kinectCoordToWorldCoord(kinectPoint.x, kinectPoint.y));
+    });
+    surfaceDirty = true;
+}
+
+void SandSurfaceRenderer::drawVectorRivers(){
+    if (!useRivers || !useVectorRivers)
+        return;
+    ofPushStyle();
+    ofSetColor(riverColor);
+    riversMesh.draw();
+    ofPopStyle();
+}
+
+void SandSurfaceRenderer::renderOnCpu(ofPixels & image){
+    cpuRenderer.setColorMap(heightMap.getPixels());
+    cpuRenderer.render(kinectProjector->getFilteredDepthPixels(), getCpuRendererParameters(), image);
+}
+
 void SandSurfaceRenderer::drawSandbox() {
+    if (useCpuRenderer){
+        renderOnCpu(cpuRenderedPixels);
+        cpuRenderedImage.setFromPixels(cpuRenderedPixels);
+        fboProjWindow.begin();
+        ofBackground(0);
+        cpuRenderedImage.draw(0, 0);
+        drawVectorRivers();
+        drawVectorContourLines();
+        fboProjWindow.end();
+        return;
+    }
     fboProjWindow.begin();
     ofBackground(0);
     kinectProjector->bind();
@@ -257,10 +522,33 @@ void SandSurfaceRenderer::drawSandbox() {
     heightMapShader.setUniformTexture("heightColorMapSampler",heightMap.getTexture(), 2);
     heightMapShader.setUniformTexture("pixelCornerElevationSampler", contourLineFramebufferObject.getTexture(), 3);
     heightMapShader.setUniform1f("contourLineFactor", contourLineFactor);
-    heightMapShader.setUniform1i("drawContourLines", drawContourLines);
-    mesh.draw();
+    int contourLinesMode = 0; // No contour lines or vector contour lines
+    if (drawContourLines && !useVectorContourLines)
+        contourLinesMode = singlePassContourLines ? 2 : 1;
+    heightMapShader.setUniform1i("drawContourLines", contourLinesMode);
+    heightMapShader.setUniform2f("contourLineTransformation", ofVec2f(1/contourLineDistance, -contourLineFboOffset/contourLineDistance));
+    heightMapShader.setUniform4f("meshROI", meshROI);
+    heightMapShader.setUniform1i("useHillshading", useHillshading);
+    heightMapShader.setUniform1i("useWater", useWaterSimulation);
+    if (useWaterSimulation){
+        heightMapShader.setUniformTexture("waterDepthSampler", waterDepthTexture, 5);
+        heightMapShader.setUniform4f("waterColor", ofFloatColor(waterColor));
+    }
+    heightMapShader.setUniform1i("useRivers", useRivers && !useVectorRivers);
+    if (useRivers && !useVectorRivers){
+        heightMapShader.setUniformTexture("riverSampler", riverTexture, 6);
+        heightMapShader.setUniform4f("riverColor", ofFloatColor(riverColor));
+    }
+    if (useHillshading){
+        heightMapShader.setUniformTexture("normalsSampler", kinectProjector->getNormalsTexture(), 4);
+        heightMapShader.setUniform3f("lightDirection", lightDirection);
+        heightMapShader.setUniform1f("hillshadingStrength", hillshadingStrength);
+    }
+    drawMesh();
     heightMapShader.end();
     kinectProjector->unbind();
+    drawVectorRivers();
+    drawVectorContourLines();
     fboProjWindow.end();
 }
 
@@ -275,7 +563,8 @@ void SandSurfaceRenderer::prepareContourLinesFbo()
     elevationShader.setUniform2f("contourLineFboTransformation",ofVec2f(contourLineFboScale,contourLineFboOffset));
     elevationShader.setUniform2f("depthTransformation",ofVec2f(FilteredDepthScale,FilteredDepthOffset));
     elevationShader.setUniform4f("basePlaneEq", basePlaneEq);
-    mesh.draw();
+    elevationShader.setUniform4f("meshROI", meshROI);
+    drawMesh();
     elevationShader.end();
     kinectProjector->unbind();
     contourLineFramebufferObject.end();
@@ -289,7 +578,19 @@ void SandSurfaceRenderer::setupGui(){
     
     // instantiate the gui //
     gui2 = new ofxDatGui( ofxDatGuiAnchor::TOP_LEFT );
+    gui2->addToggle("CPU rendering", useCpuRenderer)->setStripeColor(ofColor::green);
+    gui2->addToggle("Adaptive mesh", useAdaptiveMesh)->setStripeColor(ofColor::green);
     gui2->addToggle("Contour lines", drawContourLines)->setStripeColor(ofColor::blue);
+    gui2->addToggle("Vector contour lines", useVectorContourLines)->setStripeColor(ofColor::blue);
+    gui2->addToggle("Single pass contour lines", singlePassContourLines)->setStripeColor(ofColor::blue);
+    gui2->addToggle("Hillshading", useHillshading)->setStripeColor(ofColor::red);
+    gui2->addSlider("Hillshading strength", 0, 2, hillshadingStrength)->setStripeColor(ofColor::red);
+    gui2->addToggle("Water simulation", useWaterSimulation)->setStripeColor(ofColor::cyan);
+    gui2->addSlider("Rain (mm/min)", 0, 30, rainRate)->setName("Rain");
+    gui2->getSlider("Rain")->setStripeColor(ofColor::cyan);
+    gui2->addToggle("Rivers", useRivers)->setStripeColor(ofColor::cyan);
+    gui2->addToggle("Vector rivers", useVectorRivers)->setStripeColor(ofColor::cyan);
+    gui2->addSlider("River threshold", 50, 5000, riverThreshold)->setStripeColor(ofColor::cyan);
     gui2->addSlider("Lines distance", 1, 30, contourLineDistance)->setName("Contour lines distance");
     gui2->getSlider("Contour lines distance")->setStripeColor(ofColor::blue);
     gui2->addDropdown("Load Color Map", colorMapFilesList)->setName("Load Color Map");
@@ -301,6 +602,10 @@ void SandSurfaceRenderer::setupGui(){
     gui->addButton("Reset colors to color map file")->setName("Reset colors");
     gui->addButton("Save to color map file")->setName("Save");
     gui->addToggle("Edit color map", editColorMap)->setName("Edit");
+    gui->addButton("Export contour lines to SVG")->setName("Export contour lines");
+    gui->addButton("Add water spring on the highest hill")->setName("Add water spring");
+    gui->addButton("Add water drain in the lowest valley")->setName("Add water drain");
+    gui->addButton("Remove water, springs and drains")->setName("Clear water");
 
     gui3 = new ofxDatGui( ofxDatGuiAnchor::NO_ANCHOR );
     gui3->addSlider("Height", -300, 300, 0)->setName("Height");
@@ -368,8 +673,20 @@ void SandSurfaceRenderer::populateColorList(){
 }
 
 void SandSurfaceRenderer::onButtonEvent(ofxDatGuiButtonEvent e){
+    setDirty(); // Colors, contour lines or mesh settings may have changed
     if (e.target->is("Save")) {
         saveModal->show();
+    } else if (e.target->is("Export contour lines")) {
+        contourExtractor.setParameters(getContourExtractorParameters());
+        contourExtractor.update(kinectProjector->getFilteredDepthPixels());
+        contourExtractor.saveSvg("contourLines/contourLines-"+ofGetTimestampString()+".svg");
+    } else if (e.target->is("Add water spring")) {
+        addWaterSource(true);
+    } else if (e.target->is("Add water drain")) {
+        addWaterSource(false);
+    } else if (e.target->is("Clear water")) {
+        waterSimulation.clearSources();
+        waterSimulation.clearWater();
     } else if (e.target->is("Reset colors")) {
         heightMap.loadFile(colorMapPath+colorMapFile);
         populateColorList();
@@ -422,14 +739,39 @@ void SandSurfaceRenderer::onButtonEvent(ofxDatGuiButtonEvent e){
 }
 
 void SandSurfaceRenderer::onToggleEvent(ofxDatGuiToggleEvent e){
+    setDirty();
     if (e.target->is("Contour lines")) {
         drawContourLines = e.checked;
+        if (drawContourLines && useVectorContourLines)
+            updateVectorContourLines(true); // The lines were not followed while hidden
+    } else if (e.target->is("Vector contour lines")) {
+        useVectorContourLines = e.checked;
+        if (drawContourLines && useVectorContourLines)
+            updateVectorContourLines(true);
+    } else if (e.target->is("Single pass contour lines")) {
+        singlePassContourLines = e.checked;
+    } else if (e.target->is("Water simulation")) {
+        setWaterSimulation(e.checked);
+    } else if (e.target->is("Rivers")) {
+        setRivers(e.checked);
+    } else if (e.target->is("Vector rivers")) {
+        useVectorRivers = e.checked;
+    } else if (e.target->is("Hillshading")) {
+        useHillshading = e.checked;
+        kinectProjector->setComputeNormals(useHillshading);
+    } else if (e.target->is("CPU rendering")) {
+        useCpuRenderer = e.checked;
+    } else if (e.target->is("Adaptive mesh")) {
+        useAdaptiveMesh = e.checked;
+        if (useAdaptiveMesh)
+            updateAdaptiveMesh();
     } else if (e.target->is("Edit")) {
         editColorMap = e.checked;
     }
 }
 
 void SandSurfaceRenderer::onColorPickerEvent(ofxDatGuiColorPickerEvent e){
+    setDirty();
     if (e.target->is("ColorPicker")) {
         int i = selectedColor;
         int j = heightMap.size()-1-i;
@@ -439,9 +781,19 @@ void SandSurfaceRenderer::onColorPickerEvent(ofxDatGuiColorPickerEvent e){
 }
 
 void SandSurfaceRenderer::onSliderEvent(ofxDatGuiSliderEvent e){
+    setDirty();
     if (e.target->is("Contour lines distance")) {
         contourLineDistance = e.value;
         contourLineFactor = contourLineFboScale/contourLineDistance;        
+    } else if (e.target->is("Rain")) {
+        rainRate = e.value;
+        waterSimulation.setRain(rainRate/60);
+    } else if (e.target->is("River threshold")) {
+        riverThreshold = e.value;
+        hydrology.setRiverThreshold(riverThreshold);
+        riversDirty = true;
+    } else if (e.target->is("Hillshading strength")) {
+        hillshadingStrength = e.value;
     } else if (e.target->is("Height")) {
         int i = selectedColor;
         int j = heightMap.size()-1-i;
@@ -451,12 +803,14 @@ void SandSurfaceRenderer::onSliderEvent(ofxDatGuiSliderEvent e){
 }
 
 void SandSurfaceRenderer::onDropdownEvent(ofxDatGuiDropdownEvent e){
+    setDirty();
     colorMapFile = e.target->getLabel();
     heightMap.loadFile(colorMapPath+e.target->getLabel());
     populateColorList();
 }
 
 void SandSurfaceRenderer::onScrollViewEvent(ofxDatGuiScrollViewEvent e){
+    setDirty();
     int i = e.index;
     if (i != selectedColor){
         int j = heightMap.size()-1-i;
@@ -478,6 +832,7 @@ void SandSurfaceRenderer::onScrollViewEvent(ofxDatGuiScrollViewEvent e){
 }
 
 void SandSurfaceRenderer::onSaveModalEvent(ofxModalEvent e){
+    setDirty();
     if (e.type == ofxModalEvent::SHOWN){
         cout << "save modal window is open" << endl;
     }   else if (e.type == ofxModalEvent::HIDDEN){
@@ -509,6 +864,16 @@ bool SandSurfaceRenderer::loadSettings(){
     colorMapFile = xml.getValue<string>("colorMapFile");
     drawContourLines = xml.getValue<bool>("drawContourLines");
     contourLineDistance = xml.getValue<float>("contourLineDistance");
+    useAdaptiveMesh = xml.getValue<bool>("useAdaptiveMesh");
+    useVectorContourLines = xml.getValue<bool>("useVectorContourLines");
+    singlePassContourLines = xml.getValue<bool>("singlePassContourLines", true);
+    useHillshading = xml.getValue<bool>("useHillshading");
+    hillshadingStrength = xml.getValue<float>("hillshadingStrength", 1);
+    useWaterSimulation = xml.getValue<bool>("useWaterSimulation");
+    rainRate = xml.getValue<float>("rainRate");
+    useRivers = xml.getValue<bool>("useRivers");
+    useVectorRivers = xml.getValue<bool>("useVectorRivers");
+    riverThreshold = xml.getValue<float>("riverThreshold", 400);
     
     return true;
 }
@@ -522,6 +887,16 @@ bool SandSurfaceRenderer::saveSettings(){
     xml.addValue("colorMapFile", colorMapFile);
     xml.addValue("drawContourLines", drawContourLines);
     xml.addValue("contourLineDistance", contourLineDistance);
+    xml.addValue("useAdaptiveMesh", useAdaptiveMesh);
+    xml.addValue("useVectorContourLines", useVectorContourLines);
+    xml.addValue("singlePassContourLines", singlePassContourLines);
+    xml.addValue("useHillshading", useHillshading);
+    xml.addValue("hillshadingStrength", hillshadingStrength);
+    xml.addValue("useWaterSimulation", useWaterSimulation);
+    xml.addValue("rainRate", rainRate);
+    xml.addValue("useRivers", useRivers);
+    xml.addValue("useVectorRivers", useVectorRivers);
+    xml.addValue("riverThreshold", riverThreshold);
     xml.setToParent();
     return xml.save(settingsFile);
 }
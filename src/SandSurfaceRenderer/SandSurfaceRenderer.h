@@ -31,6 +31,11 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "../KinectProjector/KinectProjector.h"
 #include "ColorMap.h"
+#include "AdaptiveMesh.h"
+#include "CpuSandRenderer.h"
+#include "ContourExtractor.h"
+#include "WaterSimulation.h"
+#include "Hydrology.h"
 #endif /* defined(__GreatSand__SandSurfaceRenderer__) */
 
 class SaveModal : public ofxModalWindow
@@ -72,6 +77,11 @@ public:
     void update();
     void drawMainWindow(float x, float y, float width, float height);
     void drawProjectorWindow();
+    void setDirty(); // Force the sand surface and contour lines to be rendered again
+    void renderOnCpu(ofPixels & image); // Render the projector image without the shaders
+    const ContourExtractor & getContourExtractor(){ // Vector contour lines, up to date when they are drawn
+        return contourExtractor;
+    }
     
     // Gui and events functions
     void setupGui();
@@ -87,6 +97,20 @@ public:
 private:
     // Private methods
     void setupMesh();
+    void updateMeshROI();
+    void updateAdaptiveMesh();
+    void drawMesh();
+    CpuSandRenderer::Parameters getCpuRendererParameters();
+    ContourExtractor::Parameters getContourExtractorParameters();
+    void updateVectorContourLines(bool force = false);
+    void accumulateChangedTiles(vector<unsigned char> & pendingTiles); // Ors the depth tiles changed by the last frame
+    void updateWaterSimulation();
+    void setWaterSimulation(bool suseWaterSimulation);
+    void addWaterSource(bool spring);
+    void updateRivers();
+    void setRivers(bool suseRivers);
+    void drawVectorRivers();
+    void drawVectorContourLines();
     void updateConversionMatrices();
     void updateRangesAndBasePlane();
     void drawSandbox();
@@ -108,18 +132,76 @@ private:
     ofMatrix4x4                 transposedKinectProjMatrix;
     ofMatrix4x4                 transposedKinectWorldMatrix;
 
-    // Mesh
-    ofMesh mesh;
+    // Mesh: static grid covering the whole kinect image, the ROI is selected
+    // by the meshROI uniform and the number of drawn triangle strip rows
+    ofVbo meshVbo;
     int meshwidth;          //Mesh size
     int meshheight;
+    int meshRowIndices;     // Number of indices per grid row strip (degenerate triangles included)
+    int numMeshIndices;
+    int meshDrawCount;      // Number of indices drawn for the current ROI
+    ofVec4f meshROI;        // Grid offset (xy) and last vertex position (zw) in kinect image space
+    
+    // Adaptive level of detail mesh (same vertices, triangles from the quadtree)
+    bool useAdaptiveMesh;
+    AdaptiveMesh adaptiveMesh;
+    ofVbo adaptiveMeshVbo;
+    int adaptiveMeshDrawCount;
     
     // Shaders
     ofShader elevationShader;
     ofShader heightMapShader;
     
+    // CPU rendering path (used when the shaders are not available)
+    bool useCpuRenderer;
+    CpuSandRenderer cpuRenderer;
+    ofPixels cpuRenderedPixels;
+    ofImage cpuRenderedImage;
+    
+    // Vector contour lines: extracted on the CPU and drawn as a line batch
+    // instead of the contour line fbo pass
+    bool useVectorContourLines;
+    ContourExtractor contourExtractor;
+    ofVboMesh contourLinesMesh;
+    
+    // Single pass contour lines: the heightmap shader computes the contour lines from the
+    // interpolated elevation instead of the contour line fbo pass
+    bool singlePassContourLines;
+    
+    // Hillshading: the height map colors are shaded with the surface normals computed by the kinect grabber
+    bool useHillshading;
+    float hillshadingStrength;
+    ofVec3f lightDirection; // Toward the light, in kinect image space
+    
+    // Water simulation: flows over the elevation map, its depth is blended by the heightmap shader
+    bool useWaterSimulation;
+    WaterSimulation waterSimulation;
+    bool waterTerrainDirty; // The whole terrain has to be copied to the simulation
+    vector<unsigned char> waterChangedTiles; // Depth tiles changed since the terrain was last copied
+    float rainRate; // mm/min
+    float waterDisplayDepth; // Depth (mm) of fully colored water
+    ofColor waterColor;
+    ofPixels waterDepthPixels;
+    ofTexture waterDepthTexture;
+    
+    // Rivers: flow accumulation of the elevation map, blended by the heightmap shader or drawn as a line batch
+    bool useRivers;
+    bool useVectorRivers;
+    Hydrology hydrology;
+    bool hydrologyDirty; // The whole elevation map has to be processed
+    vector<unsigned char> riversChangedTiles; // Depth tiles changed since the elevation was last processed
+    bool riversDirty; // The river texture and lines have to be rebuilt
+    float riverThreshold; // Drained area (kinect pixels) of the smallest river
+    ofColor riverColor;
+    ofPixels riverPixels;
+    ofTexture riverTexture;
+    ofVboMesh riversMesh;
+    
     // FBos
     ofFbo   fboProjWindow;    
     ofFbo   contourLineFramebufferObject;
+    bool surfaceDirty; // fboProjWindow has to be rendered again
+    bool contourLinesDirty; // contourLineFramebufferObject has to be rendered again
 
     // Base plane
     ofVec3f basePlaneNormal, basePlaneNormalBack;
@@ -0,0 +1,328 @@
+/***********************************************************************
+WaterSimulation - WaterSimulation simulates water flowing over the sand
+surface with a multi-threaded shallow water (virtual pipes) model.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "WaterSimulation.h"
+#include <thread>
+#include <condition_variable>
+
+namespace {
+    const float wallHeight = 1e6; // mm, water never flows into walls
+    const int maxSubsteps = 16; // Beyond that the simulation slows down instead of becoming instable
+
+    // Outflows of a row toward the neighbours at offset, accelerated by the water surface difference
+    void accelerateFlux(const float* t, const float* w, float* flux, int offset, int width, float pipeFactor, float damping){
+        for (int x = 0; x < width; x++){
+            float newFlux = flux[x]*damping+pipeFactor*(t[x]+w[x]-t[x+offset]-w[x+offset]);
+            flux[x] = newFlux > 0 ? newFlux : 0;
+        }
+    }
+
+    // Threads wait until all of them reached the barrier
+    class Barrier {
+    public:
+        Barrier(int snumThreads):numThreads(snumThreads), numWaiting(0), generation(0){}
+        void wait(){
+            std::unique_lock<std::mutex> lock(mutex);
+            int currentGeneration = generation;
+            if (++numWaiting == numThreads){
+                numWaiting = 0;
+                generation++;
+                condition.notify_all();
+            } else {
+                condition.wait(lock, [&]{return generation != currentGeneration;});
+            }
+        }
+    private:
+        std::mutex mutex;
+        std::condition_variable condition;
+        int numThreads, numWaiting, generation;
+    };
+}
+
+WaterSimulation::WaterSimulation()
+:width(0),
+height(0),
+stride(2),
+numThreads(1),
+cellSize(1.7), // A kinect pixel at 1 m
+gravity(9810),
+fluxDamping(0.002),
+rainRate(0),
+numSubsteps(0),
+sourceRatesDirty(true)
+{
+}
+
+WaterSimulation::~WaterSimulation(){
+    finishUpdate();
+}
+
+void WaterSimulation::setup(int swidth, int sheight, int snumThreads){
+    finishUpdate();
+    width = swidth;
+    height = sheight;
+    stride = width+2;
+    numThreads = snumThreads > 0 ? snumThreads : max(1u, std::thread::hardware_concurrency());
+    int size = stride*(height+2);
+    terrain.assign(size, wallHeight);
+    water.assign(size, 0);
+    fluxLeft.assign(size, 0);
+    fluxRight.assign(size, 0);
+    fluxTop.assign(size, 0);
+    fluxBottom.assign(size, 0);
+    sourceRate.assign(size, 0);
+    sourceRatesDirty = true;
+    ofLogVerbose("WaterSimulation") << "setup(): " << width << "x" << height << " threads: " << numThreads;
+}
+
+void WaterSimulation::setTerrain(const ofFloatPixels & sterrain, const vector<unsigned char>* changedTiles, int tileSize){
+    finishUpdate();
+    int tilesCols = (width+tileSize-1)/tileSize;
+    const float* terrainPtr = sterrain.getData();
+    for (int y = 0; y < height; y++){
+        for (int x = 0; x < width; x++){
+            if (changedTiles != NULL && !(*changedTiles)[(y/tileSize)*tilesCols+x/tileSize])
+                continue;
+            float h = terrainPtr[y*width+x];
+            int i = (y+1)*stride+x+1;
+            if (std::isnan(h)){
+                terrain[i] = wallHeight;
+                water[i] = 0;
+            } else {
+                terrain[i] = h;
+            }
+        }
+    }
+    sourceRatesDirty = true; // Walls may have moved
+}
+
+void WaterSimulation::setRain(float srainRate){
+    finishUpdate();
+    rainRate = srainRate;
+    sourceRatesDirty = true;
+}
+
+void WaterSimulation::addSource(const Source & source){
+    finishUpdate();
+    sources.push_back(source);
+    sourceRatesDirty = true;
+}
+
+void WaterSimulation::clearSources(){
+    finishUpdate();
+    sources.clear();
+    sourceRatesDirty = true;
+}
+
+void WaterSimulation::clearWater(){
+    finishUpdate();
+    std::fill(water.begin(), water.end(), 0);
+    std::fill(fluxLeft.begin(), fluxLeft.end(), 0);
+    std::fill(fluxRight.begin(), fluxRight.end(), 0);
+    std::fill(fluxTop.begin(), fluxTop.end(), 0);
+    std::fill(fluxBottom.begin(), fluxBottom.end(), 0);
+}
+
+bool WaterSimulation::findTerrainExtremum(bool highest, ofVec2f & location) const{
+    bool found = false;
+    float extremum = 0;
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++){
+            float h = terrain[(y+1)*stride+x+1];
+            if (h >= wallHeight)
+                continue;
+            if (!found || (highest ? h > extremum : h < extremum)){
+                extremum = h;
+                location = ofVec2f(x, y);
+                found = true;
+            }
+        }
+    return found;
+}
+
+void WaterSimulation::updateSourceRates(){
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++){
+            int i = (y+1)*stride+x+1;
+            sourceRate[i] = terrain[i] < wallHeight ? rainRate : 0;
+        }
+    for (auto & source : sources){
+        int minX = max(0, static_cast<int>(floor(source.position.x-source.radius)));
+        int maxX = min(width-1, static_cast<int>(ceil(source.position.x+source.radius)));
+        int minY = max(0, static_cast<int>(floor(source.position.y-source.radius)));
+        int maxY = min(height-1, static_cast<int>(ceil(source.position.y+source.radius)));
+        for (int y = minY; y <= maxY; y++)
+            for (int x = minX; x <= maxX; x++){
+                int i = (y+1)*stride+x+1;
+                if (terrain[i] < wallHeight && ofVec2f(x, y).squareDistance(source.position) <= source.radius*source.radius)
+                    sourceRate[i] += source.rate;
+            }
+    }
+    sourceRatesDirty = false;
+}
+
+void WaterSimulation::runInBands(std::function<void(int, int)> work){
+    // Each thread processes a band of rows
+    int numBands = min(numThreads, height);
+    vector<std::thread> workers;
+    for (int i = 1; i < numBands; i++)
+        workers.push_back(std::thread(work, i*height/numBands, (i+1)*height/numBands));
+    work(0, height/numBands);
+    for (auto & worker : workers)
+        worker.join();
+}
+
+void WaterSimulation::startUpdate(float dt){
+    finishUpdate();
+    if (width == 0 || dt <= 0)
+        return;
+    updateThread = std::thread(&WaterSimulation::runUpdate, this, dt);
+}
+
+void WaterSimulation::finishUpdate(){
+    if (updateThread.joinable())
+        updateThread.join();
+}
+
+void WaterSimulation::runUpdate(float dt){
+    if (sourceRatesDirty)
+        updateSourceRates();
+
+    // Gravity waves must not cross more than half a cell per substep
+    float maxDepth = max(1.0f, *std::max_element(water.begin(), water.end()));
+    float stableStep = 0.5f*cellSize/sqrt(gravity*maxDepth);
+    numSubsteps = min(maxSubsteps, max(1, static_cast<int>(ceil(dt/stableStep))));
+    float step = min(dt/numSubsteps, stableStep);
+
+    Barrier barrier(min(numThreads, height));
+    runInBands([&](int startRow, int endRow){
+        for (int s = 0; s < numSubsteps; s++){
+            computeFluxes(startRow, endRow, step);
+            barrier.wait(); // moveWater reads the fluxes of the neighbouring bands
+            moveWater(startRow, endRow, step);
+            barrier.wait();
+        }
+    });
+}
+
+void WaterSimulation::computeFluxes(int startRow, int endRow, float dt){
+    float pipeFactor = dt*gravity*cellSize; // Pipe section cellSize^2 over pipe length cellSize
+    float cellArea = cellSize*cellSize;
+    float damping = 1-fluxDamping;
+    for (int y = startRow; y < endRow; y++){
+        int rowStart = (y+1)*stride+1;
+        const float* t = &terrain[rowStart];
+        const float* w = &water[rowStart];
+        float* fl = &fluxLeft[rowStart];
+        float* fr = &fluxRight[rowStart];
+        float* ft = &fluxTop[rowStart];
+        float* fb = &fluxBottom[rowStart];
+        // One pass per pipe: the loops stay simple enough to be vectorized
+        accelerateFlux(t, w, fl, -1, width, pipeFactor, damping);
+        accelerateFlux(t, w, fr, 1, width, pipeFactor, damping);
+        accelerateFlux(t, w, ft, -stride, width, pipeFactor, damping);
+        accelerateFlux(t, w, fb, stride, width, pipeFactor, damping);
+        // A cell cannot give more water than it holds
+        for (int x = 0; x < width; x++){
+            float total = (fl[x]+fr[x]+ft[x]+fb[x])*dt+1e-12f;
+            float scale = min(total, w[x]*cellArea)/total;
+            fl[x] *= scale;
+            fr[x] *= scale;
+            ft[x] *= scale;
+            fb[x] *= scale;
+        }
+    }
+}
+
+void WaterSimulation::moveWater(int startRow, int endRow, float dt){
+    float volumeToDepth = dt/(cellSize*cellSize);
+    for (int y = startRow; y < endRow; y++){
+        int rowStart = (y+1)*stride+1;
+        float* w = &water[rowStart];
+        const float* source = &sourceRate[rowStart];
+        const float* fl = &fluxLeft[rowStart];
+        const float* fr = &fluxRight[rowStart];
+        const float* ft = &fluxTop[rowStart];
+        const float* fb = &fluxBottom[rowStart];
+        for (int x = 0; x < width; x++){
+            float inflow = fr[x-1]+fl[x+1]+fb[x-stride]+ft[x+stride];
+            float outflow = fl[x]+fr[x]+ft[x]+fb[x];
+            w[x] = max(0.0f, w[x]+(inflow-outflow)*volumeToDepth+source[x]*dt);
+        }
+    }
+}
+
+float WaterSimulation::getWaterVolume() const{
+    double volume = 0;
+    for (auto depth : water)
+        volume += depth;
+    return volume*cellSize*cellSize/1e6;
+}
+
+void WaterSimulation::getWaterDepthPixels(ofPixels & pixels, float maxDepth) const{
+    if (pixels.getWidth() != width || pixels.getHeight() != height || pixels.getNumChannels() != 1)
+        pixels.allocate(width, height, 1);
+    unsigned char* pixelsPtr = pixels.getData();
+    float scale = 255/maxDepth;
+    for (int y = 0; y < height; y++){
+        const float* w = &water[(y+1)*stride+1];
+        for (int x = 0; x < width; x++, pixelsPtr++)
+            *pixelsPtr = static_cast<unsigned char>(min(255.0f, w[x]*scale+0.5f));
+    }
+}
+
+WaterSimulation::BenchmarkResult WaterSimulation::benchmark(int width, int height, int numFrames, int numThreads){
+    // Same hills as the golden image check, seen from 1 m
+    ofFloatPixels hills;
+    hills.allocate(width, height, 1);
+    float* hillsPtr = hills.getData();
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++, hillsPtr++)
+            *hillsPtr = 80*sin(x/45.0f)*cos(y/60.0f)+40*sin((x+y)/23.0f)-30;
+
+    WaterSimulation simulation;
+    simulation.setup(width, height, numThreads);
+    simulation.setTerrain(hills);
+    simulation.setRain(0.5);
+    Source spring = {ofVec2f(), 5, 50};
+    Source drain = {ofVec2f(), 5, -50};
+    simulation.findTerrainExtremum(true, spring.position);
+    simulation.findTerrainExtremum(false, drain.position);
+    simulation.addSource(spring);
+    simulation.addSource(drain);
+
+    BenchmarkResult result;
+    int totalSubsteps = 0;
+    uint64_t start = ofGetElapsedTimeMicros();
+    for (int i = 0; i < numFrames; i++){
+        simulation.update(1/30.0f);
+        totalSubsteps += simulation.getNumSubsteps();
+    }
+    result.frameTime = (ofGetElapsedTimeMicros()-start)/1000.0f/numFrames;
+    result.numSubsteps = totalSubsteps/numFrames;
+    result.waterVolume = simulation.getWaterVolume();
+    result.realTime = result.frameTime <= 1000/30.0f;
+    ofLogNotice("WaterSimulation") << "benchmark(): " << width << "x" << height << " " << simulation.numThreads << " threads: "
+        << result.frameTime << " ms per frame, " << result.numSubsteps << " substeps, water volume: " << result.waterVolume << " l, "
+        << (result.realTime ? "real time" : "SLOWER THAN 30 Hz");
+    return result;
+}
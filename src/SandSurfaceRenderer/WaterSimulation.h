@@ -0,0 +1,119 @@
+/***********************************************************************
+WaterSimulation - WaterSimulation simulates water flowing over the sand
+surface with a multi-threaded shallow water (virtual pipes) model.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include <thread>
+
+// Each cell (one kinect pixel) holds a water depth and the outflows of the
+// four virtual pipes to its neighbours. A step accelerates the outflows with
+// the water surface height differences, scales them so that a cell never
+// gives more water than it holds, then moves the water. The grid has a one
+// cell wall border and cells outside of the sandbox are walls, so the
+// stencils run without bounds checks on contiguous rows, one pass per pipe
+// direction so that the compiler vectorizes them.
+// The rows are split in bands, one per thread, synchronised between passes.
+// An update can run in the background while the frame is drawn: the
+// functions that change the simulation wait for it, the water must only be
+// read after finishUpdate.
+class WaterSimulation {
+public:
+    struct Source {
+        ofVec2f position; // Kinect image coordinates
+        float radius; // In cells
+        float rate; // Water height added per second (mm/s), negative for a drain
+    };
+
+    struct BenchmarkResult {
+        float frameTime; // ms to simulate 1/30 s, mean over the frames
+        int numSubsteps; // Per frame
+        float waterVolume; // Final water volume in liters
+        bool realTime; // frameTime fits in a 30 Hz frame
+    };
+
+    WaterSimulation();
+    ~WaterSimulation();
+
+    void setup(int width, int height, int numThreads = 0);
+    // Height of the sand (mm), NaN for walls. Only the changed tiles (one byte per tileSize
+    // tile, NULL: everything changed) are copied.
+    void setTerrain(const ofFloatPixels & terrain, const vector<unsigned char>* changedTiles = NULL, int tileSize = 32);
+    void setCellSize(float scellSize){ // Width of a cell in mm
+        finishUpdate();
+        cellSize = scellSize;
+    }
+    void setRain(float srainRate); // mm/s over the whole sandbox
+    void addSource(const Source & source);
+    void clearSources();
+    const vector<Source> & getSources() const {
+        return sources;
+    }
+    void clearWater();
+    bool findTerrainExtremum(bool highest, ofVec2f & location) const; // Highest or lowest sand cell
+
+    void startUpdate(float dt); // Seconds, split in stable substeps
+    void finishUpdate(); // Waits for the update
+    void update(float dt){
+        startUpdate(dt);
+        finishUpdate();
+    }
+
+    float getWaterDepth(int x, int y) const {
+        return water[(y+1)*stride+x+1];
+    }
+    float getWaterVolume() const; // Liters
+    int getNumSubsteps() const {
+        return numSubsteps;
+    }
+    // 8 bits water depth image, 255 for maxDepth mm or more
+    void getWaterDepthPixels(ofPixels & pixels, float maxDepth) const;
+
+    // Rain, a spring on the highest hill and a drain in the lowest valley of a
+    // synthetic hills terrain, simulated at 30 Hz
+    static BenchmarkResult benchmark(int width = 640, int height = 480, int numFrames = 90, int numThreads = 0);
+
+private:
+    void runUpdate(float dt);
+    void computeFluxes(int startRow, int endRow, float dt);
+    void moveWater(int startRow, int endRow, float dt);
+    void updateSourceRates();
+    void runInBands(std::function<void(int, int)> work);
+
+    int width, height;
+    int stride; // Row length with the wall border
+    int numThreads;
+    std::thread updateThread;
+
+    float cellSize;
+    float gravity; // mm/s^2
+    float fluxDamping; // Fraction of the outflows lost at each step
+    float rainRate;
+    int numSubsteps;
+
+    // Padded grids, (width+2)*(height+2)
+    vector<float> terrain; // Walls are very high
+    vector<float> water;
+    vector<float> fluxLeft, fluxRight, fluxTop, fluxBottom; // Outflows (mm^3/s)
+    vector<float> sourceRate; // Rain, sources and drains (mm/s)
+    vector<Source> sources;
+    bool sourceRatesDirty;
+};
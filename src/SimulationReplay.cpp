@@ -0,0 +1,364 @@
+/***********************************************************************
+SimulationReplay - SimulationReplay records what the fish school depends
+on and replays it to check that the trajectories are bit-identical.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "SimulationReplay.h"
+
+SimulationReplay::SimulationReplay()
+:recording(false),
+seed(0),
+width(0),
+height(0),
+tileSize(32),
+numFrames(0),
+stepsPending(false)
+{
+}
+
+void SimulationReplay::startRecording(uint64_t sseed, int swidth, int sheight, int stileSize, ofRectangle sborders){
+    seed = sseed;
+    width = swidth;
+    height = sheight;
+    tileSize = stileSize;
+    borders = sborders;
+    recordedElevation.allocate(width, height, 1);
+    recordedElevation.set(0, std::numeric_limits<float>::quiet_NaN()); // As a new elevation: all of it is recorded
+    events.clear();
+    numFrames = 0;
+    stepsPending = false;
+    recording = true;
+    ofLogVerbose("SimulationReplay") << "startRecording(): seed " << seed;
+}
+
+bool SimulationReplay::stopRecording(string path){
+    if (!recording)
+        return false;
+    recording = false;
+    // Magic, header, seed, borders, then the events: type, number of ints, number of floats, ints, floats
+    vector<char> data;
+    auto append = [&](const void* values, size_t size){
+        const char* bytes = static_cast<const char*>(values);
+        data.insert(data.end(), bytes, bytes+size);
+    };
+    append("MSSR", 4);
+    int32_t header[4] = {width, height, tileSize, static_cast<int32_t>(events.size())};
+    append(header, sizeof(header));
+    append(&seed, sizeof(seed));
+    float bordersValues[4] = {borders.x, borders.y, borders.width, borders.height};
+    append(bordersValues, sizeof(bordersValues));
+    for (auto & event : events){
+        int32_t eventHeader[3] = {event.type, static_cast<int32_t>(event.ints.size()), static_cast<int32_t>(event.floats.size())};
+        append(eventHeader, sizeof(eventHeader));
+        append(event.ints.data(), event.ints.size()*sizeof(int32_t));
+        append(event.floats.data(), event.floats.size()*sizeof(float));
+    }
+    events.clear();
+    ofBuffer buffer(data.data(), data.size());
+    bool saved = ofBufferToFile(path, buffer, true);
+    ofLogVerbose("SimulationReplay") << "stopRecording(): " << numFrames << " frames " << (saved ? "saved" : "could not be saved") << " to " << path;
+    return saved;
+}
+
+void SimulationReplay::addEvent(EventType type, vector<int32_t> ints, vector<float> floats){
+    Event event;
+    event.type = type;
+    event.ints = std::move(ints);
+    event.floats = std::move(floats);
+    events.push_back(std::move(event));
+}
+
+bool SimulationReplay::hasValidSizes(const Event & event){
+    // Number of ints and floats of each event type, -1: any
+    int numInts = 0, numFloats = 0;
+    switch (event.type){
+        case ELEVATION: numInts = -1; numFloats = -1; break;
+        case BORDERS: numFloats = 4; break;
+        case NAVIGATION_UPDATE: return event.ints.size() >= 1 && event.floats.empty();
+        case SET_TARGET: numInts = 1; numFloats = 3; break;
+        case CLEAR_TARGET: break;
+        case MOTHER_LOCATION: numFloats = 2; break;
+        case ADD: numFloats = 2; break;
+        case POP_BACK: break;
+        case CLEAR: break;
+        case STEPS: numInts = 2; break;
+        case STATE_HASH: numInts = 2; break;
+        default: return false; // Unknown type
+    }
+    return (numInts == -1 || event.ints.size() == numInts) && (numFloats == -1 || event.floats.size() == numFloats);
+}
+
+ofRectangle SimulationReplay::getTileRect(int tile, int width, int height, int tileSize){
+    int tilesCols = (width+tileSize-1)/tileSize;
+    int x0 = (tile%tilesCols)*tileSize;
+    int y0 = (tile/tilesCols)*tileSize;
+    return ofRectangle(x0, y0, min(tileSize, width-x0), min(tileSize, height-y0));
+}
+
+void SimulationReplay::recordElevation(const ofFloatPixels & elevation){
+    if (elevation.getWidth() != width || elevation.getHeight() != height)
+        return;
+    // Compared bit by bit: NaN outside of the sandbox
+    vector<int32_t> tiles;
+    vector<float> values;
+    int numTiles = ((width+tileSize-1)/tileSize)*((height+tileSize-1)/tileSize);
+    for (int tile = 0; tile < numTiles; tile++){
+        ofRectangle rect = getTileRect(tile, width, height, tileSize);
+        bool changed = false;
+        for (int y = rect.y; y < rect.getBottom() && !changed; y++){
+            int offset = y*width+rect.x;
+            changed = memcmp(elevation.getData()+offset, recordedElevation.getData()+offset, rect.width*sizeof(float)) != 0;
+        }
+        if (!changed)
+            continue;
+        tiles.push_back(tile);
+        for (int y = rect.y; y < rect.getBottom(); y++){
+            int offset = y*width+rect.x;
+            values.insert(values.end(), elevation.getData()+offset, elevation.getData()+offset+static_cast<int>(rect.width));
+            memcpy(recordedElevation.getData()+offset, elevation.getData()+offset, rect.width*sizeof(float));
+        }
+    }
+    if (!tiles.empty())
+        addEvent(ELEVATION, std::move(tiles), std::move(values));
+}
+
+void SimulationReplay::recordBorders(ofRectangle sborders){
+    if (recording)
+        addEvent(BORDERS, vector<int32_t>(), {sborders.x, sborders.y, sborders.width, sborders.height});
+}
+
+void SimulationReplay::recordNavigationUpdate(const ofFloatPixels & elevation, const vector<unsigned char>* changedTiles){
+    if (!recording)
+        return;
+    recordElevation(elevation);
+    vector<int32_t> ints(1, changedTiles == NULL);
+    if (changedTiles != NULL)
+        for (int tile = 0; tile < changedTiles->size(); tile++)
+            if ((*changedTiles)[tile])
+                ints.push_back(tile);
+    addEvent(NAVIGATION_UPDATE, std::move(ints));
+}
+
+void SimulationReplay::recordTarget(ofVec2f target, bool throughWater, float radius){
+    if (recording)
+        addEvent(SET_TARGET, {throughWater}, {target.x, target.y, radius});
+}
+
+void SimulationReplay::recordClearTarget(){
+    if (recording)
+        addEvent(CLEAR_TARGET);
+}
+
+void SimulationReplay::recordMotherLocation(ofVec2f location){
+    if (recording)
+        addEvent(MOTHER_LOCATION, vector<int32_t>(), {location.x, location.y});
+}
+
+void SimulationReplay::recordAdd(ofVec2f location){
+    if (recording)
+        addEvent(ADD, vector<int32_t>(), {location.x, location.y});
+}
+
+void SimulationReplay::recordPopBack(){
+    if (recording)
+        addEvent(POP_BACK);
+}
+
+void SimulationReplay::recordClear(){
+    if (recording)
+        addEvent(CLEAR);
+}
+
+void SimulationReplay::recordSteps(const ofFloatPixels & elevation, int numSteps, bool seekMother){
+    if (!recording)
+        return;
+    recordElevation(elevation);
+    addEvent(STEPS, {numSteps, seekMother});
+    numFrames++;
+    stepsPending = true;
+}
+
+void SimulationReplay::recordStateHash(uint64_t hash){
+    if (!recording || !stepsPending)
+        return;
+    addEvent(STATE_HASH, {static_cast<int32_t>(hash >> 32), static_cast<int32_t>(hash & 0xFFFFFFFF)});
+    stepsPending = false;
+}
+
+SimulationReplay::Result SimulationReplay::replay(string path, int numThreads){
+    Result result = {false, false, 0, 0, -1, 0};
+    ofBuffer buffer = ofBufferFromFile(path, true);
+    const char* ptr = buffer.getData();
+    const char* end = ptr+buffer.size();
+    auto read = [&](void* values, size_t size){
+        if (end-ptr < size)
+            return false;
+        if (size > 0) // Events without ints or floats
+            memcpy(values, ptr, size);
+        ptr += size;
+        return true;
+    };
+    char magic[4];
+    int32_t header[4];
+    uint64_t seed;
+    float bordersValues[4];
+    if (!read(magic, 4) || strncmp(magic, "MSSR", 4) != 0 || !read(header, sizeof(header)) || !read(&seed, sizeof(seed)) || !read(bordersValues, sizeof(bordersValues))){
+        ofLogError("SimulationReplay") << "replay(): " << path << " is not a simulation recording";
+        return result;
+    }
+    int width = header[0];
+    int height = header[1];
+    int tileSize = header[2];
+    int numEvents = header[3];
+    if (width <= 0 || height <= 0 || width > 4096 || height > 4096 || tileSize <= 0 || tileSize > 4096 || numEvents < 0){
+        ofLogError("SimulationReplay") << "replay(): " << path << ": invalid header";
+        return result;
+    }
+    int numTiles = ((width+tileSize-1)/tileSize)*((height+tileSize-1)/tileSize);
+
+    // Same setup as the app, from scratch
+    ofFloatPixels elevation;
+    elevation.allocate(width, height, 1);
+    elevation.set(0, std::numeric_limits<float>::quiet_NaN());
+    ShoreDistanceField shore;
+    shore.setup(width, height, numThreads);
+    NavigationField navigation;
+    navigation.setup(width, height);
+    FishSchool fish;
+    fish.setup(width, height, ofRectangle(bordersValues[0], bordersValues[1], bordersValues[2], bordersValues[3]), numThreads);
+    fish.setSeed(seed);
+    fish.setNavigationField(&navigation);
+    bool shoreDirty = true;
+    vector<unsigned char> changedTiles(numTiles);
+    uint64_t stepMicros = 0;
+
+    // The replay stops at the first event that does not fit the recording
+    Event event;
+    auto invalid = [&](int e){
+        ofLogError("SimulationReplay") << "replay(): " << path << ": invalid event " << e << " of type " << event.type;
+        return result;
+    };
+    for (int e = 0; e < numEvents; e++){
+        int32_t eventHeader[3];
+        if (!read(eventHeader, sizeof(eventHeader)) || eventHeader[1] < 0 || eventHeader[2] < 0
+            || eventHeader[1] > (end-ptr)/sizeof(int32_t) || eventHeader[2] > (end-ptr)/sizeof(float)){
+            ofLogError("SimulationReplay") << "replay(): " << path << " is truncated";
+            return result;
+        }
+        event.type = eventHeader[0];
+        event.ints.resize(eventHeader[1]);
+        event.floats.resize(eventHeader[2]);
+        if (!read(event.ints.data(), event.ints.size()*sizeof(int32_t)) || !read(event.floats.data(), event.floats.size()*sizeof(float))){
+            ofLogError("SimulationReplay") << "replay(): " << path << " is truncated";
+            return result;
+        }
+        const vector<int32_t> & ints = event.ints;
+        const vector<float> & floats = event.floats;
+        if (!hasValidSizes(event))
+            return invalid(e);
+        switch (event.type){
+            case ELEVATION: {
+                // Every tile is inside the map and the values are exactly the rows of the tiles
+                size_t numValues = 0;
+                for (int tile : ints){
+                    if (tile < 0 || tile >= numTiles)
+                        return invalid(e);
+                    ofRectangle rect = getTileRect(tile, width, height, tileSize);
+                    numValues += static_cast<size_t>(rect.width)*static_cast<size_t>(rect.height);
+                }
+                if (numValues != floats.size())
+                    return invalid(e);
+                const float* valuesPtr = floats.data();
+                for (int tile : ints){
+                    ofRectangle rect = getTileRect(tile, width, height, tileSize);
+                    for (int y = rect.y; y < rect.getBottom(); y++, valuesPtr += static_cast<int>(rect.width))
+                        memcpy(elevation.getData()+y*width+static_cast<int>(rect.x), valuesPtr, rect.width*sizeof(float));
+                }
+                shoreDirty = true;
+                break;
+            }
+            case BORDERS:
+                fish.setBorders(ofRectangle(floats[0], floats[1], floats[2], floats[3]));
+                break;
+            case NAVIGATION_UPDATE:
+                std::fill(changedTiles.begin(), changedTiles.end(), 0);
+                for (int k = 1; k < ints.size(); k++){
+                    if (ints[k] < 0 || ints[k] >= numTiles)
+                        return invalid(e);
+                    changedTiles[ints[k]] = 1;
+                }
+                navigation.update(elevation, ints[0] ? NULL : &changedTiles, tileSize);
+                break;
+            case SET_TARGET:
+                navigation.setTarget(ofVec2f(floats[0], floats[1]), ints[0] != 0, floats[2]);
+                break;
+            case CLEAR_TARGET:
+                navigation.clearTarget();
+                break;
+            case MOTHER_LOCATION:
+                fish.setMotherLocation(ofVec2f(floats[0], floats[1]));
+                break;
+            case ADD:
+                fish.add(ofVec2f(floats[0], floats[1]));
+                break;
+            case POP_BACK:
+                if (fish.empty())
+                    return invalid(e);
+                fish.pop_back();
+                break;
+            case CLEAR:
+                fish.clear();
+                break;
+            case STEPS: {
+                if (ints[0] < 0)
+                    return invalid(e);
+                if (shoreDirty){
+                    shore.update(elevation);
+                    shoreDirty = false;
+                }
+                uint64_t start = ofGetElapsedTimeMicros();
+                for (int i = 0; i < ints[0]; i++)
+                    fish.step(shore, ints[1] != 0);
+                stepMicros += ofGetElapsedTimeMicros()-start;
+                result.numSteps += ints[0];
+                result.numFrames++;
+                break;
+            }
+            case STATE_HASH: {
+                uint64_t hash = (static_cast<uint64_t>(static_cast<uint32_t>(ints[0])) << 32) | static_cast<uint32_t>(ints[1]);
+                if (result.firstMismatch == -1 && fish.getStateHash() != hash)
+                    result.firstMismatch = result.numFrames-1;
+                break;
+            }
+        }
+    }
+    if (ptr != end){
+        ofLogError("SimulationReplay") << "replay(): " << path << ": unexpected data after the last event";
+        return result;
+    }
+
+    result.loaded = true;
+    result.identical = result.firstMismatch == -1;
+    result.stepTime = result.numSteps > 0 ? stepMicros/1000.0f/result.numSteps : 0;
+    ofLogNotice("SimulationReplay") << "replay(): " << path << ": " << result.numFrames << " frames, " << result.numSteps << " steps of "
+        << fish.size() << " fish, " << result.stepTime << " ms per step, "
+        << (result.identical ? "identical trajectories" : "TRAJECTORIES DIFFER from frame "+ofToString(result.firstMismatch));
+    return result;
+}
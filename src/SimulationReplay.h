@@ -0,0 +1,104 @@
+/***********************************************************************
+SimulationReplay - SimulationReplay records what the fish school depends
+on and replays it to check that the trajectories are bit-identical.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include "FishSchool.h"
+#include "NavigationField.h"
+
+// A recording is the ordered log of the calls the app makes on the fish
+// school and on its navigation field, with the elevation tiles that changed
+// before each update, and the hash of the fish state after each frame of
+// steps. A replay makes the same calls on a new school (no kinect needed),
+// compares the hashes and times the steps: an optimisation of the fish code
+// is checked against the recorded reference on the same input.
+// The record functions do nothing when no recording is running.
+class SimulationReplay {
+public:
+    struct Result {
+        bool loaded;
+        bool identical; // Every state hash matched the recording
+        int numFrames; // Frames of steps
+        int numSteps;
+        int firstMismatch; // Frame, -1 if none
+        float stepTime; // ms per step, mean
+    };
+
+    SimulationReplay();
+
+    // seed: seed of the fish school, width, height: kinect image size
+    void startRecording(uint64_t seed, int width, int height, int tileSize, ofRectangle borders);
+    bool stopRecording(string path); // Saves the recording
+    bool isRecording() const {
+        return recording;
+    }
+    int getNumRecordedFrames() const {
+        return numFrames;
+    }
+
+    void recordBorders(ofRectangle borders);
+    void recordNavigationUpdate(const ofFloatPixels & elevation, const vector<unsigned char>* changedTiles); // NULL: full update
+    void recordTarget(ofVec2f target, bool throughWater, float radius);
+    void recordClearTarget();
+    void recordMotherLocation(ofVec2f location);
+    void recordAdd(ofVec2f location);
+    void recordPopBack();
+    void recordClear();
+    void recordSteps(const ofFloatPixels & elevation, int numSteps, bool seekMother);
+    void recordStateHash(uint64_t hash); // After the steps
+
+    static Result replay(string path, int numThreads = 0); // Stops with an error at the first invalid event
+
+private:
+    enum EventType {
+        ELEVATION, // ints: tiles, floats: their elevation, row by row
+        BORDERS,
+        NAVIGATION_UPDATE, // ints: full update, changed tiles
+        SET_TARGET,
+        CLEAR_TARGET,
+        MOTHER_LOCATION,
+        ADD,
+        POP_BACK,
+        CLEAR,
+        STEPS,
+        STATE_HASH
+    };
+    struct Event {
+        int32_t type;
+        vector<int32_t> ints;
+        vector<float> floats;
+    };
+
+    void addEvent(EventType type, vector<int32_t> ints = vector<int32_t>(), vector<float> floats = vector<float>());
+    void recordElevation(const ofFloatPixels & elevation); // The tiles that differ from the last recorded elevation
+    static bool hasValidSizes(const Event & event); // Numbers of ints and floats of its type
+    static ofRectangle getTileRect(int tile, int width, int height, int tileSize);
+
+    bool recording;
+    uint64_t seed;
+    int width, height, tileSize;
+    ofRectangle borders; // At the start
+    ofFloatPixels recordedElevation;
+    vector<Event> events;
+    int numFrames;
+    bool stepsPending; // Waiting for the state hash
+};
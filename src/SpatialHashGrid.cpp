@@ -0,0 +1,61 @@
+/***********************************************************************
+SpatialHashGrid - SpatialHashGrid buckets points of the kinect image in
+a uniform grid to answer neighbourhood queries in constant time.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "SpatialHashGrid.h"
+
+SpatialHashGrid::SpatialHashGrid()
+:cellSize(1),
+cols(0),
+rows(0)
+{
+}
+
+void SpatialHashGrid::setup(float width, float height, float scellSize){
+    cellSize = scellSize;
+    cols = max(1, static_cast<int>(ceil(width/cellSize)));
+    rows = max(1, static_cast<int>(ceil(height/cellSize)));
+    cellStart.assign(cols*rows+1, 0);
+    sortedIndices.clear();
+    ofLogVerbose("SpatialHashGrid") << "setup(): " << cols << "x" << rows << " cells of " << cellSize;
+}
+
+void SpatialHashGrid::build(const vector<float> & x, const vector<float> & y){
+    int n = x.size();
+    pointCells.resize(n);
+    sortedIndices.resize(n);
+    std::fill(cellStart.begin(), cellStart.end(), 0);
+    // Counting sort: points per cell, first index of each cell, then placement
+    for (int i = 0; i < n; i++){
+        pointCells[i] = cellRow(y[i])*cols+cellCol(x[i]);
+        cellStart[pointCells[i]+1]++;
+    }
+    for (int cell = 0; cell < cols*rows; cell++)
+        cellStart[cell+1] += cellStart[cell];
+    vector<int> next(cellStart.begin(), cellStart.end()-1);
+    for (int i = 0; i < n; i++)
+        sortedIndices[next[pointCells[i]]++] = i;
+}
+
+void SpatialHashGrid::clear(){
+    std::fill(cellStart.begin(), cellStart.end(), 0);
+    sortedIndices.clear();
+}
@@ -0,0 +1,67 @@
+/***********************************************************************
+SpatialHashGrid - SpatialHashGrid buckets points of the kinect image in
+a uniform grid to answer neighbourhood queries in constant time.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+// The grid covers the kinect image (the points outside go to the border
+// cells) and is rebuilt from scratch in linear time by a counting sort of
+// the points by cell: the points of a cell are contiguous, so a query only
+// reads the few cells around it.
+class SpatialHashGrid {
+public:
+    SpatialHashGrid();
+
+    void setup(float width, float height, float cellSize);
+    void build(const vector<float> & x, const vector<float> & y);
+    void clear(); // No points until the next build
+
+    // Calls visit(index) for every point of the cells overlapping the square of half side radius
+    // around (px, py): the caller checks the actual distance
+    template<class Visitor>
+    void forEachCandidate(float px, float py, float radius, Visitor visit) const {
+        if (cols == 0)
+            return;
+        int minCol = cellCol(px-radius);
+        int maxCol = cellCol(px+radius);
+        int minRow = cellRow(py-radius);
+        int maxRow = cellRow(py+radius);
+        for (int row = minRow; row <= maxRow; row++)
+            for (int cell = row*cols+minCol; cell <= row*cols+maxCol; cell++)
+                for (int k = cellStart[cell]; k < cellStart[cell+1]; k++)
+                    visit(sortedIndices[k]);
+    }
+
+private:
+    int cellCol(float x) const {
+        return ofClamp(static_cast<int>(x/cellSize), 0, cols-1);
+    }
+    int cellRow(float y) const {
+        return ofClamp(static_cast<int>(y/cellSize), 0, rows-1);
+    }
+
+    float cellSize;
+    int cols, rows;
+    vector<int> pointCells;
+    vector<int> cellStart; // First sorted point of each cell, cols*rows+1 entries
+    vector<int> sortedIndices;
+};
@@ -42,10 +42,33 @@ void ofApp::setup() {
 	projRes = ofVec2f(projWindow->getWidth(), projWindow->getHeight());
 	kinectROI = kinectProjector->getKinectROI();
 	
+	// Lakes on the kinect grid, following the tiles of the depth change detection
+	lakeDetector.setup(kinectRes.x, kinectRes.y, kinectProjector->getDepthTileSize());
+	float cellSize = kinectProjector->kinectPixelSizeOnSand(); // From the calibration, updated with the base plane and the ROI
+	if (cellSize > 0)
+		lakeDetector.setCellSize(cellSize);
+	minFishLakeArea = 400;
+	fishNavigation.setup(kinectRes.x, kinectRes.y);
+	rabbitNavigation.setup(kinectRes.x, kinectRes.y);
+	fish.setup(kinectRes.x, kinectRes.y, kinectROI);
+	fish.setNavigationField(&fishNavigation);
+	
+	// Fixed simulation steps, at the frame rate
+	simulationSeed = ofGetSystemTimeMicros();
+	nextRabbitSerial = 0;
+	spawnRandom.setSeed(simulationSeed, std::numeric_limits<uint64_t>::max()); // The animals count their streams from 0
+	fish.setSeed(simulationSeed);
+	simulationTimeStep = 1/60.0;
+	maxStepsPerFrame = 4;
+	simulationLag = 0;
+	recordingPath = "settings/simulationRecording.bin";
+	replayFinished = false;
+	
 	fboVehicles.allocate(projRes.x, projRes.y, GL_RGBA);
 	fboVehicles.begin();
 	ofClear(0,0,0,255);
 	fboVehicles.end();
+	vehiclesDirty = false;
 	
 	setupGui();
 
@@ -58,15 +81,16 @@ void ofApp::setup() {
 void ofApp::addNewFish(){
     ofVec2f location;
     setRandomVehicleLocation(kinectROI, true, location);
-    auto f = Fish(kinectProjector, location, kinectROI, motherFish);
-    f.setup();
-    fish.push_back(f);
+    fish.add(location);
+    simulationReplay.recordAdd(location);
 }
 
 void ofApp::addNewRabbit(){
     ofVec2f location;
     setRandomVehicleLocation(kinectROI, false, location);
     auto r = Rabbit(kinectProjector, location, kinectROI, motherRabbit);
+    r.setNavigationField(&rabbitNavigation);
+    r.setRandomSeed(simulationSeed, nextRabbitSerial++);
     r.setup();
     rabbits.push_back(r);
 }
@@ -85,9 +109,11 @@ bool ofApp::addMotherFish(){
     
     // Set the mother Fish plateform location under the sea level
     motherFish.z = kinectProjector->elevationToKinectDepth(-10, motherFish.x, motherFish.y);
-    for (auto & f : fish){
-        f.setMotherLocation(motherFish);
-    }
+    fish.setMotherLocation(motherFish);
+    simulationReplay.recordMotherLocation(motherFish);
+    // The fish find their mother within 10 pixels
+    fishNavigation.setTarget(motherFish, true, 10);
+    simulationReplay.recordTarget(motherFish, true, 10);
     showMotherFish = true;
     return true;
 }
@@ -110,6 +136,7 @@ bool ofApp::addMotherRabbit(){
     for (auto & r: rabbits){
         r.setMotherLocation(motherRabbit);
     }
+    rabbitNavigation.setTarget(motherRabbit, false, 10);
     showMotherRabbit = true;
     return true;
 }
@@ -120,10 +147,12 @@ bool ofApp::setRandomVehicleLocation(ofRectangle area, bool liveInWater, ofVec2f
     int maxCount = 100;
     while (!okwater && count < maxCount) {
         count++;
-        float x = ofRandom(area.getLeft(),area.getRight());
-        float y = ofRandom(area.getTop(),area.getBottom());
-        bool insideWater = kinectProjector->elevationAtKinectCoord(x, y) < 0;
-        if ((insideWater && liveInWater) || (!insideWater && !liveInWater)){
+        float x = spawnRandom.uniform(area.getLeft(),area.getRight());
+        float y = spawnRandom.uniform(area.getTop(),area.getBottom());
+        // Puddles are too small for the fish but still wet for the rabbits
+        const LakeDetector::Lake* lake = lakeDetector.getLakeAt(x, y);
+        bool okLocation = liveInWater ? lake != NULL && lake->area >= minFishLakeArea : lake == NULL;
+        if (okLocation){
             location = ofVec2f(x, y);
             okwater = true;
         }
@@ -131,30 +160,117 @@ bool ofApp::setRandomVehicleLocation(ofRectangle area, bool liveInWater, ofVec2f
     return okwater;
 }
 
+void ofApp::updateLakes(){
+    // Only the tiles where the depth changed are labelled again
+    if (kinectProjector->isBasePlaneUpdated() || kinectProjector->isROIUpdated()){
+        float cellSize = kinectProjector->kinectPixelSizeOnSand();
+        if (cellSize > 0)
+            lakeDetector.setCellSize(cellSize);
+        lakeDetector.update(kinectProjector->getElevationPixels());
+    } else if (kinectProjector->isDepthFrameUpdated()){
+        lakeDetector.update(kinectProjector->getElevationPixels(), &kinectProjector->getChangedDepthTiles());
+    }
+}
+
+void ofApp::updateNavigation(){
+    // The fields of the shown mothers, in parallel, only on the tiles where the depth changed
+    bool fullUpdate = kinectProjector->isBasePlaneUpdated() || kinectProjector->isROIUpdated();
+    bool terrainChanged = fullUpdate || kinectProjector->isDepthFrameUpdated();
+    vector<NavigationField*> fields;
+    if (showMotherFish && (terrainChanged || fishNavigation.needsFullUpdate()))
+        fields.push_back(&fishNavigation);
+    if (showMotherRabbit && (terrainChanged || rabbitNavigation.needsFullUpdate()))
+        fields.push_back(&rabbitNavigation);
+    if (fields.empty())
+        return;
+    const vector<unsigned char>* changedTiles = fullUpdate ? NULL : &kinectProjector->getChangedDepthTiles();
+    if (fields[0] == &fishNavigation)
+        simulationReplay.recordNavigationUpdate(kinectProjector->getElevationPixels(), changedTiles);
+    NavigationField::updateAll(fields, kinectProjector->getElevationPixels(), changedTiles, kinectProjector->getDepthTileSize());
+}
+
+void ofApp::startRecording(){
+    // The fish start again from a new seed, with a new navigation field, so that the replay can start from scratch
+    simulationSeed = ofGetSystemTimeMicros();
+    simulationReplay.startRecording(simulationSeed, kinectRes.x, kinectRes.y, kinectProjector->getDepthTileSize(), kinectROI);
+    spawnRandom.setSeed(simulationSeed, std::numeric_limits<uint64_t>::max());
+    int numFish = fish.size();
+    fish.clear();
+    fish.setSeed(simulationSeed);
+    fishNavigation.setup(kinectRes.x, kinectRes.y);
+    if (showMotherFish){
+        fish.setMotherLocation(motherFish);
+        simulationReplay.recordMotherLocation(motherFish);
+        fishNavigation.setTarget(motherFish, true, 10);
+        simulationReplay.recordTarget(motherFish, true, 10);
+    }
+    for (int i = 0; i < numFish; i++)
+        addNewFish();
+}
+
 void ofApp::update() {
+    // The fish step started by the previous update reads the terrain, it ends before the terrain changes
+    fish.finishStep();
+    if (simulationReplay.isRecording())
+        simulationReplay.recordStateHash(fish.getStateHash());
+    if (replayThread.joinable() && replayFinished) // The replay logged its result
+        replayThread.join();
+
     // Call kinectProjector->update() first during the update function()
 	kinectProjector->update();
     
 	sandSurfaceRenderer->update();
+	updateLakes();
+	updateNavigation();
     
-    if (kinectProjector->isROIUpdated())
+    if (kinectProjector->isROIUpdated()){
         kinectROI = kinectProjector->getKinectROI();
+        fish.setBorders(kinectROI);
+        simulationReplay.recordBorders(kinectROI);
+        vehiclesDirty = true;
+    }
+    // The mothers platforms follow the sand
+    if ((showMotherFish || showMotherRabbit) && (kinectProjector->isDepthFrameUpdated() || kinectProjector->isCalibrationUpdated()))
+        vehiclesDirty = true;
 
+	int numSteps = 0;
 	if (kinectProjector->isImageStabilized()) {
-	    for (auto & f : fish){
-	        f.applyBehaviours(showMotherFish);
-	        f.update();
+	    // Fixed steps: as many as the time elapsed since the last frame allows, independent of the frame rate
+	    simulationLag += ofGetLastFrameTime();
+	    numSteps = min(maxStepsPerFrame, static_cast<int>(simulationLag/simulationTimeStep));
+	    simulationLag = numSteps == maxStepsPerFrame ? 0 : simulationLag-numSteps*simulationTimeStep;
+	    for (int step = 0; step < numSteps; step++){
+	        for (auto & r : rabbits){
+	            r.applyBehaviours(showMotherRabbit);
+	            r.update();
+	        }
 	    }
-	    for (auto & r : rabbits){
-	        r.applyBehaviours(showMotherRabbit);
-	        r.update();
+	    // Moving animals need a new frame, an empty scene is only redrawn when it changed
+	    if (!fish.empty() || !rabbits.empty())
+	        vehiclesDirty = true;
+	    if (vehiclesDirty){
+	        drawVehicles();
+	        vehiclesDirty = false;
 	    }
-	    drawVehicles();
 	}
 	gui->update();
+
+	// The last fish step of the frame runs on its threads while the frame is drawn
+	if (numSteps > 0){
+	    const ShoreDistanceField & shore = kinectProjector->getShoreDistanceField();
+	    simulationReplay.recordSteps(kinectProjector->getElevationPixels(), numSteps, showMotherFish);
+	    for (int step = 1; step < numSteps; step++)
+	        fish.step(shore, showMotherFish);
+	    fish.startStep(shore, showMotherFish);
+	}
 }
 
 
+void ofApp::exit() {
+    if (replayThread.joinable())
+        replayThread.join();
+}
+
 void ofApp::draw() {
 	sandSurfaceRenderer->drawMainWindow(300, 30, 600, 450);//400, 20, 400, 300);
 	fboVehicles.draw(300, 30, 600, 450);
@@ -179,9 +295,9 @@ void ofApp::drawVehicles()
         drawMotherFish();
     if (showMotherRabbit)
         drawMotherRabbit();
-    for (auto & f : fish){
-        f.draw();
-    }
+    fish.draw([this](float x, float y){
+        return kinectProjector->kinectCoordToProjCoord(x, y);
+    });
     for (auto & r : rabbits){
         r.draw();
     }
@@ -322,11 +438,13 @@ void ofApp::dragEvent(ofDragInfo dragInfo) {
 void ofApp::setupGui(){
     // instantiate and position the gui //
     gui = new ofxDatGui();
-    gui->addSlider("# of fish", 0, 10, fish.size())->setPrecision(0);
+    gui->addSlider("# of fish", 0, 2000, fish.size())->setPrecision(0);
     gui->addSlider("# of rabbits", 0, 10, rabbits.size())->setPrecision(0);
     gui->addToggle("Mother fish", showMotherFish);
     gui->addToggle("Mother rabbit", showMotherRabbit);
     gui->addButton("Remove all animals");
+    gui->addToggle("Record fish simulation", false); // The rabbits are not recorded
+    gui->addButton("Replay fish recording");
     gui->addBreak();
     gui->addHeader(":: Game ::", false);
 
@@ -340,25 +458,48 @@ void ofApp::setupGui(){
 }
 
 void ofApp::onButtonEvent(ofxDatGuiButtonEvent e){
+    vehiclesDirty = true;
     if (e.target->is("Remove all animals")) {
         fish.clear();
+        simulationReplay.recordClear();
         rabbits.clear();
         showMotherFish = false;
         showMotherRabbit = false;
+        fishNavigation.clearTarget();
+        simulationReplay.recordClearTarget();
+        rabbitNavigation.clearTarget();
         gui->getSlider("# of fish")->setValue(0);
         gui->getSlider("# of rabbits")->setValue(0);
         gui->getToggle("Mother fish")->setChecked(false);
         gui->getToggle("Mother rabbit")->setChecked(false);
+    } else if (e.target->is("Replay fish recording")) {
+        if (replayThread.joinable()){
+            ofLogNotice("ofApp") << "onButtonEvent(): The previous replay is still running";
+            return;
+        }
+        if (simulationReplay.isRecording()){
+            simulationReplay.stopRecording(recordingPath);
+            gui->getToggle("Record fish simulation")->setChecked(false);
+        }
+        // In the background: the app keeps running, the replay timings are only indicative meanwhile
+        replayFinished = false;
+        replayThread = std::thread([this](){
+            SimulationReplay::replay(recordingPath);
+            replayFinished = true;
+        });
     }
 }
 
 void ofApp::onToggleEvent(ofxDatGuiToggleEvent e){
+    vehiclesDirty = true;
     if (e.target->is("Mother fish")) {
         if (!showMotherFish) {
             if (!addMotherFish())
                 e.target->setChecked(false);
         } else {
             showMotherFish = e.checked;
+            fishNavigation.clearTarget();
+            simulationReplay.recordClearTarget();
         }
     } else if (e.target->is("Mother rabbit")) {
         if (!showMotherRabbit) {
@@ -366,11 +507,18 @@ void ofApp::onToggleEvent(ofxDatGuiToggleEvent e){
                 e.target->setChecked(false);
         } else {
             showMotherRabbit = e.checked;
+            rabbitNavigation.clearTarget();
         }
+    } else if (e.target->is("Record fish simulation")) {
+        if (e.checked)
+            startRecording();
+        else if (simulationReplay.stopRecording(recordingPath))
+            ofLogNotice("ofApp") << "onToggleEvent(): " << simulationReplay.getNumRecordedFrames() << " frames recorded to " << recordingPath;
     }
 }
 
 void ofApp::onSliderEvent(ofxDatGuiSliderEvent e){
+    vehiclesDirty = true;
     if (e.target->is("# of fish")) {
         if (e.value > fish.size())
             while (e.value > fish.size()){
@@ -379,6 +527,7 @@ void ofApp::onSliderEvent(ofxDatGuiSliderEvent e){
         if (e.value < fish.size())
             while (e.value < fish.size()){
                 fish.pop_back();
+                simulationReplay.recordPopBack();
             }
 
     } else if (e.target->is("# of rabbits")) {
@@ -26,6 +26,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #include "KinectProjector/KinectProjector.h"
 #include "SandSurfaceRenderer/SandSurfaceRenderer.h"
 #include "vehicle.h"
+#include "FishSchool.h"
+#include "LakeDetector.h"
+#include "NavigationField.h"
+#include "SimulationReplay.h"
+#include "AgentRandom.h"
+#include <thread>
+#include <atomic>
 
 class ofApp : public ofBaseApp {
 
@@ -37,8 +44,12 @@ public:
 	bool addMotherFish();
 	bool addMotherRabbit();
 	bool setRandomVehicleLocation(ofRectangle area, bool liveInWater, ofVec2f & location);
+	void updateLakes();
+	void updateNavigation();
+	void startRecording();
 
 	void update();
+	void exit();
 
 	void draw();
 	void drawProjWindow(ofEventArgs& args);
@@ -74,11 +85,16 @@ private:
 	ofVec2f kinectRes;
 	ofRectangle kinectROI;
 	
+	// Lakes: connected water bodies, fish only live in the large ones
+	LakeDetector lakeDetector;
+	int minFishLakeArea; // Cells
+	
 	// FBos
 	ofFbo fboVehicles;
+	bool vehiclesDirty; // fboVehicles has to be drawn again
 
 	// Fish and Rabbits
-	vector<Fish> fish;
+	FishSchool fish;
 	vector<Rabbit> rabbits;
 	int fishNum;
 	int rabbitsNum;
@@ -89,8 +105,21 @@ private:
 	bool showMotherFish;
 	bool showMotherRabbit;
 	float motherPlatformSize;
+	NavigationField fishNavigation, rabbitNavigation; // Shortest paths to the mothers
 	bool waitingToInitialiseVehicles;
 	
+	// Simulation: fixed steps, each animal draws from its own random stream
+	uint64_t simulationSeed;
+	uint64_t nextRabbitSerial; // Random stream of the next rabbit
+	AgentRandom spawnRandom; // Locations of the new animals and of the mothers
+	float simulationTimeStep; // s
+	int maxStepsPerFrame; // Below, the simulation slows down
+	double simulationLag; // Time not simulated yet (s)
+	SimulationReplay simulationReplay; // Fish only, the rabbits are not recorded
+	string recordingPath;
+	std::thread replayThread; // The replay runs in the background, joined by update() when finished
+	std::atomic<bool> replayFinished;
+	
 	// GUI
 	ofxDatGui* gui;
 };
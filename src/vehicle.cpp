@@ -32,28 +32,24 @@ Vehicle::Vehicle(std::shared_ptr<KinectProjector> const& k, ofPoint slocation, o
     wandertheta = 0;
     mother = false;
     motherLocation = smotherLocation;
+    navigationField = NULL;
 }
 
 void Vehicle::updateBeachDetection(){
-    // Find sandbox gradients and elevations in the next 10 steps of vehicle v, update vehicle variables
-    ofPoint futureLocation;
-    futureLocation = location;
+    // Distance to the shore inside of the vehicle medium and direction away from the shore,
+    // the beach is near when the vehicle can reach it in less than 10 steps in any direction
+    float shoreDistance = kinectProjector->shoreDistanceAtKinectCoord(location.x, location.y);
+    ofVec2f escapeDirection = kinectProjector->shoreGradientAtKinectCoord(location.x, location.y);
+    if (liveInWater){
+        shoreDistance *= -1;
+        escapeDirection *= -1;
+    }
+    float speed = velocity.length();
+    beach = shoreDistance < 0 || shoreDistance < 9*speed;
     beachSlope = ofVec2f(0);
-    beach = false;
-    int i = 1;
-    while (i < 10 && !beach)
-    {
-        bool overwater = kinectProjector->elevationAtKinectCoord(futureLocation.x, futureLocation.y) > 0;
-        if ((overwater && liveInWater) || (!overwater && !liveInWater))
-        {
-            beach = true;
-            beachDist = i;
-            beachSlope = kinectProjector->gradientAtKinectCoord(futureLocation.x,futureLocation.y);
-            if (liveInWater)
-                beachSlope *= -1;
-        }
-        futureLocation += velocity; // Go to next future location step
-        i++;
+    if (beach){
+        beachDist = shoreDistance > 0 ? 1+shoreDistance/speed : 1; // In steps
+        beachSlope = escapeDirection;
     }
 }
 
@@ -92,7 +88,7 @@ ofPoint Vehicle::wanderEffect(){
     
     ofPoint velocityChange, desired;
     
-    wandertheta += ofRandom(-change,change);     // Randomly change wander theta
+    wandertheta += random.uniform(-change,change);     // Randomly change wander theta
     
     ofPoint front = velocity;
     front.normalize();
@@ -134,6 +130,10 @@ ofPoint Vehicle::seekEffect(){
     desired = motherLocation - location;
     
     float d = desired.length();
+    // Around the islands and along the channels dug to the mother, from anywhere she can be reached
+    bool navigating = d >= 10 && navigationField != NULL && navigationField->isReachable(location.x, location.y);
+    if (navigating)
+        desired = navigationField->getDirection(location.x, location.y);
     desired.normalize();
     
     //If we are closer than XX pixels slow down
@@ -149,8 +149,8 @@ ofPoint Vehicle::seekEffect(){
     velocityChange = desired - velocity;
     velocityChange.limit(maxVelocityChange);
     
-    //If we are further than XX pixels we don't see the mother
-    if (d > 100) {
+    //If we are further than XX pixels we don't see the mother, unless we know the way
+    if (d > 100 && !navigating) {
         velocityChange = ofPoint(0);
     }
     
@@ -220,138 +220,6 @@ void Vehicle::update(){
 }
 
 
-//==============================================================
-// Derived class Fish
-//==============================================================
-
-void Fish::setup(){
-    minborderDist = 50;
-    internalBorders = borders;
-    internalBorders.scaleFromCenter((borders.width-minborderDist)/borders.width, (borders.height-minborderDist)/borders.height);
-    
-    wanderR = 10;         // Radius for our "wander circle"
-    wanderD = 80;         // Distance for our "wander circle"
-    change = 0.3;
-    
-    r = 12;
-    desiredseparation = 24;
-    maxVelocityChange = 1;
-    maxRotation = 30;
-    topSpeed =2;
-}
-
-ofPoint Fish::wanderEffect(){
-    
-    ofPoint velocityChange, desired;
-    
-    wandertheta += ofRandom(-change,change);     // Randomly change wander theta
-    
-    ofPoint front = velocity;
-    front.normalize();
-    front *= wanderD;
-    ofPoint circleloc = location + front;
-    
-    float h = ofRadToDeg(atan2(front.y,front.x)); // Signed angle
-    
-    ofPoint circleOffSet = ofPoint(wanderR*cos(wandertheta+h),wanderR*sin(wandertheta+h));
-    ofPoint target = circleloc + circleOffSet;
-    
-    desired = target - location;
-    desired.normalize();
-    desired *= topSpeed;
-    
-    velocityChange = desired - velocity;
-    velocityChange.limit(maxVelocityChange);
-    
-    return velocityChange;
-}
-
-void Fish::applyBehaviours(bool seekMother){
-    updateBeachDetection();
-    
-    //    separateF = separateEffect(vehicles);
-    seekF = ofVec2f(0);
-    if (seekMother)
-        seekF = seekEffect();
-    bordersF = bordersEffect();
-    slopesF = slopesEffect();
-    wanderF = wanderEffect();
-    
-    //    separateF*=1;//2;
-    seekF *= 1;
-    bordersF *=2;
-    slopesF *= 2;//2;
-    wanderF *= 0.8;
-    
-    if (beach){
-        applyVelocityChange(slopesF);
-    }
-    if (border){
-        applyVelocityChange(bordersF);
-    }
-    //    applyVelocityChange(separateF);
-    if (seekF.lengthSquared() == 0){
-        applyVelocityChange(wanderF);
-    } else {
-        applyVelocityChange(seekF);
-    }
-    //    currentForce = separateF+seekF+bordersF+slopesF;
-}
-
-void Fish::draw()
-{
-    ofPushMatrix();
-    ofTranslate(projectorCoord);
-    ofRotate(angle);
-    
-    // Compute tail angle
-    float nv = 0.5;//velocity.lengthSquared()/10; // Tail movement amplitude
-    float fact = 50+250*velocity.length()/topSpeed;
-    float tailangle = nv/25 * (abs(((int)(ofGetElapsedTimef()*fact) % 100) - 50)-25);
-    
-    // Color of the fish
-    nv = 255;
-    fact = 50;
-    float hsb = nv/50 * (abs(((int)(ofGetElapsedTimef()*fact) % 100) - 50));
-    
-    // Fish scale
-    float sc = 7;
-    float tailSize = 1*sc;
-    float fishLength = 2*sc;
-    float fishHead = tailSize;
-    
-    ofPolyline fish;
-    fish.curveTo( ofPoint(-fishLength-tailSize*cos(tailangle+0.8), tailSize*sin(tailangle+0.8)));
-    fish.curveTo( ofPoint(-fishLength-tailSize*cos(tailangle+0.8), tailSize*sin(tailangle+0.8)));
-    fish.curveTo( ofPoint(-fishLength, 0));
-    fish.curveTo( ofPoint(0, -fishHead));
-    fish.curveTo( ofPoint(fishHead, 0));
-    fish.curveTo( ofPoint(0, fishHead));
-    fish.curveTo( ofPoint(-fishLength, 0));
-    fish.curveTo( ofPoint(-fishLength-tailSize*cos(tailangle-0.8), tailSize*sin(tailangle-0.8)));
-    fish.curveTo( ofPoint(-fishLength-tailSize*cos(tailangle-0.8), tailSize*sin(tailangle-0.8)));
-    fish.close();
-    ofSetLineWidth(2.0);
-    ofColor c = ofColor(255);
-    ofSetColor(c);
-    if (mother)
-    {
-        c.setHsb((int)hsb, 255, 255); // rainbow
-        ofFill();
-    } else {
-        ofNoFill();
-    }
-    fish.draw();
-    if (mother)
-    {
-        c.setHsb(255-(int)hsb, 255, 255); // rainbow
-        ofSetColor(c);
-    }
-    ofDrawCircle(0, 0, sc*0.5);
-    ofNoFill();
-    ofPopMatrix();
-}
-
 //==============================================================
 // Derived class Rabbit
 //==============================================================
@@ -383,7 +251,7 @@ ofPoint Rabbit::wanderEffect(){
     
     ofPoint velocityChange, desired;
     
-    wandertheta = ofRandom(-change,change);     // Randomly change wander theta
+    wandertheta = random.uniform(-change,change);     // Randomly change wander theta
     
     float currDir = ofDegToRad(angle);
     ofPoint front = ofVec2f(cos(currDir), sin(currDir));
@@ -475,7 +343,7 @@ void Rabbit::applyBehaviours(bool seekMother){
                 velocity = ofPoint(0);
                 setWait = true;
                 waitCounter = 0;
-                waitTime = ofRandom(minWaitingTime, maxWaitingTime);
+                waitTime = random.uniform(minWaitingTime, maxWaitingTime);
                 if (beach)
                     waitTime = 0;
             }
@@ -25,6 +25,8 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #include "ofxCv.h"
 
 #include "KinectProjector/KinectProjector.h"
+#include "NavigationField.h"
+#include "AgentRandom.h"
 
 class Vehicle{
 
@@ -59,6 +61,15 @@ public:
         motherLocation = loc;
     }
     
+    void setNavigationField(const NavigationField* field){
+        navigationField = field;
+    }
+    
+    // Own random stream: the vehicle does not depend on the others nor on the global generator
+    void setRandomSeed(uint64_t seed, uint64_t stream){
+        random.setSeed(seed, stream);
+    }
+    
 protected:
     void updateBeachDetection();
     ofPoint seekEffect();
@@ -86,6 +97,7 @@ protected:
     
     bool mother;
     ofVec2f motherLocation;
+    const NavigationField* navigationField; // Shortest paths to the mother, NULL: straight line
     
     // For slope effect
     float beachDist;
@@ -104,18 +116,8 @@ protected:
     float change ;
     float wandertheta;
     float topSpeed;
-};
-
-class Fish : public Vehicle {
-public:
-    Fish(std::shared_ptr<KinectProjector> const& k, ofPoint slocation, ofRectangle sborders, ofVec2f motherLocation) : Vehicle(k, slocation, sborders, true, motherLocation){}
-
-    void setup();
-    void applyBehaviours(bool seekMother);
-    void draw();
     
-private:
-    ofPoint wanderEffect();
+    AgentRandom random;
 };
 
 class Rabbit : public Vehicle {
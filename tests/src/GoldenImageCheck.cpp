@@ -0,0 +1,257 @@
+/***********************************************************************
+GoldenImageCheck - GoldenImageCheck renders synthetic sand scenes with
+the CPU renderer and compares them with stored golden images to detect
+color mapping, contour line and performance regressions.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "GoldenImageCheck.h"
+#include "Checks.h"
+#include "../../src/SandSurfaceRenderer/ColorMap.h"
+
+namespace {
+    const int kinectWidth = 640;
+    const int kinectHeight = 480;
+    const float baseDepth = 1000; // Distance from the kinect to the base plane in mm
+    const char* sceneNames[] = {"flat", "slope", "cone", "hills", "hills_no_contours", "hills_roi"};
+}
+
+GoldenImageCheck::GoldenImageCheck()
+:projResX(640),
+projResY(480),
+maxColorDistance(30),
+maxFailedFraction(0.002),
+maxSlowdown(1.5),
+numTimedRenders(5)
+{
+}
+
+void GoldenImageCheck::setup(string sgoldenPath, string scolorMapFile, int sprojResX, int sprojResY){
+    goldenPath = sgoldenPath;
+    colorMapFile = scolorMapFile;
+    projResX = sprojResX;
+    projResY = sprojResY;
+    renderer.setup(projResX, projResY, 1);
+}
+
+int GoldenImageCheck::getNumScenes(){
+    return sizeof(sceneNames)/sizeof(sceneNames[0]);
+}
+
+string GoldenImageCheck::getSceneName(int index){
+    return sceneNames[index];
+}
+
+void GoldenImageCheck::makeScene(int index, ofFloatPixels & depth, CpuSandRenderer::Parameters & parameters) const{
+    // Sand height in mm above the base plane, seen by a kinect looking straight down
+    depth.allocate(kinectWidth, kinectHeight, 1);
+    float* depthPtr = depth.getData();
+    for (int y = 0; y < kinectHeight; y++){
+        for (int x = 0; x < kinectWidth; x++, depthPtr++){
+            float h = 0;
+            float r = ofVec2f(x-320, y-240).length();
+            if (index == 1) // slope
+                h = -150+300.0f*x/kinectWidth;
+            else if (index == 2) // cone
+                h = max(0.0f, 180-r);
+            else if (index >= 3) // hills
+                h = 80*sin(x/45.0f)*cos(y/60.0f)+40*sin((x+y)/23.0f)-30;
+            *depthPtr = baseDepth-h;
+        }
+    }
+
+    // Kinect pinhole model (f = 580 px) and a projector with the same point of view
+    parameters.kinectWorldMatrix = ofMatrix4x4(1/580.0f, 0, 0, -320/580.0f,
+                                               0, 1/580.0f, 0, -240/580.0f,
+                                               0, 0, 0, 1,
+                                               0, 0, 0, 1);
+    float f = 560.0f*projResX/640;
+    parameters.kinectProjMatrix = ofMatrix4x4(f, 0, projResX/2.0f, 0,
+                                              0, f, projResY/2.0f, 0,
+                                              0, 0, 1, 0,
+                                              0, 0, 0, 1);
+    parameters.basePlaneEq = ofVec4f(0, 0, 1, -baseDepth);
+    parameters.drawContourLines = index != 4;
+    parameters.contourLineDistance = 10;
+    parameters.kinectROI = index == 5 ? ofRectangle(40, 30, 560, 420) : ofRectangle(0, 0, kinectWidth, kinectHeight);
+}
+
+float GoldenImageCheck::colorDistance(const unsigned char* c1, const unsigned char* c2){
+    // "Redmean" weighted euclidean distance, a cheap approximation of perceived color difference
+    float rmean = (c1[0]+c2[0])/2.0f;
+    float dr = c1[0]-c2[0];
+    float dg = c1[1]-c2[1];
+    float db = c1[2]-c2[2];
+    return sqrt((2+rmean/256)*dr*dr+4*dg*dg+(2+(255-rmean)/256)*db*db);
+}
+
+float GoldenImageCheck::compare(const ofPixels & image, const ofPixels & golden) const{
+    if (image.getWidth() != golden.getWidth() || image.getHeight() != golden.getHeight())
+        return 1;
+    int size = image.getWidth()*image.getHeight();
+    int imageChannels = image.getNumChannels();
+    int goldenChannels = golden.getNumChannels();
+    const unsigned char* imagePtr = image.getData();
+    const unsigned char* goldenPtr = golden.getData();
+    int numFailed = 0;
+    for (int i = 0; i < size; i++, imagePtr += imageChannels, goldenPtr += goldenChannels)
+        if (colorDistance(imagePtr, goldenPtr) > maxColorDistance)
+            numFailed++;
+    return static_cast<float>(numFailed)/size;
+}
+
+float GoldenImageCheck::timeReferenceWork(){
+    // Same kind of work as the shading pass: buffer reads, float math,
+    // table lookups and RGBA writes over the projector image
+    int size = projResX*projResY;
+    vector<float> values(size);
+    for (int i = 0; i < size; i++)
+        values[i] = (i*7919%1000)/1000.0f;
+    vector<uint32_t> lut(1024);
+    for (int i = 0; i < 1024; i++)
+        lut[i] = 0xff000000 | ((i*2654435761u) >> 8);
+    vector<uint32_t> pixels(size, 0);
+    float time = 0;
+    for (int j = 0; j < numTimedRenders; j++){
+        uint64_t start = ofGetElapsedTimeMicros();
+        for (int pass = 0; pass < 32; pass++)
+            for (int i = 1; i < size; i++)
+                pixels[i] = lut[static_cast<int>((values[i]*0.75f+values[i-1]*0.25f)*1023)]^(pixels[i-1]&0xff);
+        float runTime = (ofGetElapsedTimeMicros()-start)/1000.0f;
+        time = j == 0 ? runTime : min(time, runTime);
+    }
+    volatile uint32_t sink = pixels.back(); // Keep the work from being optimised away
+    (void)sink;
+    return time;
+}
+
+vector<GoldenImageCheck::Result> GoldenImageCheck::run(bool record){
+    vector<Result> results;
+    ColorMap colorMap;
+    if (!colorMap.loadFile(colorMapFile)){
+        ofLogError("GoldenImageCheck") << "run(): color map " << colorMapFile << " could not be loaded";
+        return results;
+    }
+    renderer.setColorMap(colorMap.getPixels());
+
+    // Same conversions as the SandSurfaceRenderer
+    float elevationMin = -colorMap.getScalarRangeMin();
+    float elevationMax = -colorMap.getScalarRangeMax();
+    float heightMapScale = (colorMap.getNumEntries()-1)/(elevationMax-elevationMin);
+    float heightMapOffset = 0.5/colorMap.getNumEntries()-heightMapScale*elevationMin;
+
+    if (record)
+        ofDirectory::createDirectory(goldenPath, true, true);
+    ofXml timings;
+    if (record || !timings.load(goldenPath+"timings.xml")) // Recorded from scratch, or missing times fail below
+        timings.addChild("TIMINGS");
+    timings.setTo("TIMINGS");
+    float referenceTime = timeReferenceWork();
+    ofLogNotice("GoldenImageCheck") << "run(): reference workload: " << referenceTime << " ms";
+
+    for (int i = 0; i < getNumScenes(); i++){
+        Result result;
+        result.name = getSceneName(i);
+        result.recorded = false;
+        ofFloatPixels depth;
+        CpuSandRenderer::Parameters parameters;
+        makeScene(i, depth, parameters);
+        parameters.heightMapScale = heightMapScale;
+        parameters.heightMapOffset = heightMapOffset;
+        parameters.elevationMin = elevationMin;
+        parameters.elevationMax = elevationMax;
+        parameters.depthMin = min(baseDepth+elevationMin, baseDepth+elevationMax);
+        parameters.depthMax = max(baseDepth+elevationMin, baseDepth+elevationMax);
+
+        ofPixels image;
+        renderer.render(depth, parameters, image); // Warm up
+        for (int j = 0; j < numTimedRenders; j++){
+            uint64_t start = ofGetElapsedTimeMicros();
+            renderer.render(depth, parameters, image);
+            float renderTime = (ofGetElapsedTimeMicros()-start)/1000.0f;
+            result.renderTime = j == 0 ? renderTime : min(result.renderTime, renderTime);
+        }
+        result.relativeTime = result.renderTime/referenceTime;
+
+        string goldenFile = goldenPath+result.name+".png";
+        ofPixels golden;
+        if (record){
+            ofSaveImage(image, goldenFile);
+            result.recorded = ofLoadImage(golden, goldenFile); // Read back to check the written file
+            result.failedFraction = result.recorded ? compare(image, golden) : 1;
+            result.passed = result.failedFraction == 0;
+            if (!result.recorded)
+                ofLogError("GoldenImageCheck") << "run(): " << goldenFile << " could not be written";
+        } else if (ofLoadImage(golden, goldenFile)){
+            result.failedFraction = compare(image, golden);
+            result.passed = result.failedFraction <= maxFailedFraction;
+        } else {
+            ofLogError("GoldenImageCheck") << "run(): golden image " << goldenFile << " is missing, it is only written when recording";
+            result.failedFraction = 1;
+            result.passed = false;
+        }
+
+        if (record){
+            timings.addValue(result.name, result.relativeTime);
+            result.recordedRelativeTime = result.relativeTime;
+        } else {
+            result.recordedRelativeTime = timings.getValue<float>(result.name, 0);
+            if (result.recordedRelativeTime <= 0){
+                ofLogError("GoldenImageCheck") << "run(): no recorded render time for " << result.name << " in " << goldenPath << "timings.xml";
+                result.passed = false;
+            } else if (result.relativeTime > result.recordedRelativeTime*maxSlowdown){
+                ofLogError("GoldenImageCheck") << "run(): " << result.name << " renders " << result.relativeTime/result.recordedRelativeTime
+                    << " times slower than recorded (limit " << maxSlowdown << ")";
+                result.passed = false;
+            }
+        }
+
+        ofLogNotice("GoldenImageCheck") << "run(): " << result.name << ": " << (result.recorded ? "RECORDED" : (result.passed ? "PASSED" : "FAILED"))
+            << " differing pixels: " << result.failedFraction*100 << "% render time: " << result.renderTime << " ms ("
+            << result.relativeTime << " x reference, recorded " << result.recordedRelativeTime << ")";
+        results.push_back(result);
+    }
+    if (record && !timings.save(goldenPath+"timings.xml")){
+        ofLogError("GoldenImageCheck") << "run(): " << goldenPath << "timings.xml could not be written";
+        for (auto & result : results)
+            result.passed = false;
+    }
+    return results;
+}
+
+bool GoldenImageCheck::allPassed(const vector<Result> & results){
+    if (results.empty())
+        return false;
+    for (auto & result : results)
+        if (!result.passed)
+            return false;
+    return true;
+}
+
+// Arguments: [--record], writes the golden images instead of comparing with them
+bool checkGoldenImages(const vector<string> & args){
+    bool record = !args.empty() && args[0] == "--record";
+    if (args.size() > (record ? 1 : 0)){
+        ofLogError("checkGoldenImages") << "Invalid arguments";
+        return false;
+    }
+    GoldenImageCheck check;
+    check.setup();
+    return GoldenImageCheck::allPassed(check.run(record));
+}
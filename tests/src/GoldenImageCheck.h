@@ -0,0 +1,79 @@
+/***********************************************************************
+GoldenImageCheck - GoldenImageCheck renders synthetic sand scenes with
+the CPU renderer and compares them with stored golden images to detect
+color mapping, contour line and performance regressions.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include "../../src/SandSurfaceRenderer/CpuSandRenderer.h"
+
+// Scenes are generated procedurally (no kinect nor calibration needed) and
+// rendered with a fixed color map file stored with the golden images. A
+// missing golden image fails the check: the golden images are only written
+// when recording. Render times are stored as ratios to a fixed reference
+// workload timed in the same run, so that the budgets recorded on one
+// machine hold on another one (single threaded to not depend on the cores).
+class GoldenImageCheck {
+public:
+    struct Result {
+        string name;
+        bool passed;
+        bool recorded; // The rendered image was stored as the golden image
+        float renderTime; // ms, best of several renders (the least disturbed by the other processes)
+        float relativeTime; // Render time over the reference workload time
+        float recordedRelativeTime; // Stored with the golden image, 0 if missing
+        float failedFraction; // Fraction of pixels over the perceptual tolerance
+    };
+
+    GoldenImageCheck();
+
+    void setup(string goldenPath = "goldens/", string colorMapFile = "goldens/HeightColorMap.xml", int projResX = 640, int projResY = 480);
+    void setTolerance(float smaxColorDistance, float smaxFailedFraction){
+        maxColorDistance = smaxColorDistance;
+        maxFailedFraction = smaxFailedFraction;
+    }
+    void setMaxSlowdown(float smaxSlowdown){ // Allowed relative time over the recorded one
+        maxSlowdown = smaxSlowdown;
+    }
+
+    vector<Result> run(bool record = false); // record: (over)write the golden images and times instead of comparing
+    static bool allPassed(const vector<Result> & results);
+
+    static int getNumScenes();
+    static string getSceneName(int index);
+    void makeScene(int index, ofFloatPixels & depth, CpuSandRenderer::Parameters & parameters) const;
+
+    // Fraction of pixels whose perceptual color distance exceeds the tolerance
+    float compare(const ofPixels & image, const ofPixels & golden) const;
+
+private:
+    static float colorDistance(const unsigned char* c1, const unsigned char* c2);
+    float timeReferenceWork(); // ms, best of numTimedRenders runs
+
+    string goldenPath;
+    string colorMapFile;
+    int projResX, projResY;
+    float maxColorDistance; // Weighted RGB ("redmean") distance, 0-765
+    float maxFailedFraction;
+    float maxSlowdown;
+    int numTimedRenders;
+    CpuSandRenderer renderer;
+};
@@ -0,0 +1,66 @@
+/***********************************************************************
+GrayCodeDecodeCheck - Round trip of synthetic kinect captures of the
+structured light patterns through the Gray code decoder.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "Checks.h"
+#include "../../src/KinectProjector/GrayCodeCalibration.h"
+
+bool checkGrayCodeDecode(const vector<string> & args){
+    // The kinect sees the projector image slightly rotated and scaled, the left of its
+    // image is not lit by the projector
+    ofVec2f projRes(1280, 800);
+    ofVec2f kinectRes(640, 480);
+    int numIgnoredBits = 2;
+    auto kinectToProj = [](int x, int y){
+        return ofVec2f(-100+1.9f*x+0.1f*y, 40+1.5f*y-0.05f*x);
+    };
+    GrayCodeCalibration grayCode;
+    grayCode.setup(projRes, kinectRes, numIgnoredBits);
+    for (int i = 0; i < grayCode.getNumPatterns(); i++){
+        ofPixels capture;
+        grayCode.renderSyntheticCapture(i, kinectToProj, capture);
+        grayCode.addCapture(capture);
+    }
+    grayCode.decode();
+
+    // Every lit kinect pixel is decoded to the center of its code cell
+    int numLit = 0;
+    for (int y = 0; y < kinectRes.y; y++)
+        for (int x = 0; x < kinectRes.x; x++){
+            ofVec2f p = kinectToProj(x, y);
+            if (p.x >= 0 && p.x < projRes.x && p.y >= 0 && p.y < projRes.y)
+                numLit++;
+        }
+    float halfStep = (1 << numIgnoredBits)/2.0f;
+    int numWrong = 0;
+    float maxError = 0;
+    for (auto & c : grayCode.getCorrespondences()){
+        ofVec2f error = kinectToProj(c.kinect.x, c.kinect.y)-c.projector;
+        maxError = max(maxError, max(abs(error.x), abs(error.y)));
+        if (abs(error.x) > halfStep || abs(error.y) > halfStep)
+            numWrong++;
+    }
+    int numDecoded = grayCode.getCorrespondences().size();
+    bool passed = numLit > 0 && numDecoded >= 0.99*numLit && numWrong == 0;
+    ofLogNotice("GrayCodeDecodeCheck") << numDecoded << " of " << numLit << " lit kinect pixels decoded, " << numWrong
+        << " wrong, max error " << maxError << " projector pixels";
+    return passed;
+}
@@ -0,0 +1,38 @@
+/***********************************************************************
+WaterBenchmarkCheck - Times the water simulation on a synthetic terrain
+with rain, a spring and a drain.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "Checks.h"
+#include "../../src/SandSurfaceRenderer/WaterSimulation.h"
+
+// Arguments: [width height [frames [threads]]], the kinect image by default
+bool checkWaterBenchmark(const vector<string> & args){
+    int width = args.size() >= 2 ? ofToInt(args[0]) : 640;
+    int height = args.size() >= 2 ? ofToInt(args[1]) : 480;
+    int numFrames = args.size() >= 3 ? ofToInt(args[2]) : 90;
+    int numThreads = args.size() >= 4 ? ofToInt(args[3]) : 0;
+    if (width <= 0 || height <= 0 || numFrames <= 0){
+        ofLogError("checkWaterBenchmark") << "Invalid arguments";
+        return false;
+    }
+    WaterSimulation::BenchmarkResult result = WaterSimulation::benchmark(width, height, numFrames, numThreads);
+    return result.realTime && result.waterVolume > 0;
+}
@@ -0,0 +1,66 @@
+/***********************************************************************
+main.cpp - Runs the Magic Sand checks from the command line.
+Copyright (c) 2016 Thomas Wolf
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "ofMain.h"
+#include "Checks.h"
+
+namespace {
+    struct Check {
+        string name;
+        bool (*run)(const vector<string> & args);
+        string usage;
+        bool timing; // Depends on the machine: only run when named
+    };
+    const Check checks[] = {
+        {"graycode", checkGrayCodeDecode, "graycode: decodes synthetic captures of the calibration patterns", false},
+        {"water-benchmark", checkWaterBenchmark, "water-benchmark [width height [frames [threads]]]: the water simulation keeps up with 30 Hz", true},
+        {"golden", checkGoldenImages, "golden [--record]: the CPU renderer output matches the golden images of synthetic scenes (--record rewrites them)", false},
+    };
+}
+
+// magicSandTests [check [arguments]]: without check, all of them run but the timing ones.
+// The exit code is 0 if every check passed, 1 otherwise (2 for a wrong command line).
+int main(int argc, char* argv[]){
+    ofSetLogLevel(OF_LOG_NOTICE);
+    vector<string> args(argv+1, argv+argc);
+    bool passed = true;
+    if (args.empty()){
+        for (auto & check : checks){
+            if (check.timing)
+                continue;
+            bool checkPassed = check.run(args);
+            ofLogNotice("magicSandTests") << check.name << ": " << (checkPassed ? "PASSED" : "FAILED");
+            passed = passed && checkPassed;
+        }
+        return passed ? 0 : 1;
+    }
+    for (auto & check : checks){
+        if (check.name == args[0]){
+            passed = check.run(vector<string>(args.begin()+1, args.end()));
+            ofLogNotice("magicSandTests") << check.name << ": " << (passed ? "PASSED" : "FAILED");
+            return passed ? 0 : 1;
+        }
+    }
+    ofLogError("magicSandTests") << "Unknown check " << args[0] << ", usage: magicSandTests [check [arguments]] with check:";
+    for (auto & check : checks)
+        ofLogError("magicSandTests") << "  " << check.usage;
+    return 2;
+}